@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# Builds nginx with the module, generates directories with different
+# numbers of entries and kinds of names, and measures listing them: how
+# many requests per second are served, the 99th percentile of latency, the
+# average time spent reading, sorting and rendering (from the
+# $fancyindex_*_time variables) and how much the resident memory of the
+# worker grew during the run.
+#
+# Usage: bench/run.sh NGINX_SRC [SIZE...]
+#
+# Sizes default to 1000 10000 100000 1000000. The environment may set
+# BENCH_DIR (where nginx, the directories and the logs go), PORT, DURATION
+# (of each wrk run), CONNECTIONS, THREADS and QUERIES (the query strings
+# tried on each directory, separated by spaces). See HACKING.md.
+#
+set -e
+# Query strings have question marks, which must not be expanded.
+set -f
+
+if [ $# -lt 1 ] || [ ! -x "$1/configure" ]; then
+    echo "usage: $0 NGINX_SRC [SIZE...]" >&2
+    exit 2
+fi
+
+if ! command -v wrk > /dev/null; then
+    echo "$0: wrk is needed, see https://github.com/wg/wrk" >&2
+    exit 1
+fi
+
+src=$(cd "$1" && pwd)
+shift
+module=$(cd "$(dirname "$0")/.." && pwd)
+work=${BENCH_DIR:-/tmp/fancyindex-bench}
+port=${PORT:-8080}
+duration=${DURATION:-10s}
+connections=${CONNECTIONS:-16}
+threads=${THREADS:-2}
+queries=${QUERIES:-"? ?C=M&O=D ?F=json ?per_page=100&page=2"}
+sizes=${*:-1000 10000 100000 1000000}
+
+mkdir -p "$work/logs" "$work/data"
+
+echo "Building nginx in $src" >&2
+(
+    cd "$src"
+    ./configure --prefix="$work" --add-module="$module" --with-threads \
+        --with-cc-opt='-O2 -g -fno-omit-frame-pointer' > "$work/configure.log"
+    make -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)" \
+        > "$work/make.log"
+)
+
+# Plain ASCII names, UTF-8 names (measured character by character), and
+# names which have to be escaped in URIs.
+for n in $sizes; do
+    for kind in ascii utf8 escape; do
+        dir="$work/data/$kind-$n"
+        [ -d "$dir" ] && continue
+
+        echo "Generating $dir" >&2
+        mkdir -p "$dir.tmp"
+        case $kind in
+            ascii)  seq -f "$dir.tmp/file-%07g.txt" "$n" ;;
+            utf8)   seq -f "$dir.tmp/fichier-été-%07g.txt" "$n" ;;
+            escape) seq -f "$dir.tmp/file #%07g & more?.txt" "$n" ;;
+        esac | tr '\n' '\0' | xargs -0 touch
+        mv "$dir.tmp" "$dir"
+    done
+done
+
+cat > "$work/nginx.conf" <<CONF
+worker_processes 1;
+error_log $work/logs/error.log;
+pid $work/logs/nginx.pid;
+events { worker_connections 1024; }
+http {
+    charset utf-8;
+    log_format bench '\$status \$request_time \$fancyindex_read_time '
+                     '\$fancyindex_sort_time \$fancyindex_render_time';
+    access_log $work/logs/access.log bench;
+    server {
+        listen 127.0.0.1:$port;
+        root $work/data;
+        location / { fancyindex on; }
+    }
+}
+CONF
+
+"$src/objs/nginx" -p "$work" -c "$work/nginx.conf"
+trap '"$src/objs/nginx" -p "$work" -c "$work/nginx.conf" -s stop' EXIT
+sleep 1
+
+master=$(cat "$work/logs/nginx.pid")
+
+# The peak memory of a process is never reset, so each run gets a new
+# worker, whose resident memory is read before the run as the baseline.
+new_worker() {
+    old=$(pgrep -P "$master" | head -n 1)
+    kill -HUP "$master"
+    while :; do
+        worker=$(pgrep -P "$master" | grep -vx "$old" | head -n 1) || :
+        [ -n "$worker" ] && ! kill -0 "$old" 2>/dev/null && break
+        sleep 0.1
+    done
+    base=$(awk '/^VmRSS:/ { print $2 }' "/proc/$worker/status")
+}
+
+printf '%-16s %-10s %10s %10s %9s %9s %9s %10s\n' \
+    directory query req/s p99 read_ms sort_ms rend_ms growth_kB
+
+for n in $sizes; do
+    for kind in ascii utf8 escape; do
+        for q in $queries; do
+            new_worker
+            : > "$work/logs/access.log"
+
+            wrk -t"$threads" -c"$connections" -d"$duration" --latency \
+                "http://127.0.0.1:$port/$kind-$n/$q" > "$work/wrk.log"
+
+            rps=$(awk '/^Requests\/sec:/ { print $2 }' "$work/wrk.log")
+            p99=$(awk '$1 == "99%" { print $2 }' "$work/wrk.log")
+            hwm=$(awk -v base="$base" '/^VmHWM:/ { print $2 - base }' \
+                  "/proc/$worker/status" 2>/dev/null || echo -)
+
+            awk -v dir="$kind-$n" -v q="$q" -v rps="$rps" -v p99="$p99" \
+                -v hwm="$hwm" '
+                $1 == 200 { n++; r += $3; s += $4; t += $5 }
+                END {
+                    if (n == 0) n = 1
+                    printf "%-16s %-10s %10s %10s %9.2f %9.2f %9.2f %10s\n",
+                           dir, q, rps, p99, r * 1000 / n, s * 1000 / n,
+                           t * 1000 / n, hwm
+                }' "$work/logs/access.log"
+        done
+    done
+done
@@ -24,6 +24,28 @@
 #include <ngx_http.h>
 #include <ngx_log.h>
 
+#if (NGX_LINUX)
+#include <sys/syscall.h>
+#endif
+
+#if (NGX_HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
+#if (NGX_HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
 #include "template.h"
 
 #if defined(__GNUC__) && (__GNUC__ >= 3)
@@ -85,54 +107,119 @@ static const char *long_month[] = {
     F_ ('Y',  4, "%04d", (t)->ngx_tm_year                         )
 
 
-static size_t
-ngx_fancyindex_timefmt_calc_size (const ngx_str_t *fmt)
+/**
+ * Time formats are compiled into a list of operations, each one either a
+ * literal piece of the format or one of the conversions above.
+ */
+typedef struct {
+    ngx_str_t   literal;
+    ngx_uint_t  conversion;  /**< Conversion letter, or 0 for literals. */
+} ngx_fancyindex_timefmt_op_t;
+
+
+/**
+ * Number of seconds after which the output of a conversion may change.
+ */
+static time_t
+ngx_fancyindex_timefmt_resolution (u_char letter)
+{
+    switch (letter) {
+        case 'r': case 'S': case 'T':
+            return 1;
+        case 'M': case 'R':
+            return 60;
+        case 'H': case 'I': case 'k': case 'l': case 'p': case 'P':
+            return 60 * 60;
+        default:
+            return 24 * 60 * 60;
+    }
+}
+
+
+static ngx_array_t *
+ngx_fancyindex_timefmt_compile (ngx_pool_t *pool, const ngx_str_t *fmt,
+                                size_t *size, time_t *resolution,
+                                ngx_uint_t *fixed)
 {
 #define DATETIME_CASE(letter, fmtlen, fmt, ...) \
-        case letter: result += (fmtlen); break;
+        case letter: result += (fmtlen); op->conversion = letter; break;
 
+    ngx_fancyindex_timefmt_op_t *op;
+    ngx_array_t *ops;
     size_t i, result = 0;
-    for (i = 0; i < fmt->len; i++) {
-        if (fmt->data[i] == '%') {
-            if (++i >= fmt->len) {
-                result++;
-                break;
-            }
+
+    *resolution = 24 * 60 * 60;
+    *fixed = 1;
+
+    ops = ngx_array_create(pool, 4, sizeof(ngx_fancyindex_timefmt_op_t));
+    if (ops == NULL)
+        return NULL;
+
+    for (i = 0, op = NULL; i < fmt->len; i++) {
+        if (fmt->data[i] == '%' && i + 1 < fmt->len) {
+            if ((op = ngx_array_push(ops)) == NULL)
+                return NULL;
+
+            /* Unknown conversions output the letter itself. */
+            op->literal.data = &fmt->data[++i];
+            op->literal.len  = 1;
+            op->conversion   = 0;
+
             switch (fmt->data[i]) {
                 DATETIME_FORMATS(DATETIME_CASE,)
                 default:
                     result++;
             }
-        } else {
-            result++;
+
+            if (op->conversion) {
+                *resolution = ngx_min(*resolution,
+                        ngx_fancyindex_timefmt_resolution(op->conversion));
+            }
+
+            /* Only full names of days and months vary in length. */
+            if (op->conversion == 'A' || op->conversion == 'B')
+                *fixed = 0;
+
+            op = NULL;
+            continue;
         }
+
+        /* Literal characters, including a trailing '%', are coalesced. */
+        if (op == NULL) {
+            if ((op = ngx_array_push(ops)) == NULL)
+                return NULL;
+
+            op->literal.data = &fmt->data[i];
+            op->literal.len  = 0;
+            op->conversion   = 0;
+        }
+
+        op->literal.len++;
+        result++;
     }
-    return result;
+
+    *size = result;
+    return ops;
 
 #undef DATETIME_CASE
 }
 
 
 static u_char*
-ngx_fancyindex_timefmt (u_char *buffer, const ngx_str_t *fmt, const ngx_tm_t *tm)
+ngx_fancyindex_timefmt (u_char *buffer, const ngx_array_t *ops, const ngx_tm_t *tm)
 {
 #define DATETIME_CASE(letter, fmtlen, fmt, ...) \
         case letter: buffer = ngx_snprintf(buffer, fmtlen, fmt, ##__VA_ARGS__); break;
 
+    ngx_fancyindex_timefmt_op_t *op = ops->elts;
     size_t i;
-    for (i = 0; i < fmt->len; i++) {
-        if (fmt->data[i] == '%') {
-            if (++i >= fmt->len) {
-                *buffer++ = '%';
-                break;
-            }
-            switch (fmt->data[i]) {
-                DATETIME_FORMATS(DATETIME_CASE, tm)
-                default:
-                    *buffer++ = fmt->data[i];
-            }
-        } else {
-            *buffer++ = fmt->data[i];
+
+    for (i = 0; i < ops->nelts; i++) {
+        switch (op[i].conversion) {
+            DATETIME_FORMATS(DATETIME_CASE, tm)
+            default:
+                buffer = ngx_cpymem(buffer, op[i].literal.data,
+                                    op[i].literal.len);
         }
     }
     return buffer;
@@ -141,6 +228,56 @@ ngx_fancyindex_timefmt (u_char *buffer, const ngx_str_t *fmt, const ngx_tm_t *tm
 }
 
 
+/**
+ * Compiled patterns of fancyindex_ignore.
+ */
+typedef struct {
+    ngx_hash_t   exact;      /**< Names, lowercased with PCRE. */
+    ngx_uint_t   nexact;
+#if (NGX_PCRE)
+    ngx_array_t *prefixes;   /**< Trie of lowercased prefixes. */
+    ngx_array_t *suffixes;   /**< Trie of reversed lowercased suffixes. */
+    ngx_uint_t   nprefixes;
+    ngx_uint_t   nsuffixes;
+    ngx_array_t *regex;      /**< Other patterns, combined if possible. */
+#endif
+} ngx_http_fancyindex_ignore_t;
+
+
+/**
+ * Contents of a local header or footer file, as last read by the worker.
+ * Requests sending it hold references, so it can be replaced while still
+ * being sent.
+ */
+typedef struct {
+    ngx_uint_t       refs;   /**< Requests, plus one while it is current. */
+    ngx_file_uniq_t  uniq;
+    time_t           mtime;
+    off_t            size;
+    size_t           len;
+    u_char           data[1];
+} ngx_http_fancyindex_file_t;
+
+/**
+ * A header or footer, either fetched with a subrequest or read from a
+ * local file.
+ */
+typedef struct {
+    ngx_str_t                    path;  /**< URI, or file name if local. */
+    ngx_uint_t                   local;
+    ngx_http_fancyindex_file_t  *file;  /**< Contents of a local file. */
+} ngx_http_fancyindex_include_t;
+
+
+/**
+ * Where cached listings of at least min_size bytes are kept as files.
+ */
+typedef struct {
+    ngx_path_t                     *path;
+    size_t                          min_size;
+} ngx_http_fancyindex_cache_path_t;
+
+
 /**
  * Configuration structure for the fancyindex module. The configuration
  * commands defined in the module do fill in the members of this structure.
@@ -148,19 +285,70 @@ ngx_fancyindex_timefmt (u_char *buffer, const ngx_str_t *fmt, const ngx_tm_t *tm
 typedef struct {
     ngx_flag_t enable;       /**< Module is enabled. */
     ngx_uint_t default_sort; /**< Default sort criterion. */
+    ngx_uint_t collation;    /**< How names are compared. */
     ngx_flag_t localtime;    /**< File mtime dates are sent in local time. */
     ngx_flag_t exact_size;   /**< Sizes are sent always in bytes. */
+    ngx_uint_t size_units;   /**< Powers of rounded sizes, UNITS_*. */
     ngx_uint_t name_length;  /**< Maximum length of file names in bytes. */
     ngx_flag_t hide_symlinks;/**< Hide symbolic links in listings. */
+    ngx_flag_t directories_first; /**< List directories before files. */
 
-    ngx_str_t  header;       /**< File name for header, or empty if none. */
-    ngx_str_t  footer;       /**< File name for footer, or empty if none. */
+    ngx_http_fancyindex_include_t *header; /**< Header, or NULL if none. */
+    ngx_http_fancyindex_include_t *footer; /**< Footer, or NULL if none. */
     ngx_str_t  css_href;     /**< Link to a CSS stylesheet, or empty if none. */
     ngx_str_t  time_format;  /**< Format used for file timestamps. */
+    ngx_array_t *time_ops;   /**< Compiled time format. */
+    size_t     date_len;     /**< Length of formatted timestamps, at most. */
+    ngx_uint_t date_fixed;   /**< All timestamps have date_len bytes. */
+    time_t     date_resolution; /**< Seconds shown as the same timestamp. */
+    ngx_str_t  head;         /**< Built-in header, up to the title. */
 
     ngx_array_t *ignore;     /**< List of files to ignore in listings. */
+    ngx_http_fancyindex_ignore_t *ignore_matcher;
+
+    ngx_flag_t stream;       /**< Stream rows of big listings. */
+    ngx_bufs_t stream_bufs;  /**< Buffers used to stream rows. */
+
+    ngx_flag_t aio;          /**< Scan directories in a thread pool. */
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;
+#endif
+
+    ngx_shm_zone_t *cache;   /**< Zone for rendered listings, or NULL. */
+    ngx_http_fancyindex_cache_path_t *cache_path; /**< Or NULL if none. */
+    ngx_uint_t compress;     /**< Mask of encodings of cached variants. */
+    ngx_uint_t compress_level; /**< Of gzip, or the quality of Brotli. */
+    ngx_flag_t cache_watch;  /**< Trust cached listings being watched. */
+    ngx_flag_t cache_lock;   /**< Wait for listings being built. */
+    ngx_msec_t cache_lock_timeout; /**< How long listings are built, at most. */
+    ngx_uint_t cache_use_stale; /**< NGX_HTTP_FANCYINDEX_STALE_* */
+    time_t     cache_errors; /**< Seconds errors are cached, or zero. */
+    ngx_uint_t generation;   /**< Identifies how listings are rendered. */
+
+    ngx_uint_t format;       /**< Default output format. */
+    ngx_uint_t page_size;    /**< Entries per page, or zero for no pages. */
+
+    ngx_uint_t recursive_depth; /**< Levels of trees, or zero if not listed. */
+    ngx_uint_t recursive_max; /**< Maximum entries of trees. */
+
+    ngx_uint_t max_entries;  /**< Entries kept in listings, or zero. */
+    ngx_flag_t max_entries_top; /**< Keep the entries going first. */
+    ngx_msec_t max_scan_time; /**< Time to read directories, or zero. */
 } ngx_http_fancyindex_loc_conf_t;
 
+typedef struct {
+    ngx_shm_zone_t *status;  /**< Zone for fancyindex_status, or NULL. */
+    ngx_array_t    *cache_paths; /**< Cache paths and their zones, or NULL. */
+} ngx_http_fancyindex_main_conf_t;
+
+/**
+ * A cache path along with a zone whose listings are kept there.
+ */
+typedef struct {
+    ngx_http_fancyindex_cache_path_t *cp;
+    ngx_shm_zone_t                   *zone;
+} ngx_http_fancyindex_cache_use_t;
+
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME       0
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE       1
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE       2
@@ -178,8 +366,107 @@ static ngx_conf_enum_t ngx_http_fancyindex_sort_criteria[] = {
     { ngx_null_string, 0 }
 };
 
+#define NGX_HTTP_FANCYINDEX_FORMAT_HTML   0
+#define NGX_HTTP_FANCYINDEX_FORMAT_JSON   1
+#define NGX_HTTP_FANCYINDEX_FORMAT_XML    2
+#define NGX_HTTP_FANCYINDEX_FORMAT_PLAIN  3
+#define NGX_HTTP_FANCYINDEX_FORMAT_JS     4
+
+#define NGX_HTTP_FANCYINDEX_COLLATION_BYTES     0
+#define NGX_HTTP_FANCYINDEX_COLLATION_CASEFOLD  1
+#define NGX_HTTP_FANCYINDEX_COLLATION_NATURAL   2
+
+#define NGX_HTTP_FANCYINDEX_UNITS_IEC  0
+#define NGX_HTTP_FANCYINDEX_UNITS_SI   1
+
+static ngx_conf_enum_t ngx_http_fancyindex_size_units[] = {
+    { ngx_string("iec"), NGX_HTTP_FANCYINDEX_UNITS_IEC },
+    { ngx_string("si"), NGX_HTTP_FANCYINDEX_UNITS_SI },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t ngx_http_fancyindex_collations[] = {
+    { ngx_string("bytes"), NGX_HTTP_FANCYINDEX_COLLATION_BYTES },
+    { ngx_string("casefold"), NGX_HTTP_FANCYINDEX_COLLATION_CASEFOLD },
+    { ngx_string("natural"), NGX_HTTP_FANCYINDEX_COLLATION_NATURAL },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t ngx_http_fancyindex_format_names[] = {
+    { ngx_string("html"), NGX_HTTP_FANCYINDEX_FORMAT_HTML },
+    { ngx_string("json"), NGX_HTTP_FANCYINDEX_FORMAT_JSON },
+    { ngx_string("xml"), NGX_HTTP_FANCYINDEX_FORMAT_XML },
+    { ngx_string("plain"), NGX_HTTP_FANCYINDEX_FORMAT_PLAIN },
+    { ngx_string("js"), NGX_HTTP_FANCYINDEX_FORMAT_JS },
+    { ngx_null_string, 0 }
+};
+
 
 #define NGX_HTTP_FANCYINDEX_PREALLOCATE  50
+#define NGX_HTTP_FANCYINDEX_GETDENTS_SIZE  (64 * 1024)
+#define NGX_HTTP_FANCYINDEX_NAMES_SIZE     (16 * 1024)
+#define NGX_HTTP_FANCYINDEX_HINT_MAX       (1024 * 1024)
+#define NGX_HTTP_FANCYINDEX_NAME_MAX       256
+#define NGX_HTTP_FANCYINDEX_RADIX_SORT_MIN  64
+#define NGX_HTTP_FANCYINDEX_RECURSIVE_DEPTH  16
+#define NGX_HTTP_FANCYINDEX_RECURSIVE_MAX    100000
+#define NGX_HTTP_FANCYINDEX_CLOCK_ENTRIES    64
+#define NGX_HTTP_FANCYINDEX_CACHE_FILE_MIN   (64 * 1024)
+
+/*
+ * Why a listing does not have every entry of the directory.
+ */
+#define NGX_HTTP_FANCYINDEX_TRUNCATED_ENTRIES  1
+#define NGX_HTTP_FANCYINDEX_TRUNCATED_TIME     2
+
+/*
+ * Encodings of the variants of cached listings. The identity variant only
+ * holds the table, compressed variants hold the complete page.
+ */
+#define NGX_HTTP_FANCYINDEX_IDENTITY   0
+#define NGX_HTTP_FANCYINDEX_GZIP       1
+#define NGX_HTTP_FANCYINDEX_BROTLI     2
+#define NGX_HTTP_FANCYINDEX_ENCODINGS  3
+
+/*
+ * How cached listings are validated: against the information of the
+ * directory, or trusting that the directory is being watched for changes,
+ * which needs no stat() at all. When the entry is validated against the
+ * directory information it may then be marked as watched. Snapshots used
+ * for delta listings are not validated at all.
+ */
+#define NGX_HTTP_FANCYINDEX_CACHE_STAT     0
+#define NGX_HTTP_FANCYINDEX_CACHE_WATCHED  1
+#define NGX_HTTP_FANCYINDEX_CACHE_WATCH    2
+#define NGX_HTTP_FANCYINDEX_CACHE_ANY      3
+
+/*
+ * Outcome of looking up the listing of a request in the cache zone, as
+ * reported by $fancyindex_cache_status. Requests which are not looked up,
+ * like trees, deltas and those answered as not modified, bypass the zone.
+ */
+#define NGX_HTTP_FANCYINDEX_LOOKUP_NONE    0
+#define NGX_HTTP_FANCYINDEX_LOOKUP_HIT     1
+#define NGX_HTTP_FANCYINDEX_LOOKUP_MISS    2
+#define NGX_HTTP_FANCYINDEX_LOOKUP_BYPASS  3
+#define NGX_HTTP_FANCYINDEX_LOOKUP_UPDATING  4
+#define NGX_HTTP_FANCYINDEX_LOOKUPS        5
+
+/*
+ * When stale listings are served, with fancyindex_cache_use_stale, and how
+ * often, in milliseconds, requests waiting for a listing being built by
+ * another one look it up again.
+ */
+#define NGX_HTTP_FANCYINDEX_STALE_OFF       0
+#define NGX_HTTP_FANCYINDEX_STALE_UPDATING  1
+
+#define NGX_HTTP_FANCYINDEX_CACHE_LOCK_POLL  50
+
+static ngx_conf_enum_t ngx_http_fancyindex_use_stale[] = {
+    { ngx_string("off"), NGX_HTTP_FANCYINDEX_STALE_OFF },
+    { ngx_string("updating"), NGX_HTTP_FANCYINDEX_STALE_UPDATING },
+    { ngx_null_string, 0 }
+};
 
 
 /**
@@ -213,6 +500,7 @@ static ngx_conf_enum_t ngx_http_fancyindex_sort_criteria[] = {
 
 typedef struct {
     ngx_str_t      name;
+    ngx_str_t      key;     /**< Collation key, or NULL data if none. */
     size_t         utf_len;
     ngx_uint_t     escape;
     ngx_uint_t     dir;
@@ -221,6 +509,190 @@ typedef struct {
 } ngx_http_fancyindex_entry_t;
 
 
+/**
+ * A rendered listing stored in the cache zone. The key is stored first in
+ * the data area, immediately followed by the rendered table body and then
+ * by the compressed variants of the complete page, if any. Listings kept
+ * in files have their variants there in the same order, and the data area
+ * holds the null-terminated name of the file after the key instead.
+ *
+ * A request building a listing may lock its node, so that others wait for
+ * it, or are served the stale listing meanwhile; nodes are also added just
+ * to hold the lock of listings which are not cached yet.
+ *
+ * Directories which cannot be listed have nodes with just the key and the
+ * status of the response, which is used until the node expires.
+ */
+typedef struct {
+    ngx_rbtree_node_t  node;     /**< Keyed by the CRC32 of the key. */
+    ngx_queue_t        queue;    /**< Position in the LRU queue. */
+    ngx_file_uniq_t    uniq;     /**< Inode of the directory. */
+    time_t             mtime;    /**< Modification time, or expiry time. */
+    ngx_uint_t         watched;  /**< Epoch it was last watched, or 0. */
+    ngx_msec_t         lock;     /**< When its lock expires, or 0. */
+    size_t             len[NGX_HTTP_FANCYINDEX_ENCODINGS]; /**< Per variant. */
+    u_short            key_len;  /**< Length of the key. */
+    u_short            file_len; /**< Length of the file name, or 0. */
+    u_short            status;   /**< Status of an error, or 0. */
+    u_char             empty;    /**< Only holds a lock, not a listing. */
+    u_char             data[1];  /**< Key, followed by the body. */
+} ngx_http_fancyindex_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    ngx_queue_t        queue;    /**< Most recently used entries first. */
+    ngx_uint_t         epoch;    /**< Changes whenever watches are lost. */
+} ngx_http_fancyindex_cache_sh_t;
+
+typedef struct {
+    ngx_http_fancyindex_cache_sh_t *sh;
+    ngx_slab_pool_t                *shpool;
+    size_t                          max_len; /**< Largest cacheable node. */
+    ngx_uint_t                      fresh;   /**< Created, not inherited. */
+} ngx_http_fancyindex_cache_t;
+
+/**
+ * How a request coalesces with others building the same listing, and the
+ * lock it took to build it itself.
+ */
+typedef struct {
+    ngx_msec_t         timeout;  /**< How long a lock is held, at most. */
+    ngx_msec_t         expires;  /**< When the lock taken expires, or 0. */
+    ngx_msec_t         deadline; /**< Until when to wait, once waiting. */
+    unsigned           wait:1;   /**< Wait for listings being built. */
+    unsigned           stale:1;  /**< Serve stale ones being built. */
+    unsigned           updating:1; /**< A stale listing was served. */
+} ngx_http_fancyindex_cache_lock_t;
+
+
+/**
+ * What a listing took, exposed as $fancyindex_* variables. Times are in
+ * microseconds; reading the directory includes the stat calls and the
+ * matching of ignored names.
+ */
+typedef struct {
+    ngx_uint_t         lookup;   /**< NGX_HTTP_FANCYINDEX_LOOKUP_* */
+    ngx_uint_t         scanned;  /**< Entries read from directories. */
+    ngx_uint_t         filtered; /**< Entries ignored or hidden. */
+    ngx_uint_t         stat_calls;
+    ngx_uint_t         bytes;    /**< Bytes of listings rendered. */
+    uint64_t           read_time;
+    uint64_t           sort_time;
+    uint64_t           render_time;
+} ngx_http_fancyindex_stats_t;
+
+/**
+ * Totals of every listing, kept in the zone of fancyindex_status. Times
+ * are in milliseconds, so that they take 49 days to wrap around where
+ * atomic values have 32 bits.
+ */
+typedef struct {
+    ngx_atomic_t       requests;
+    ngx_atomic_t       lookups[NGX_HTTP_FANCYINDEX_LOOKUPS];
+    ngx_atomic_t       scanned;
+    ngx_atomic_t       filtered;
+    ngx_atomic_t       stat_calls;
+    ngx_atomic_t       bytes;
+    ngx_atomic_t       read_time;
+    ngx_atomic_t       sort_time;
+    ngx_atomic_t       render_time;
+} ngx_http_fancyindex_status_sh_t;
+
+
+typedef struct ngx_http_fancyindex_walk_s  ngx_http_fancyindex_walk_t;
+
+/**
+ * Per-request state. Listings which are streamed keep here the sorted
+ * entries and the ring of buffers into which rows are rendered.
+ */
+typedef struct {
+    ngx_buf_t                   *content; /**< Table, or its beginning. */
+
+    ngx_str_t                    path;    /**< Directory being listed. */
+    size_t                       allocated; /**< Size of path.data. */
+    ngx_str_t                    key;     /**< Cache key, if cached. */
+    ngx_file_info_t              fi;      /**< Directory info for cache. */
+    size_t                       dir_size; /**< Directory size, as a hint. */
+    u_char                      *names;   /**< Free space for names. */
+    u_char                      *names_end;
+    ngx_uint_t                   utf8;
+    ngx_uint_t                   sort_criterion;
+    ngx_int_t                    scan_rc; /**< Result of threaded scan. */
+    ngx_uint_t                   accept;  /**< Encodings accepted. */
+    ngx_uint_t                   encoding; /**< Encoding of content. */
+    ngx_uint_t                   format;  /**< Output format. */
+    ngx_str_t                    since;   /**< Token of a previous state. */
+    ngx_uint_t                   depth;   /**< Levels of a tree, or zero. */
+    ngx_http_fancyindex_walk_t  *walk;    /**< Tree being read. */
+    ngx_http_fancyindex_stats_t  stats;
+    ngx_http_fancyindex_cache_lock_t  lock;
+    ngx_event_t                  lock_event; /**< Polls a cache lock. */
+#if (NGX_HAVE_INOTIFY)
+    int                          wd;      /**< Watch of the directory. */
+#endif
+#if (NGX_PCRE2 && NGX_THREADS)
+    pcre2_match_data            *match_data;
+#endif
+
+    ngx_http_fancyindex_entry_t *entries; /**< Entries to render. */
+    ngx_uint_t                   nentries;
+    ngx_uint_t                   total;   /**< Entries in the directory. */
+    ngx_http_fancyindex_entry_t *read;    /**< All total entries, if read. */
+    ngx_uint_t                   page;    /**< Page to render, from 1. */
+    ngx_uint_t                   per_page; /**< Zero if not paginated. */
+    ngx_uint_t                   next;    /**< Next entry to render. */
+    const char                  *sort_url_args;
+
+    ngx_buf_t                  **bufs;    /**< Stream buffers. */
+    ngx_uint_t                   nbufs;   /**< Stream buffers allocated. */
+
+    unsigned                     stream:1;
+    unsigned                     have_fi:1; /**< fi was filled in. */
+    unsigned                     vary:1;  /**< Variants may be sent. */
+    unsigned                     vary_accept:1; /**< Format negotiated. */
+    unsigned                     per_page_arg:1; /**< Page size asked for. */
+    unsigned                     delta:1; /**< Changes since a state. */
+    unsigned                     not_modified:1;
+    unsigned                     done:1;  /**< Table bottom was rendered. */
+    unsigned                     truncated:2; /**< TRUNCATED_* flags. */
+} ngx_http_fancyindex_ctx_t;
+
+
+/**
+ * Output format of listings. Rows are rendered by render_row() between
+ * head and tail, and row_len() gives their length, so buffers are sized
+ * for what is rendered; the HTML format builds its head separately, as it
+ * depends on the request. Truncated listings end with the truncated tail
+ * instead, which marks them as such in formats where that fits.
+ */
+typedef struct {
+    ngx_str_t   content_type;
+    ngx_str_t   head;
+    ngx_str_t   tail;
+    ngx_str_t   truncated;
+    size_t    (*row_len)(ngx_http_fancyindex_ctx_t *ctx,
+                         ngx_http_fancyindex_loc_conf_t *alcf,
+                         ngx_http_fancyindex_entry_t *entry);
+    u_char   *(*render_row)(u_char *p, ngx_http_fancyindex_ctx_t *ctx,
+                            ngx_http_fancyindex_loc_conf_t *alcf,
+                            ngx_http_fancyindex_entry_t *entry);
+} ngx_http_fancyindex_format_t;
+
+
+#if (NGX_THREADS)
+/**
+ * Directory scan handed over to a thread pool.
+ */
+typedef struct {
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_pool_t                     *pool;  /**< Pool for scanned entries. */
+    ngx_log_t                      *log;
+} ngx_http_fancyindex_task_ctx_t;
+#endif /* NGX_THREADS */
+
+
 
 static int ngx_libc_cdecl
     ngx_http_fancyindex_cmp_entries_name_desc(const void *one, const void *two);
@@ -234,12 +706,98 @@ static int ngx_libc_cdecl
     ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two);
 static int ngx_libc_cdecl
     ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two);
+static int ngx_libc_cdecl
+    ngx_http_fancyindex_cmp_entries_bytes(const void *one, const void *two);
+static int ngx_http_fancyindex_cmp_names(ngx_http_fancyindex_entry_t *first,
+    ngx_http_fancyindex_entry_t *second);
+
+/*
+ * Comparison functions, indexed by NGX_HTTP_FANCYINDEX_SORT_CRITERION_*.
+ */
+static int (*ngx_http_fancyindex_sort_cmp[]) (const void*, const void*) = {
+    ngx_http_fancyindex_cmp_entries_name_asc,
+    ngx_http_fancyindex_cmp_entries_size_asc,
+    ngx_http_fancyindex_cmp_entries_mtime_asc,
+    ngx_http_fancyindex_cmp_entries_name_desc,
+    ngx_http_fancyindex_cmp_entries_size_desc,
+    ngx_http_fancyindex_cmp_entries_mtime_desc,
+};
 
-static ngx_int_t ngx_http_fancyindex_error(ngx_http_request_t *r,
+#if !(NGX_LINUX)
+static ngx_int_t ngx_http_fancyindex_error(ngx_log_t *log,
     ngx_dir_t *dir, ngx_str_t *name);
+#endif
+
+static char *ngx_http_fancyindex_aio(ngx_conf_t    *cf,
+                                     ngx_command_t *cmd,
+                                     void          *conf);
+
+static char *ngx_http_fancyindex_cache(ngx_conf_t    *cf,
+                                       ngx_command_t *cmd,
+                                       void          *conf);
+static char *ngx_http_fancyindex_cache_path(ngx_conf_t    *cf,
+                                            ngx_command_t *cmd,
+                                            void          *conf);
+
+static char *ngx_http_fancyindex_cache_compress(ngx_conf_t    *cf,
+                                                ngx_command_t *cmd,
+                                                void          *conf);
+
+static char *ngx_http_fancyindex_recursive(ngx_conf_t    *cf,
+                                           ngx_command_t *cmd,
+                                           void          *conf);
+static char *ngx_http_fancyindex_max_entries(ngx_conf_t    *cf,
+                                             ngx_command_t *cmd,
+                                             void          *conf);
+
+static char *ngx_http_fancyindex_include(ngx_conf_t    *cf,
+                                         ngx_command_t *cmd,
+                                         void          *conf);
+
+static char *ngx_http_fancyindex_status(ngx_conf_t    *cf,
+                                        ngx_command_t *cmd,
+                                        void          *conf);
+
+static ngx_int_t ngx_http_fancyindex_cache_init_zone(ngx_shm_zone_t *shm_zone,
+                                                     void           *data);
+
+static ngx_int_t ngx_http_fancyindex_cache_get(ngx_http_request_t *r,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *key, ngx_file_info_t *fi,
+    ngx_uint_t validate, ngx_uint_t accept, ngx_uint_t *encoding,
+    ngx_buf_t **pb, ngx_http_fancyindex_cache_lock_t *lock);
+
+static void ngx_http_fancyindex_cache_put(ngx_http_request_t *r,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *key, ngx_file_info_t *fi,
+    ngx_uint_t watched, ngx_buf_t **variants,
+    ngx_http_fancyindex_cache_path_t *cp);
+
+static char *ngx_http_fancyindex_cache_watch_check(ngx_conf_t *cf,
+                                                   void       *post,
+                                                   void       *data);
+
+static ngx_conf_post_t  ngx_http_fancyindex_cache_watch_post =
+    { ngx_http_fancyindex_cache_watch_check };
+
+/* Truncated names need room for at least a character and the ellipsis. */
+static ngx_conf_num_bounds_t  ngx_http_fancyindex_name_length_bounds =
+    { ngx_conf_check_num_bounds, 4, -1 };
+
+/* Levels shared by zlib and, as qualities, by Brotli. */
+static ngx_conf_num_bounds_t  ngx_http_fancyindex_compress_level_bounds =
+    { ngx_conf_check_num_bounds, 1, 9 };
+
+static ngx_int_t ngx_http_fancyindex_init_module(ngx_cycle_t *cycle);
+
+static ngx_int_t ngx_http_fancyindex_init_process(ngx_cycle_t *cycle);
+
+static void ngx_http_fancyindex_exit_process(ngx_cycle_t *cycle);
+
+static ngx_int_t ngx_http_fancyindex_add_variables(ngx_conf_t *cf);
 
 static ngx_int_t ngx_http_fancyindex_init(ngx_conf_t *cf);
 
+static void *ngx_http_fancyindex_create_main_conf(ngx_conf_t *cf);
+
 static void *ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf);
 
 static char *ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf,
@@ -257,13 +815,18 @@ static uintptr_t
  * inline them always, if possible (see how ngx_force_inline is defined
  * above).
  */
-static ngx_inline ngx_buf_t*
-    make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
+static ngx_inline ngx_chain_t*
+    make_header_chain(ngx_http_request_t *r,
+                      ngx_http_fancyindex_loc_conf_t *alcf)
     ngx_force_inline;
 
-static ngx_inline ngx_buf_t*
-    make_footer_buf(ngx_http_request_t *r)
-    ngx_force_inline;
+static ngx_buf_t*
+    make_footer_buf(ngx_http_request_t *r);
+
+static void ngx_http_fancyindex_stream_handler(ngx_http_request_t *r);
+
+static ngx_int_t ngx_http_fancyindex_send(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf);
 
 
 
@@ -283,6 +846,13 @@ static ngx_command_t  ngx_http_fancyindex_commands[] = {
       offsetof(ngx_http_fancyindex_loc_conf_t, default_sort),
       &ngx_http_fancyindex_sort_criteria },
 
+    { ngx_string("fancyindex_collation"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, collation),
+      &ngx_http_fancyindex_collations },
+
     { ngx_string("fancyindex_localtime"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -297,23 +867,30 @@ static ngx_command_t  ngx_http_fancyindex_commands[] = {
       offsetof(ngx_http_fancyindex_loc_conf_t, exact_size),
       NULL },
 
+    { ngx_string("fancyindex_size_units"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, size_units),
+      &ngx_http_fancyindex_size_units },
+
     { ngx_string("fancyindex_name_length"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_num_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_fancyindex_loc_conf_t, name_length),
-      NULL },
+      &ngx_http_fancyindex_name_length_bounds },
 
     { ngx_string("fancyindex_header"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-      ngx_conf_set_str_slot,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_include,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_fancyindex_loc_conf_t, header),
       NULL },
 
     { ngx_string("fancyindex_footer"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
-      ngx_conf_set_str_slot,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_include,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_fancyindex_loc_conf_t, footer),
       NULL },
@@ -332,6 +909,13 @@ static ngx_command_t  ngx_http_fancyindex_commands[] = {
       0,
       NULL },
 
+    { ngx_string("fancyindex_directories_first"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, directories_first),
+      NULL },
+
     { ngx_string("fancyindex_hide_symlinks"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -346,1038 +930,8644 @@ static ngx_command_t  ngx_http_fancyindex_commands[] = {
       offsetof(ngx_http_fancyindex_loc_conf_t, time_format),
       NULL },
 
-    ngx_null_command
-};
-
-
-static ngx_http_module_t  ngx_http_fancyindex_module_ctx = {
-    NULL,                                  /* preconfiguration */
-    ngx_http_fancyindex_init,              /* postconfiguration */
+    { ngx_string("fancyindex_stream"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, stream),
+      NULL },
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    { ngx_string("fancyindex_stream_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, stream_bufs),
+      NULL },
 
-    NULL,                                  /* create server configuration */
-    NULL,                                  /* merge server configuration */
+    { ngx_string("fancyindex_aio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_aio,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
 
-    ngx_http_fancyindex_create_loc_conf,   /* create location configration */
-    ngx_http_fancyindex_merge_loc_conf     /* merge location configration */
-};
+    { ngx_string("fancyindex_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
 
+    { ngx_string("fancyindex_cache_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_fancyindex_cache_path,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
 
-ngx_module_t  ngx_http_fancyindex_module = {
-    NGX_MODULE_V1,
-    &ngx_http_fancyindex_module_ctx,       /* module context */
-    ngx_http_fancyindex_commands,          /* module directives */
-    NGX_HTTP_MODULE,                       /* module type */
-    NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
-    NULL,                                  /* init thread */
-    NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
-    NULL,                                  /* exit master */
-    NGX_MODULE_V1_PADDING
-};
+    { ngx_string("fancyindex_cache_compress"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_fancyindex_cache_compress,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
 
+    { ngx_string("fancyindex_cache_compress_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, compress_level),
+      &ngx_http_fancyindex_compress_level_bounds },
 
+    { ngx_string("fancyindex_page_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, page_size),
+      NULL },
 
-static const ngx_str_t css_href_pre =
-    ngx_string("<link rel=\"stylesheet\" href=\"");
-static const ngx_str_t css_href_post =
-    ngx_string("\" type=\"text/css\"/>\n");
+    { ngx_string("fancyindex_format"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, format),
+      &ngx_http_fancyindex_format_names },
 
+    { ngx_string("fancyindex_cache_watch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_watch),
+      &ngx_http_fancyindex_cache_watch_post },
 
+    { ngx_string("fancyindex_cache_lock"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_lock),
+      NULL },
+
+    { ngx_string("fancyindex_cache_lock_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_lock_timeout),
+      NULL },
+
+    { ngx_string("fancyindex_cache_use_stale"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_use_stale),
+      &ngx_http_fancyindex_use_stale },
+
+    { ngx_string("fancyindex_cache_errors"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_errors),
+      NULL },
+
+    { ngx_string("fancyindex_recursive"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_fancyindex_recursive,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_max_entries"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_max_entries,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_max_scan_time"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, max_scan_time),
+      NULL },
+
+    { ngx_string("fancyindex_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_fancyindex_status,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_fancyindex_module_ctx = {
+    ngx_http_fancyindex_add_variables,     /* preconfiguration */
+    ngx_http_fancyindex_init,              /* postconfiguration */
+
+    ngx_http_fancyindex_create_main_conf,  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_fancyindex_create_loc_conf,   /* create location configration */
+    ngx_http_fancyindex_merge_loc_conf     /* merge location configration */
+};
+
+
+ngx_module_t  ngx_http_fancyindex_module = {
+    NGX_MODULE_V1,
+    &ngx_http_fancyindex_module_ctx,       /* module context */
+    ngx_http_fancyindex_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_fancyindex_init_module,       /* init module */
+    ngx_http_fancyindex_init_process,      /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_http_fancyindex_exit_process,      /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+
+static const ngx_str_t css_href_pre =
+    ngx_string("<link rel=\"stylesheet\" href=\"");
+static const ngx_str_t css_href_post =
+    ngx_string("\" type=\"text/css\"/>\n");
+
+
+/**
+ * Same as ngx_escape_uri() with NGX_ESCAPE_HTML, which does not escape
+ * colons or the ? character, which signals the beginning of the query
+ * string. So we handle those characters ourselves, and pass the spans in
+ * between to ngx_escape_uri(), writing directly to dst.
+ *
+ * TODO: Get rid of this once ngx_escape_uri() works as expected!
+ */
 static uintptr_t
 ngx_fancyindex_escape_uri(u_char *dst, u_char *src, size_t size)
 {
-    /*
-     * The ngx_escape_uri() function will not escape colons or the
-     * ? character, which signals the beginning of the query string.
-     * So we handle those characters ourselves.
-     *
-     * TODO: Get rid of this once ngx_escape_uri() works as expected!
-     */
+    u_char     *p, *last;
+    uintptr_t   n;
 
-    u_int escapes = 0;
-    u_char *psrc = src;
-    size_t psize = size;
+    last = src + size;
+    n = 0;
 
-    while (psize--) {
-        switch (*psrc++) {
-            case ':':
-            case '?':
-                escapes++;
-                break;
+    for ( ;; ) {
+        for (p = src; p < last && *p != ':' && *p != '?'; p++)
+            /* void */ ;
+
+        if (dst == NULL) {
+            n += ngx_escape_uri(NULL, src, p - src, NGX_ESCAPE_HTML);
+        } else {
+            dst = (u_char *) ngx_escape_uri(dst, src, p - src,
+                                            NGX_ESCAPE_HTML);
         }
-    }
 
-    if (dst == NULL) {
-        return escapes + ngx_escape_uri(NULL, src, size, NGX_ESCAPE_HTML);
-    }
-    else if (escapes == 0) {
-        /* No need to do extra escaping, avoid the temporary buffer */
-        return ngx_escape_uri(dst, src, size, NGX_ESCAPE_HTML);
-    }
-    else {
-        uintptr_t uescapes = ngx_escape_uri(NULL, src, size, NGX_ESCAPE_HTML);
-        size_t bufsz = size + 2 * uescapes;
+        if (p == last)
+            break;
 
-        /*
-         * GCC and CLANG both support stack-allocated variable length
-         * arrays. Take advantage of that to avoid a malloc-free cycle.
-         */
-#if defined(__GNUC__) || defined(__clang__)
-        u_char cbuf[bufsz];
-        u_char *buf = cbuf;
-#else  /* __GNUC__ || __clang__ */
-        u_char *buf = (u_char*) malloc(sizeof(u_char) * bufsz);
-#endif /* __GNUC__ || __clang__ */
-
-        ngx_escape_uri(buf, src, size, NGX_ESCAPE_HTML);
-
-        while (bufsz--) {
-            switch (*buf) {
-                case ':':
-                    *dst++ = '%';
-                    *dst++ = '3';
-                    *dst++ = 'A';
-                    break;
-                case '?':
-                    *dst++ = '%';
-                    *dst++ = '3';
-                    *dst++ = 'F';
-                    break;
-                default:
-                    *dst++ = *buf;
-            }
-            buf++;
+        if (dst == NULL) {
+            n++;
+        } else {
+            *dst++ = '%';
+            *dst++ = '3';
+            *dst++ = (*p == ':') ? 'A' : 'F';
         }
 
-#if !defined(__GNUC__) && !defined(__clang__)
-        free(buf);
-#endif /* !__GNUC__ && !__clang__ */
-
-        return escapes + uescapes;
+        src = p + 1;
     }
+
+    return (dst == NULL) ? n : (uintptr_t) dst;
 }
 
 
-static ngx_inline ngx_buf_t*
-make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
+/**
+ * Chains the built-in header: the part put together for the location, the
+ * URI and the fixed parts which follow it. Buffers point to their data.
+ */
+static ngx_inline ngx_chain_t*
+make_header_chain(ngx_http_request_t *r, ngx_http_fancyindex_loc_conf_t *alcf)
 {
-    size_t blen = r->uri.len
-        + ngx_sizeof_ssz(t01_head1)
-        + ngx_sizeof_ssz(t02_head2)
-        + ngx_sizeof_ssz(t03_head3)
-        + ngx_sizeof_ssz(t04_body1)
-        ;
+    ngx_chain_t *cl;
+    ngx_buf_t   *b;
+    ngx_uint_t   i;
 
-    if (css_href.len) {
-        blen += css_href_pre.len \
-              + css_href.len \
-              + css_href_post.len
-              ;
-    }
+    cl = ngx_palloc(r->pool, 4 * sizeof(ngx_chain_t));
+    b  = ngx_pcalloc(r->pool, 4 * sizeof(ngx_buf_t));
 
-    ngx_buf_t *b = ngx_create_temp_buf(r->pool, blen);
+    if (cl == NULL || b == NULL)
+        return NULL;
 
-    if (b == NULL) goto bailout;
+    b[0].pos = alcf->head.data;
+    b[0].last = alcf->head.data + alcf->head.len;
+    b[1].pos = r->uri.data;
+    b[1].last = r->uri.data + r->uri.len;
+    b[2].pos = (u_char *) t03_head3;
+    b[2].last = (u_char *) t03_head3 + ngx_sizeof_ssz(t03_head3);
+    b[3].pos = (u_char *) t04_body1;
+    b[3].last = (u_char *) t04_body1 + ngx_sizeof_ssz(t04_body1);
 
-    b->last = ngx_cpymem_ssz(b->last, t01_head1);
+    for (i = 0; i < 4; i++) {
+        b[i].start = b[i].pos;
+        b[i].end = b[i].last;
+        b[i].memory = 1;
 
-    if (css_href.len) {
-        b->last = ngx_cpymem_str(b->last, css_href_pre);
-        b->last = ngx_cpymem_str(b->last, css_href);
-        b->last = ngx_cpymem_str(b->last, css_href_post);
+        cl[i].buf = &b[i];
+        cl[i].next = (i < 3) ? &cl[i + 1] : NULL;
     }
 
-    b->last = ngx_cpymem_ssz(b->last, t02_head2);
-    b->last = ngx_cpymem_str(b->last, r->uri);
-    b->last = ngx_cpymem_ssz(b->last, t03_head3);
-    b->last = ngx_cpymem_ssz(b->last, t04_body1);
-
-bailout:
-    return b;
+    return cl;
 }
 
 
 
-static ngx_inline ngx_buf_t*
+static ngx_buf_t*
 make_footer_buf(ngx_http_request_t *r)
 {
-    /*
-     * TODO: Make this buffer static (i.e. readonly and reusable from
-     * one request to another.
-     */
-    ngx_buf_t *b = ngx_create_temp_buf(r->pool, ngx_sizeof_ssz(t08_foot1));
+    ngx_buf_t *b = ngx_calloc_buf(r->pool);
 
     if (b == NULL) goto bailout;
 
-    b->last = ngx_cpymem_ssz(b->last, t08_foot1);
+    b->start = b->pos = (u_char *) t08_foot1;
+    b->end = b->last = (u_char *) t08_foot1 + ngx_sizeof_ssz(t08_foot1);
+    b->memory = 1;
 
 bailout:
     return b;
 }
 
 
-
-static ngx_inline ngx_int_t
-make_content_buf(
-        ngx_http_request_t *r, ngx_buf_t **pb,
-        ngx_http_fancyindex_loc_conf_t *alcf)
+static void
+ngx_http_fancyindex_file_release(void *data)
 {
-    ngx_http_fancyindex_entry_t *entry;
+    ngx_http_fancyindex_file_t *file = data;
 
-    int (*sort_cmp_func) (const void*, const void*);
-    const char  *sort_url_args = "";
+    if (file && --file->refs == 0)
+        ngx_free(file);
+}
 
-    off_t        length;
-    size_t       len, root, copy, allocated;
-    u_char      *filename, *last, scale;
-    ngx_tm_t     tm;
-    ngx_array_t  entries;
-    ngx_time_t  *tp;
-    ngx_uint_t   i;
-    ngx_int_t    size;
-    ngx_str_t    path;
-    ngx_dir_t    dir;
-    ngx_buf_t   *b;
 
-    /*
-     * NGX_DIR_MASK_LEN is lesser than NGX_HTTP_FANCYINDEX_PREALLOCATE
-     */
-    if ((last = ngx_http_map_uri_to_path(r, &path, &root,
-                    NGX_HTTP_FANCYINDEX_PREALLOCATE)) == NULL)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+/**
+ * Gets a local header or footer as a buffer pointing to the contents kept
+ * by the worker, which are read again only once the file changes; with
+ * open_file_cache not even a stat() is needed meanwhile. Sets *pb to NULL
+ * if the file is empty. Returns NGX_DECLINED when the file can not be read,
+ * and the built-in one should be used.
+ */
+static ngx_int_t
+ngx_http_fancyindex_local_file(ngx_http_request_t *r,
+    ngx_http_fancyindex_include_t *inc, ngx_buf_t **pb)
+{
+    ssize_t                      n;
+    ngx_buf_t                   *b;
+    ngx_file_t                   file;
+    ngx_pool_cleanup_t          *cln;
+    ngx_open_file_info_t         of;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_fancyindex_file_t  *f;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.directio = NGX_MAX_OFF_T_VALUE;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    /* The file is only opened when there is no current copy of it. */
+    of.test_only = (inc->file != NULL);
+
+    for ( ;; ) {
+        if (ngx_open_cached_file(clcf->open_file_cache, &inc->path, &of,
+                                 r->pool) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, of.err,
+                          "%s \"%V\" failed", of.failed, &inc->path);
+            return NGX_DECLINED;
+        }
 
-    allocated = path.len;
-    path.len  = last - path.data - 1;
-    path.data[path.len] = '\0';
+        if (!of.is_file) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "\"%V\" is not a regular file", &inc->path);
+            return NGX_DECLINED;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http fancyindex: \"%s\"", path.data);
+        f = inc->file;
 
-    if (ngx_open_dir(&path, &dir) == NGX_ERROR) {
-        ngx_int_t rc, err = ngx_errno;
-        ngx_uint_t level;
+        if (f && f->uniq == of.uniq && f->mtime == of.mtime
+            && f->size == of.size)
+            break;
 
-        if (err == NGX_ENOENT || err == NGX_ENOTDIR || err == NGX_ENAMETOOLONG) {
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_NOT_FOUND;
-        } else if (err == NGX_EACCES) {
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_FORBIDDEN;
-        } else {
-            level = NGX_LOG_CRIT;
-            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        if (of.test_only) {
+            of.test_only = 0;
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: reading \"%V\"", &inc->path);
+
+        f = ngx_alloc(offsetof(ngx_http_fancyindex_file_t, data) + of.size,
+                      r->connection->log);
+        if (f == NULL)
+            return NGX_ERROR;
+
+        ngx_memzero(&file, sizeof(ngx_file_t));
+        file.fd = of.fd;
+        file.name = inc->path;
+        file.log = r->connection->log;
+
+        n = ngx_read_file(&file, f->data, of.size, 0);
+        if (n == NGX_ERROR) {
+            ngx_free(f);
+            return NGX_DECLINED;
         }
 
-        ngx_log_error(level, r->connection->log, err,
-                ngx_open_dir_n " \"%s\" failed", path.data);
+        f->refs  = 1;
+        f->uniq  = of.uniq;
+        f->mtime = of.mtime;
+        f->size  = of.size;
+        f->len   = n;
 
-        return rc;
+        ngx_http_fancyindex_file_release(inc->file);
+        inc->file = f;
+        break;
     }
 
-#if (NGX_SUPPRESS_WARN)
-    /* MSVC thinks 'entries' may be used without having been initialized */
-    ngx_memzero(&entries, sizeof(ngx_array_t));
-#endif /* NGX_SUPPRESS_WARN */
+    if (f->len == 0) {
+        *pb = NULL;
+        return NGX_OK;
+    }
 
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL)
+        return NGX_ERROR;
 
-    if (ngx_array_init(&entries, r->pool, 40,
-                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
-        return ngx_http_fancyindex_error(r, &dir, &path);
+    if ((b = ngx_calloc_buf(r->pool)) == NULL)
+        return NGX_ERROR;
 
-    filename = path.data;
-    filename[path.len] = '/';
+    f->refs++;
+    cln->handler = ngx_http_fancyindex_file_release;
+    cln->data = f;
+
+    b->start = b->pos = f->data;
+    b->end = b->last = f->data + f->len;
+    b->memory = 1;
+
+    *pb = b;
+    return NGX_OK;
+}
+
+
+/**
+ * Gets the footer chained after the table: a local file, or the built-in
+ * one if it is not configured or can not be read.
+ */
+static ngx_int_t
+ngx_http_fancyindex_footer_buf(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_buf_t **pb)
+{
+    ngx_int_t  rc;
+
+    if (alcf->footer && alcf->footer->local) {
+        rc = ngx_http_fancyindex_local_file(r, alcf->footer, pb);
+        if (rc != NGX_DECLINED)
+            return rc;
+    }
+
+    *pb = make_footer_buf(r);
+
+    return (*pb == NULL) ? NGX_ERROR : NGX_OK;
+}
+
+
+
+static void
+ngx_http_fancyindex_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                 **p;
+    ngx_http_fancyindex_cache_node_t   *cn, *cnt;
 
-    /* Read directory entries and their associated information. */
     for (;;) {
-        ngx_set_errno(0);
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            cn  = (ngx_http_fancyindex_cache_node_t *) node;
+            cnt = (ngx_http_fancyindex_cache_node_t *) temp;
 
-        if (ngx_read_dir(&dir) == NGX_ERROR) {
-            ngx_int_t err = ngx_errno;
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->key_len, cnt->key_len)
+                 < 0) ? &temp->left : &temp->right;
+        }
 
-            if (err != NGX_ENOMOREFILES) {
-                ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                        ngx_read_dir_n " \"%V\" failed", &path);
-                return ngx_http_fancyindex_error(r, &dir, &path);
-            }
+        if (*p == sentinel) {
             break;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http fancyindex file: \"%s\"", ngx_de_name(&dir));
+        temp = *p;
+    }
 
-        len = ngx_de_namelen(&dir);
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
-        if (ngx_de_name(&dir)[0] == '.')
-            continue;
 
-        if (alcf->hide_symlinks && ngx_de_is_link (&dir))
-            continue;
+/*
+ * Must be called with the zone locked.
+ */
+static ngx_http_fancyindex_cache_node_t *
+ngx_http_fancyindex_cache_lookup(ngx_http_fancyindex_cache_t *cache,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                          rc;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_http_fancyindex_cache_node_t  *cn;
 
-#if NGX_PCRE
-        {
-            ngx_str_t str = { len, ngx_de_name(&dir) };
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
 
-            if (alcf->ignore && ngx_regex_exec_array(alcf->ignore, &str,
-                                                     r->connection->log)
-                != NGX_DECLINED)
-            {
-                continue;
-            }
+    while (node != sentinel) {
+        if (hash < node->key) {
+            node = node->left;
+            continue;
         }
-#else /* !NGX_PCRE */
-        if (alcf->ignore) {
-            u_int match_found = 0;
-            ngx_str_t *s = alcf->ignore->elts;
 
-            for (i = 0; i < alcf->ignore->nelts; i++, s++) {
-                if (ngx_strcmp(ngx_de_name(&dir), s->data) == 0) {
-                    match_found = 1;
-                    break;
-                }
-            }
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
 
-            if (match_found) {
-                continue;
-            }
+        cn = (ngx_http_fancyindex_cache_node_t *) node;
+        rc = ngx_memn2cmp(key->data, cn->data, key->len, cn->key_len);
+
+        if (rc == 0) {
+            return cn;
         }
-#endif /* NGX_PCRE */
 
-        if (!dir.valid_info) {
-            /* 1 byte for '/' and 1 byte for terminating '\0' */
-            if (path.len + 1 + len + 1 > allocated) {
-                allocated = path.len + 1 + len + 1
-                          + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+        node = (rc < 0) ? node->left : node->right;
+    }
 
-                if ((filename = ngx_palloc(r->pool, allocated)) == NULL)
-                    return ngx_http_fancyindex_error(r, &dir, &path);
+    return NULL;
+}
 
-                last = ngx_cpystrn(filename, path.data, path.len + 1);
-                *last++ = '/';
-            }
 
-            ngx_cpystrn(last, ngx_de_name(&dir), len + 1);
+typedef struct ngx_http_fancyindex_dead_file_s
+    ngx_http_fancyindex_dead_file_t;
 
-            if (ngx_de_info(filename, &dir) == NGX_FILE_ERROR) {
-                ngx_int_t err = ngx_errno;
+/**
+ * A file of a listing dropped while the zone was locked, which is deleted
+ * once the zone is unlocked, so that other workers never wait on the file
+ * system for the lock.
+ */
+struct ngx_http_fancyindex_dead_file_s {
+    ngx_http_fancyindex_dead_file_t *next;
+    u_char                           name[1];
+};
 
-                if (err != NGX_ENOENT) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
-                            ngx_de_info_n " \"%s\" failed", filename);
-                    continue;
-                }
+static ngx_http_fancyindex_dead_file_t  *ngx_http_fancyindex_dead_files;
 
-                if (ngx_de_link_info(filename, &dir) == NGX_FILE_ERROR) {
-                    ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                            ngx_de_link_info_n " \"%s\" failed", filename);
-                    return ngx_http_fancyindex_error(r, &dir, &path);
-                }
-            }
-        }
 
-        if ((entry = ngx_array_push(&entries)) == NULL)
-            return ngx_http_fancyindex_error(r, &dir, &path);
+static void
+ngx_http_fancyindex_cache_delete_file(u_char *name)
+{
+    if (ngx_delete_file(name) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
+}
 
-        entry->name.len  = len;
-        entry->name.data = ngx_palloc(r->pool, len + 1);
-        if (entry->name.data == NULL)
-            return ngx_http_fancyindex_error(r, &dir, &path);
 
-        ngx_cpystrn(entry->name.data, ngx_de_name(&dir), len + 1);
-        entry->escape = 2 * ngx_fancyindex_escape_uri(NULL,
-                                                      ngx_de_name(&dir),
-                                                      len);
+/**
+ * Unlocks the zone, then deletes the files of the listings which were
+ * dropped meanwhile.
+ */
+static void
+ngx_http_fancyindex_cache_unlock_zone(ngx_http_fancyindex_cache_t *cache)
+{
+    ngx_http_fancyindex_dead_file_t  *df;
 
-        entry->dir     = ngx_de_is_dir(&dir);
-        entry->mtime   = ngx_de_mtime(&dir);
-        entry->size    = ngx_de_size(&dir);
-        entry->utf_len = (r->headers_out.charset.len == 5 &&
-                ngx_strncasecmp(r->headers_out.charset.data, (u_char*) "utf-8", 5) == 0)
-            ?  ngx_utf8_length(entry->name.data, entry->name.len)
-            : len;
-    }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    if (ngx_close_dir(&dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                ngx_close_dir_n " \"%s\" failed", &path);
+    while ((df = ngx_http_fancyindex_dead_files) != NULL) {
+        ngx_http_fancyindex_dead_files = df->next;
+        ngx_http_fancyindex_cache_delete_file(df->name);
+        ngx_free(df);
     }
+}
 
-    /*
-     * Calculate needed buffer length.
-     */
-    len = r->uri.len
-        + ngx_sizeof_ssz(t05_body2)
-        + ngx_sizeof_ssz(t06_list1)
-        + ngx_sizeof_ssz(t_parentdir_entry)
-        + ngx_sizeof_ssz(t07_list2)
-        + ngx_fancyindex_timefmt_calc_size (&alcf->time_format) * entries.nelts
-        ;
 
-    /*
-     * If we are a the root of the webserver (URI =  "/" --> length of 1),
-     * do not display the "Parent Directory" link.
-     */
-    if (r->uri.len == 1) {
-        len -= ngx_sizeof_ssz(t_parentdir_entry);
-    }
+/*
+ * Must be called with the zone locked, which is then to be unlocked with
+ * ngx_http_fancyindex_cache_unlock_zone().
+ */
+static void
+ngx_http_fancyindex_cache_delete(ngx_http_fancyindex_cache_t *cache,
+    ngx_http_fancyindex_cache_node_t *cn)
+{
+    ngx_http_fancyindex_dead_file_t  *df;
 
-    entry = entries.elts;
-    for (i = 0; i < entries.nelts; i++) {
-        /*
-         * Genearated table rows are as follows, unneeded whitespace
-         * is stripped out:
-         *
-         *   <tr>
-         *     <td><a href="U[?sort]">fname</a></td>
-         *     <td>size</td><td>date</td>
-         *   </tr>
-         */
-        len += ngx_sizeof_ssz("<tr><td><a href=\"")
-            + entry[i].name.len + entry[i].escape /* Escaped URL */
-            + ngx_sizeof_ssz("?C=x&amp;O=y") /* URL sorting arguments */
-            + ngx_sizeof_ssz("\">")
-            + entry[i].name.len + entry[i].utf_len
-            + alcf->name_length + ngx_sizeof_ssz("&gt;")
-            + ngx_sizeof_ssz("</a></td><td>")
-            + 20 /* File size */
-            + ngx_sizeof_ssz("</td><td>")    /* Date prefix */
-            + ngx_sizeof_ssz("</td></tr>\n") /* Date suffix */
-            + 2 /* CR LF */
-            ;
+    if (cn->file_len) {
+        df = ngx_alloc(offsetof(ngx_http_fancyindex_dead_file_t, name)
+                       + cn->file_len + 1, ngx_cycle->log);
+
+        if (df == NULL) {
+            ngx_http_fancyindex_cache_delete_file(cn->data + cn->key_len);
+
+        } else {
+            ngx_memcpy(df->name, cn->data + cn->key_len, cn->file_len + 1);
+            df->next = ngx_http_fancyindex_dead_files;
+            ngx_http_fancyindex_dead_files = df;
+        }
     }
 
-    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(cache->shpool, cn);
+}
+
+
+/**
+ * Allocates a node of n bytes, evicting the least recently used entries
+ * until there is enough room for it. Must be called with the zone locked.
+ */
+static ngx_http_fancyindex_cache_node_t *
+ngx_http_fancyindex_cache_alloc(ngx_http_fancyindex_cache_t *cache, size_t n)
+{
+    ngx_queue_t                       *q;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    while ((cn = ngx_slab_alloc_locked(cache->shpool, n)) == NULL) {
+        if (ngx_queue_empty(&cache->sh->queue))
+            return NULL;
+
+        q = ngx_queue_last(&cache->sh->queue);
+        ngx_http_fancyindex_cache_delete(cache,
+            ngx_queue_data(q, ngx_http_fancyindex_cache_node_t, queue));
+    }
+
+    return cn;
+}
+
+
+/**
+ * Decides what a request does about a listing missing from the cache zone,
+ * or stale, whose node is cn if there is one. Returns NGX_OK to serve the
+ * stale listing while another request builds it, NGX_AGAIN to wait for
+ * that request, and NGX_DECLINED to build the listing, having taken its
+ * lock if possible. Must be called with the zone locked.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_busy(ngx_http_fancyindex_cache_t *cache,
+    ngx_str_t *key, uint32_t hash, ngx_http_fancyindex_cache_node_t *cn,
+    ngx_http_fancyindex_cache_lock_t *lock)
+{
+    ngx_msec_t  now;
+
+    now = ngx_current_msec;
+
+    if (cn && cn->lock && (ngx_msec_int_t) (cn->lock - now) > 0) {
+        if (lock->stale && !cn->empty) {
+            lock->updating = 1;
+            return NGX_OK;
+        }
+
+        if (!lock->wait)
+            return NGX_DECLINED;
+
+        if (lock->deadline == 0)
+            lock->deadline = now + lock->timeout;
+
+        return ((ngx_msec_int_t) (lock->deadline - now) > 0) ? NGX_AGAIN
+                                                             : NGX_DECLINED;
+    }
+
+    /*
+     * Listings which are not stored once built, e.g. because they change
+     * too often, are then built by every request which waited, at once.
+     */
+    if (lock->deadline) {
+        if (cn && !cn->empty && !lock->stale)
+            ngx_http_fancyindex_cache_delete(cache, cn);
+        return NGX_DECLINED;
+    }
+
+    if (cn == NULL || cn->empty) {
+        if (!lock->wait)
+            return NGX_DECLINED;
+    }
+
+    if (cn == NULL) {
+        cn = ngx_http_fancyindex_cache_alloc(cache,
+                 offsetof(ngx_http_fancyindex_cache_node_t, data) + key->len);
+        if (cn == NULL)
+            return NGX_DECLINED;
+
+        ngx_memzero(cn, offsetof(ngx_http_fancyindex_cache_node_t, data));
+        cn->node.key = hash;
+        cn->key_len  = (u_short) key->len;
+        cn->empty    = 1;
+        ngx_memcpy(cn->data, key->data, key->len);
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+    }
+
+    cn->lock = now + lock->timeout;
+    lock->expires = cn->lock;
+
+    return NGX_DECLINED;
+}
+
+
+/**
+ * Releases the lock a request took on its listing, if it still holds it,
+ * once the listing was stored or could not be.
+ */
+static void
+ngx_http_fancyindex_cache_unlock(ngx_shm_zone_t *shm_zone, ngx_str_t *key,
+    ngx_http_fancyindex_cache_lock_t *lock)
+{
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    if (lock->expires == 0)
+        return;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(cache, key,
+                                          ngx_crc32_short(key->data, key->len));
+
+    /* Storing the listing replaced the node, and the lock with it. */
+    if (cn && cn->lock == lock->expires) {
+        if (cn->empty) {
+            ngx_http_fancyindex_cache_delete(cache, cn);
+        } else {
+            cn->lock = 0;
+        }
+    }
+
+    ngx_http_fancyindex_cache_unlock_zone(cache);
+
+    lock->expires = 0;
+}
+
+
+/**
+ * Opens the file of a cached listing, giving a buffer for the len bytes of
+ * the variant at offset, which is sent from the file. NGX_DECLINED is
+ * returned when the file is gone, as it is when the listing was evicted
+ * meanwhile.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_open(ngx_http_request_t *r, ngx_str_t *name,
+    off_t offset, size_t len, ngx_buf_t **pb)
+{
+    ngx_fd_t                  fd;
+    ngx_err_t                 err;
+    ngx_buf_t                *b;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL)
+        return NGX_ERROR;
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%V\" failed", name);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+    clnf->fd = fd;
+    clnf->name = name->data;
+    clnf->log = r->pool->log;
+
+    if ((b = ngx_calloc_buf(r->pool)) == NULL)
+        return NGX_ERROR;
+
+    if ((b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t))) == NULL)
+        return NGX_ERROR;
+
+    b->file->fd = fd;
+    b->file->name = *name;
+    b->file->log = r->connection->log;
+
+    /* Empty variants are neither in memory nor in the file. */
+    b->in_file = (len != 0);
+    b->file_pos = offset;
+    b->file_last = offset + len;
+
+    *pb = b;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Looks up a rendered listing in the cache zone. The entry is used only if
+ * the directory still has the same inode and modification time, otherwise
+ * it is dropped. On success encoding is set to the best variant available
+ * among those in the accept mask, and a copy of that variant is returned
+ * in a new buffer, so the entry may be evicted at any time afterwards.
+ *
+ * With NGX_HTTP_FANCYINDEX_CACHE_WATCHED the directory information is not
+ * needed: only entries which a worker is watching are used, and the inode
+ * and modification time are filled in from the entry.
+ *
+ * Requests which coalesce pass a lock; NGX_AGAIN is then returned while
+ * another request builds the listing, and stale listings may be returned
+ * meanwhile, telling so in the lock.
+ *
+ * Requests which only need headers neither copy the variant nor open its
+ * file, the buffer returned only tells its size, and leave stale entries
+ * for others to replace.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_get(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key, ngx_file_info_t *fi, ngx_uint_t validate,
+    ngx_uint_t accept, ngx_uint_t *encoding, ngx_buf_t **pb,
+    ngx_http_fancyindex_cache_lock_t *lock)
+{
+    off_t                              offset;
+    size_t                             len;
+    uint32_t                           hash;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, e;
+    ngx_str_t                          name;
+    ngx_buf_t                         *b;
+    u_char                            *p;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    cache = shm_zone->data;
+    rc = NGX_DECLINED;
+    b = NULL;
+    offset = 0;
+    len = 0;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(cache, key, hash);
+
+    if (cn == NULL || cn->empty) {
+        if (lock)
+            rc = ngx_http_fancyindex_cache_busy(cache, key, hash, cn, lock);
+        goto done;
+    }
+
+    if (validate == NGX_HTTP_FANCYINDEX_CACHE_ANY) {
+        /* void */
+
+    } else
+#if (NGX_HAVE_INOTIFY)
+    if (validate == NGX_HTTP_FANCYINDEX_CACHE_WATCHED) {
+        if (cn->watched != cache->sh->epoch)
+            goto done;
+
+        fi->st_ino   = cn->uniq;
+        fi->st_mtime = cn->mtime;
+
+    } else
+#endif
+    if (cn->uniq != ngx_file_uniq(fi) || cn->mtime != ngx_file_mtime(fi)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex cache: stale \"%V\"", &r->uri);
+
+        if (lock == NULL) {
+            if (!r->header_only)
+                ngx_http_fancyindex_cache_delete(cache, cn);
+            goto done;
+        }
+
+        rc = ngx_http_fancyindex_cache_busy(cache, key, hash, cn, lock);
+        if (rc != NGX_OK)
+            goto done;
+
+    } else if (validate == NGX_HTTP_FANCYINDEX_CACHE_WATCH) {
+        cn->watched = cache->sh->epoch;
+    }
+
+    /* Prefer brotli over gzip, and both over the plain body. */
+    for (e = NGX_HTTP_FANCYINDEX_ENCODINGS - 1; e > 0; e--) {
+        if (cn->len[e] && (accept & (1 << e)))
+            break;
+    }
+
+    for (i = 0; i < e; i++) {
+        offset += cn->len[i];
+    }
+
+    len = cn->len[e];
+
+    if (r->header_only) {
+        if ((b = ngx_calloc_buf(r->pool)) == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        b->file_last = len;
+
+    } else if (cn->file_len) {
+        /* Only the name is copied, the file is opened once unlocked. */
+        name.len = cn->file_len;
+        if ((name.data = ngx_pnalloc(r->pool, name.len + 1)) == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        ngx_memcpy(name.data, cn->data + cn->key_len, name.len + 1);
+
+    } else {
+        if ((b = ngx_create_temp_buf(r->pool, len)) == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        p = cn->data + cn->key_len + offset;
+        b->last = ngx_cpymem(b->last, p, len);
+    }
+
+    *encoding = e;
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    rc = NGX_OK;
+
+done:
+    ngx_http_fancyindex_cache_unlock_zone(cache);
+
+    if (rc == NGX_OK && b == NULL)
+        rc = ngx_http_fancyindex_cache_open(r, &name, offset, len, &b);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex cache: %s \"%V\"",
+                   (rc == NGX_AGAIN) ? "locked"
+                   : (rc != NGX_OK) ? "miss"
+                   : (lock && lock->updating) ? "updating" : "hit",
+                   &r->uri);
+
+    if (rc == NGX_OK)
+        *pb = b;
+
+    return rc;
+}
+
+
+/**
+ * Writes the variants of a listing to a new file under the cache path,
+ * named after the key and what makes it unique, so that a file is never
+ * rewritten while it may be read.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_file(ngx_http_request_t *r,
+    ngx_http_fancyindex_cache_path_t *cp, ngx_str_t *key,
+    ngx_buf_t **variants, ngx_str_t *name)
+{
+    off_t        offset;
+    size_t       size;
+    u_char      *p;
+    time_t       now;
+    ngx_uint_t   i;
+    ngx_md5_t    md5;
+    ngx_file_t   file;
+    ngx_err_t    err;
+    u_char       digest[16];
+
+    static ngx_uint_t  serial;
+
+    serial++;
+    now = ngx_time();
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, key->data, key->len);
+    ngx_md5_update(&md5, &ngx_pid, sizeof(ngx_pid));
+    ngx_md5_update(&md5, &serial, sizeof(serial));
+    ngx_md5_update(&md5, &now, sizeof(time_t));
+    ngx_md5_final(digest, &md5);
+
+    name->len = cp->path->name.len + 1 + cp->path->len + 2 * 16;
+    if ((name->data = ngx_pnalloc(r->pool, name->len + 1)) == NULL)
+        return NGX_ERROR;
+
+    p = ngx_cpymem(name->data, cp->path->name.data, cp->path->name.len);
+    p += 1 + cp->path->len;
+    p = ngx_hex_dump(p, digest, 16);
+    *p = '\0';
+
+    ngx_create_hashed_filename(cp->path, name->data, name->len);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = *name;
+    file.log = r->connection->log;
+
+    for (i = 0; /* void */; i++) {
+        file.fd = ngx_open_file(name->data, NGX_FILE_WRONLY,
+                                NGX_FILE_TRUNCATE, NGX_FILE_OWNER_ACCESS);
+        if (file.fd != NGX_INVALID_FILE)
+            break;
+
+        err = ngx_errno;
+
+        /* Levels of the path are created as needed. */
+        if (err != NGX_ENOENT || i > 0
+            || ngx_create_path(&file, cp->path) == NGX_ERROR)
+        {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%V\" failed", name);
+            return NGX_ERROR;
+        }
+    }
+
+    for (offset = 0, i = 0; i < NGX_HTTP_FANCYINDEX_ENCODINGS; i++) {
+        if (variants[i] == NULL)
+            continue;
+
+        size = variants[i]->last - variants[i]->pos;
+
+        if (ngx_write_file(&file, variants[i]->pos, size, offset)
+            != (ssize_t) size)
+        {
+            break;
+        }
+
+        offset += size;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", name);
+    }
+
+    if (i < NGX_HTTP_FANCYINDEX_ENCODINGS) {
+        if (ngx_delete_file(name->data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%V\" failed", name);
+        }
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Returns the size of the node holding a listing whose variants take len
+ * bytes, which is smaller when the listing is written to a file under the
+ * cache path, or zero when the key is too long to be stored at all.
+ */
+static size_t
+ngx_http_fancyindex_cache_node_size(ngx_str_t *key, size_t len,
+    ngx_http_fancyindex_cache_path_t *cp)
+{
+    if (key->len > 0xffff)
+        return 0;
+
+    if (cp && len >= cp->min_size)
+        len = cp->path->name.len + 1 + cp->path->len + 2 * 16 + 1;
+
+    return offsetof(ngx_http_fancyindex_cache_node_t, data) + key->len + len;
+}
+
+
+/**
+ * Stores a rendered listing in the cache zone, evicting the least recently
+ * used entries until there is enough room for it. The variants array is
+ * indexed by encoding, with NULL for variants which are not available; the
+ * identity one is mandatory. Entries stored as watched can be used without
+ * checking the directory until the current epoch of the zone ends. Entries
+ * stored without directory information are snapshots. Listings of at least
+ * the minimum size of the cache path, if any, are written to files and
+ * only their name is kept in the zone.
+ */
+static void
+ngx_http_fancyindex_cache_put(ngx_http_request_t *r, ngx_shm_zone_t *shm_zone,
+    ngx_str_t *key, ngx_file_info_t *fi, ngx_uint_t watched,
+    ngx_buf_t **variants, ngx_http_fancyindex_cache_path_t *cp)
+{
+    size_t                             n, len;
+    u_char                            *p;
+    uint32_t                           hash;
+    ngx_uint_t                         i;
+    ngx_str_t                          file;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    cache = shm_zone->data;
+
+    for (len = 0, i = 0; i < NGX_HTTP_FANCYINDEX_ENCODINGS; i++) {
+        if (variants[i])
+            len += variants[i]->last - variants[i]->pos;
+    }
+
+    /*
+     * Directories which changed during the last second may change again
+     * without their modification time being updated: do not cache them.
+     */
+    if (fi && ngx_file_mtime(fi) >= ngx_time())
+        return;
+
+    n = ngx_http_fancyindex_cache_node_size(key, len, cp);
+
+    /* Skip listings which would need to flush most of the zone. */
+    if (n == 0 || n > cache->max_len)
+        return;
+
+    file.len = 0;
+
+    if (cp && len >= cp->min_size) {
+        if (ngx_http_fancyindex_cache_file(r, cp, key, variants, &file)
+            != NGX_OK)
+        {
+            return;
+        }
+    }
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if ((cn = ngx_http_fancyindex_cache_lookup(cache, key, hash)) != NULL) {
+        ngx_http_fancyindex_cache_delete(cache, cn);
+    }
+
+    if ((cn = ngx_http_fancyindex_cache_alloc(cache, n)) == NULL) {
+        ngx_http_fancyindex_cache_unlock_zone(cache);
+        goto failed;
+    }
+
+    cn->node.key = hash;
+    cn->uniq     = fi ? ngx_file_uniq(fi) : 0;
+    cn->mtime    = fi ? ngx_file_mtime(fi) : 0;
+    cn->watched  = watched ? cache->sh->epoch : 0;
+    cn->lock     = 0;
+    cn->key_len  = (u_short) key->len;
+    cn->file_len = (u_short) file.len;
+    cn->status   = 0;
+    cn->empty    = 0;
+
+    p = ngx_cpymem(cn->data, key->data, key->len);
+
+    if (file.len)
+        ngx_memcpy(p, file.data, file.len + 1);
+
+    for (i = 0; i < NGX_HTTP_FANCYINDEX_ENCODINGS; i++) {
+        if (variants[i] == NULL) {
+            cn->len[i] = 0;
+            continue;
+        }
+
+        cn->len[i] = variants[i]->last - variants[i]->pos;
+        if (file.len == 0)
+            p = ngx_cpymem(p, variants[i]->pos, cn->len[i]);
+    }
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex cache: stored \"%V\", %uz bytes%s",
+                   &r->uri, len, file.len ? " in a file" : "");
+
+    ngx_http_fancyindex_cache_unlock_zone(cache);
+    return;
+
+failed:
+
+    if (file.len && ngx_delete_file(file.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%V\" failed", &file);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_error_key(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_str_t *key)
+{
+    key->len = NGX_INT_T_LEN + ngx_sizeof_ssz(":error:") + ctx->path.len;
+    if ((key->data = ngx_pnalloc(r->pool, key->len)) == NULL)
+        return NGX_ERROR;
+
+    key->len = ngx_sprintf(key->data, "%ui:error:%V", alcf->generation,
+                           &ctx->path)
+               - key->data;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Looks up the error cached for the directory of the request, with
+ * fancyindex_cache_errors. Returns the status of the response, or
+ * NGX_DECLINED when the directory has to be read. Expired errors are
+ * dropped.
+ */
+static ngx_int_t
+ngx_http_fancyindex_error_get(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_int_t                          rc;
+    ngx_str_t                          key;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    if (ngx_http_fancyindex_error_key(r, ctx, alcf, &key) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    cache = alcf->cache->data;
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(cache, &key,
+                                          ngx_crc32_short(key.data, key.len));
+
+    if (cn && cn->status) {
+        if (cn->mtime > ngx_time()) {
+            rc = cn->status;
+            ngx_queue_remove(&cn->queue);
+            ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+        } else {
+            ngx_http_fancyindex_cache_delete(cache, cn);
+        }
+    }
+
+    ngx_http_fancyindex_cache_unlock_zone(cache);
+
+    if (rc != NGX_DECLINED) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex cache: error %i \"%V\"",
+                       rc, &r->uri);
+    }
+
+    return rc;
+}
+
+
+/**
+ * Remembers that the directory of the request cannot be listed, when the
+ * response is a 404 or a 403 and errors are cached, and passes the status
+ * through. Requests for the directory then fail at once until the error
+ * expires, without touching the file system nor logging the failure again.
+ */
+static ngx_int_t
+ngx_http_fancyindex_failed(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_int_t rc)
+{
+    ngx_str_t                          key;
+    uint32_t                           hash;
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_cache_node_t  *cn;
+    ngx_http_fancyindex_loc_conf_t    *alcf;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if ((rc != NGX_HTTP_NOT_FOUND && rc != NGX_HTTP_FORBIDDEN)
+        || alcf->cache == NULL || alcf->cache_errors == 0
+        || ngx_http_fancyindex_error_key(r, ctx, alcf, &key) != NGX_OK)
+    {
+        return rc;
+    }
+
+    cache = alcf->cache->data;
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if ((cn = ngx_http_fancyindex_cache_lookup(cache, &key, hash)) != NULL) {
+        ngx_http_fancyindex_cache_delete(cache, cn);
+    }
+
+    cn = ngx_http_fancyindex_cache_alloc(cache,
+             offsetof(ngx_http_fancyindex_cache_node_t, data) + key.len);
+
+    if (cn) {
+        ngx_memzero(cn, offsetof(ngx_http_fancyindex_cache_node_t, data));
+        cn->node.key = hash;
+        cn->mtime    = ngx_time() + alcf->cache_errors;
+        cn->key_len  = (u_short) key.len;
+        cn->status   = (u_short) rc;
+        ngx_memcpy(cn->data, key.data, key.len);
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+    }
+
+    ngx_http_fancyindex_cache_unlock_zone(cache);
+
+    return rc;
+}
+
+
+#if (NGX_HAVE_INOTIFY)
+
+/*
+ * Each worker watches the directories whose listings it stores in a cache
+ * zone, and drops those entries as soon as anything in the directory is
+ * created, deleted, renamed, written to or has its attributes changed. A
+ * watch is removed once it fires: the next listing which is generated for
+ * the directory adds it again.
+ */
+#define NGX_HTTP_FANCYINDEX_WATCH_MASK \
+    (IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO \
+     |IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+#define NGX_HTTP_FANCYINDEX_WATCH_POOL_SIZE  1024
+
+
+typedef struct ngx_http_fancyindex_watch_key_s
+    ngx_http_fancyindex_watch_key_t;
+
+/**
+ * A cache entry to drop when a watched directory changes.
+ */
+struct ngx_http_fancyindex_watch_key_s {
+    ngx_http_fancyindex_watch_key_t *next;
+    ngx_shm_zone_t                  *zone;
+    ngx_str_t                        key;
+};
+
+/**
+ * A directory watched by this worker, keyed by its watch descriptor; the
+ * descriptors returned by inotify are not reused while watches are added.
+ */
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_pool_t                      *pool;
+    ngx_http_fancyindex_watch_key_t *keys;
+} ngx_http_fancyindex_watch_t;
+
+typedef struct {
+    ngx_connection_t  *connection; /**< Of the inotify descriptor. */
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    unsigned           failed:1;   /**< Do not try to set it up again. */
+    unsigned           full:1;     /**< Running out of watches was logged. */
+} ngx_http_fancyindex_watcher_t;
+
+static ngx_http_fancyindex_watcher_t  ngx_http_fancyindex_watcher;
+
+
+static ngx_http_fancyindex_watch_t *
+ngx_http_fancyindex_watch_lookup(int wd)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = ngx_http_fancyindex_watcher.rbtree.root;
+    sentinel = ngx_http_fancyindex_watcher.rbtree.sentinel;
+
+    while (node != sentinel) {
+        if ((ngx_rbtree_key_t) wd == node->key)
+            return (ngx_http_fancyindex_watch_t *) node;
+
+        node = ((ngx_rbtree_key_t) wd < node->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Drops the cache entries listed in a watch, and then the watch itself.
+ * The kernel has already removed the watch when it sends IN_IGNORED.
+ */
+static void
+ngx_http_fancyindex_watch_drop(ngx_http_fancyindex_watch_t *w,
+    ngx_uint_t remove)
+{
+    ngx_http_fancyindex_cache_t       *cache;
+    ngx_http_fancyindex_watch_key_t   *k;
+    ngx_http_fancyindex_cache_node_t  *cn;
+
+    for (k = w->keys; k; k = k->next) {
+        cache = k->zone->data;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        cn = ngx_http_fancyindex_cache_lookup(cache, &k->key,
+                 ngx_crc32_short(k->key.data, k->key.len));
+        if (cn != NULL) {
+            ngx_http_fancyindex_cache_delete(cache, cn);
+        }
+
+        ngx_http_fancyindex_cache_unlock_zone(cache);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http fancyindex watch: dropped %i",
+                   (ngx_int_t) w->node.key);
+
+    if (remove) {
+        (void) inotify_rm_watch(ngx_http_fancyindex_watcher.connection->fd,
+                                (int) w->node.key);
+    }
+
+    ngx_rbtree_delete(&ngx_http_fancyindex_watcher.rbtree, &w->node);
+    ngx_destroy_pool(w->pool);
+}
+
+
+static void
+ngx_http_fancyindex_watch_handler(ngx_event_t *ev)
+{
+    u_char                        *p;
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_connection_t              *c;
+    struct inotify_event          *ie;
+    ngx_http_fancyindex_watch_t   *w;
+    union {
+        struct inotify_event       event;
+        u_char                     data[4096];
+    } buf;
+
+    c = ev->data;
+
+    for ( ;; ) {
+        n = read(c->fd, buf.data, sizeof(buf.data));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR)
+                continue;
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "read() from inotify failed");
+            }
+
+            return;
+        }
+
+        if (n == 0)
+            return;
+
+        for (p = buf.data; p < buf.data + n;
+             p += sizeof(struct inotify_event) + ie->len)
+        {
+            ie = (struct inotify_event *) p;
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+                /* Changes were missed, nothing watched can be trusted. */
+                ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                              "inotify queue overflow, "
+                              "dropping watched listings");
+
+                while (ngx_http_fancyindex_watcher.rbtree.root
+                       != ngx_http_fancyindex_watcher.rbtree.sentinel)
+                {
+                    ngx_http_fancyindex_watch_drop(
+                        (ngx_http_fancyindex_watch_t *)
+                        ngx_http_fancyindex_watcher.rbtree.root, 1);
+                }
+
+                continue;
+            }
+
+            if ((w = ngx_http_fancyindex_watch_lookup(ie->wd)) != NULL) {
+                ngx_http_fancyindex_watch_drop(w, !(ie->mask & IN_IGNORED));
+            }
+        }
+    }
+}
+
+
+/**
+ * Sets up the inotify descriptor of the worker when a directory has to be
+ * watched for the first time.
+ */
+static ngx_int_t
+ngx_http_fancyindex_watch_init(void)
+{
+    int                fd;
+    ngx_connection_t  *c;
+
+    if (ngx_http_fancyindex_watcher.connection)
+        return NGX_OK;
+
+    if (ngx_http_fancyindex_watcher.failed)
+        return NGX_DECLINED;
+
+    ngx_http_fancyindex_watcher.failed = 1;
+
+    if ((fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "inotify_init1() failed");
+        return NGX_DECLINED;
+    }
+
+    if ((c = ngx_get_connection(fd, ngx_cycle->log)) == NULL) {
+        (void) close(fd);
+        return NGX_DECLINED;
+    }
+
+    c->read->handler = ngx_http_fancyindex_watch_handler;
+    c->read->log = c->log;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_DECLINED;
+    }
+
+    ngx_rbtree_init(&ngx_http_fancyindex_watcher.rbtree,
+                    &ngx_http_fancyindex_watcher.sentinel,
+                    ngx_rbtree_insert_value);
+
+    ngx_http_fancyindex_watcher.connection = c;
+    ngx_http_fancyindex_watcher.failed = 0;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Watches the directory being listed. This is done before its information
+ * is read, so that no change which happens afterwards can be missed.
+ */
+static void
+ngx_http_fancyindex_watch(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx)
+{
+    int                           wd;
+    ngx_err_t                     err;
+    ngx_pool_t                   *pool;
+    ngx_http_fancyindex_watch_t  *w;
+
+    if (ngx_http_fancyindex_watch_init() != NGX_OK)
+        return;
+
+    wd = inotify_add_watch(ngx_http_fancyindex_watcher.connection->fd,
+                           (char *) ctx->path.data,
+                           NGX_HTTP_FANCYINDEX_WATCH_MASK);
+    if (wd == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOSPC && !ngx_http_fancyindex_watcher.full) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, err,
+                          "inotify_add_watch(\"%s\") failed, cached listings "
+                          "will be validated with stat()", ctx->path.data);
+            ngx_http_fancyindex_watcher.full = 1;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, err,
+                       "http fancyindex watch: \"%s\" failed (%d)",
+                       ctx->path.data, err);
+        return;
+    }
+
+    if (ngx_http_fancyindex_watch_lookup(wd) == NULL) {
+        if ((pool = ngx_create_pool(NGX_HTTP_FANCYINDEX_WATCH_POOL_SIZE,
+                                    ngx_cycle->log)) == NULL)
+        {
+            (void) inotify_rm_watch(ngx_http_fancyindex_watcher.connection->fd,
+                                    wd);
+            return;
+        }
+
+        if ((w = ngx_palloc(pool, sizeof(ngx_http_fancyindex_watch_t)))
+                == NULL)
+        {
+            ngx_destroy_pool(pool);
+            (void) inotify_rm_watch(ngx_http_fancyindex_watcher.connection->fd,
+                                    wd);
+            return;
+        }
+
+        w->node.key = (ngx_rbtree_key_t) wd;
+        w->pool = pool;
+        w->keys = NULL;
+
+        ngx_rbtree_insert(&ngx_http_fancyindex_watcher.rbtree, &w->node);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex watch: \"%s\" is %d",
+                   ctx->path.data, wd);
+
+    ctx->wd = wd;
+}
+
+
+/**
+ * Records the cache key of the request in the watch of its directory.
+ * Returns whether the directory is still watched, in which case the entry
+ * can be marked as such: it will be dropped when the watch fires.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_watch_key(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_shm_zone_t *zone)
+{
+    ngx_http_fancyindex_watch_t      *w;
+    ngx_http_fancyindex_watch_key_t  *k;
+
+    if (ctx->wd == 0 || (w = ngx_http_fancyindex_watch_lookup(ctx->wd)) == NULL)
+        return 0;
+
+    for (k = w->keys; k; k = k->next) {
+        if (k->zone == zone && k->key.len == ctx->key.len
+            && ngx_memcmp(k->key.data, ctx->key.data, ctx->key.len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    k = ngx_palloc(w->pool, sizeof(ngx_http_fancyindex_watch_key_t)
+                            + ctx->key.len);
+    if (k == NULL)
+        return 0;
+
+    k->zone = zone;
+    k->key.len = ctx->key.len;
+    k->key.data = (u_char *) (k + 1);
+    ngx_memcpy(k->key.data, ctx->key.data, ctx->key.len);
+
+    k->next = w->keys;
+    w->keys = k;
+
+    return 1;
+}
+
+#endif /* NGX_HAVE_INOTIFY */
+
+
+/**
+ * Starts a new epoch in every cache zone: entries marked as watched by
+ * processes which have exited, or crashed, are checked again with stat()
+ * until a live worker watches them.
+ */
+static void
+ngx_http_fancyindex_cache_new_epoch(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                    i;
+    ngx_list_part_t              *part;
+    ngx_shm_zone_t               *shm_zone;
+    ngx_http_fancyindex_cache_t  *cache;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                break;
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_fancyindex_module)
+            continue;
+
+        cache = shm_zone[i].data;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        cache->sh->epoch++;
+        ngx_http_fancyindex_cache_unlock_zone(cache);
+    }
+}
+
+
+#if (NGX_HTTP_GZIP)
+
+/**
+ * Tells whether "br" is listed in the Accept-Encoding request header with
+ * a non-zero quality value.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_accept_br(ngx_http_request_t *r)
+{
+    u_char           *p, *last, *start;
+    ngx_uint_t        br, zero;
+    ngx_table_elt_t  *ae;
+
+    if ((ae = r->headers_in.accept_encoding) == NULL)
+        return 0;
+
+    p = ae->value.data;
+    last = p + ae->value.len;
+
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+
+        start = p;
+        while (p < last && *p != ' ' && *p != '\t' && *p != ',' && *p != ';')
+            p++;
+
+        br = (p - start == 2 && ngx_strncasecmp(start, (u_char *) "br", 2) == 0);
+        zero = 0;
+
+        /* Parameters, of which only "q" is relevant. */
+        while (p < last && *p != ',') {
+            if (*p++ != ';')
+                continue;
+
+            while (p < last && (*p == ' ' || *p == '\t'))
+                p++;
+
+            if (last - p < 3 || (*p | 0x20) != 'q' || p[1] != '=')
+                continue;
+
+            p += 2;
+            if (*p != '0')
+                continue;
+
+            for (zero = 1, p++; p < last && *p != ',' && *p != ';'; p++) {
+                if (*p >= '1' && *p <= '9')
+                    zero = 0;
+            }
+        }
+
+        if (br)
+            return !zero;
+    }
+
+    return 0;
+}
+
+#endif /* NGX_HTTP_GZIP */
+
+
+/**
+ * Returns the mask of encodings in which a listing may be sent.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_accepted(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_uint_t accept = 1 << NGX_HTTP_FANCYINDEX_IDENTITY;
+
+#if (NGX_HTTP_GZIP)
+    if ((alcf->compress & (1 << NGX_HTTP_FANCYINDEX_GZIP))
+        && ngx_http_gzip_ok(r) == NGX_OK)
+    {
+        accept |= 1 << NGX_HTTP_FANCYINDEX_GZIP;
+    }
+
+    if ((alcf->compress & (1 << NGX_HTTP_FANCYINDEX_BROTLI))
+        && r == r->main && ngx_http_fancyindex_accept_br(r))
+    {
+        accept |= 1 << NGX_HTTP_FANCYINDEX_BROTLI;
+    }
+#else
+    (void) r;    /* unused */
+    (void) alcf; /* unused */
+#endif /* NGX_HTTP_GZIP */
+
+    return accept;
+}
+
+
+#if (NGX_ZLIB)
+
+static ngx_buf_t *
+ngx_http_fancyindex_gzip(ngx_http_request_t *r, ngx_buf_t *in,
+    ngx_uint_t level)
+{
+    int        rc;
+    z_stream   zs;
+    ngx_buf_t *b;
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    rc = deflateInit2(&zs, (int) level, Z_DEFLATED, MAX_WBITS + 16,
+                      MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "deflateInit2() failed: %d", rc);
+        return NULL;
+    }
+
+    b = ngx_create_temp_buf(r->pool,
+                            deflateBound(&zs, (uLong) (in->last - in->pos)));
+    if (b == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in   = in->pos;
+    zs.avail_in  = (uInt) (in->last - in->pos);
+    zs.next_out  = b->pos;
+    zs.avail_out = (uInt) (b->end - b->pos);
+
+    rc = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "deflate() failed: %d", rc);
+        return NULL;
+    }
+
+    b->last = zs.next_out;
+
+    return b;
+}
+
+#endif /* NGX_ZLIB */
+
+
+#if (NGX_HAVE_BROTLI)
+
+static ngx_buf_t *
+ngx_http_fancyindex_brotli(ngx_http_request_t *r, ngx_buf_t *in,
+    ngx_uint_t quality)
+{
+    size_t     len;
+    ngx_buf_t *b;
+
+    len = BrotliEncoderMaxCompressedSize(in->last - in->pos);
+    if (len == 0)
+        return NULL;
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NULL;
+
+    if (!BrotliEncoderCompress((int) quality, BROTLI_DEFAULT_WINDOW,
+                               BROTLI_MODE_TEXT,
+                               in->last - in->pos, in->pos, &len, b->pos))
+    {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "BrotliEncoderCompress() failed");
+        return NULL;
+    }
+
+    b->last = b->pos + len;
+
+    return b;
+}
+
+#endif /* NGX_HAVE_BROTLI */
+
+
+/**
+ * Compresses the complete page, that is the built-in header, the table in
+ * variants[NGX_HTTP_FANCYINDEX_IDENTITY] and the built-in footer for HTML
+ * listings, in each of the configured encodings. Variants which cannot be
+ * generated are left as NULL.
+ */
+static void
+ngx_http_fancyindex_compress_page(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_buf_t **variants)
+{
+    ngx_buf_t   *footer, *page, *table;
+    ngx_chain_t *header, *cl;
+    size_t       len;
+
+    table = variants[NGX_HTTP_FANCYINDEX_IDENTITY];
+
+    /* Other formats have neither header nor footer. */
+    if (ctx->format != NGX_HTTP_FANCYINDEX_FORMAT_HTML) {
+        page = table;
+        goto compress;
+    }
+
+    if ((header = make_header_chain(r, alcf)) == NULL)
+        return;
+
+    if ((footer = make_footer_buf(r)) == NULL)
+        return;
+
+    len = (table->last - table->pos) + (footer->last - footer->pos);
+    for (cl = header; cl; cl = cl->next)
+        len += cl->buf->last - cl->buf->pos;
+
+    if ((page = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return;
+
+    for (cl = header; cl; cl = cl->next)
+        page->last = ngx_cpymem(page->last, cl->buf->pos,
+                                cl->buf->last - cl->buf->pos);
+    page->last = ngx_cpymem(page->last, table->pos, table->last - table->pos);
+    page->last = ngx_cpymem(page->last, footer->pos, footer->last - footer->pos);
+
+compress:
+
+#if (NGX_ZLIB)
+    if (alcf->compress & (1 << NGX_HTTP_FANCYINDEX_GZIP))
+        variants[NGX_HTTP_FANCYINDEX_GZIP] =
+            ngx_http_fancyindex_gzip(r, page, alcf->compress_level);
+#endif /* NGX_ZLIB */
+
+#if (NGX_HAVE_BROTLI)
+    if (alcf->compress & (1 << NGX_HTTP_FANCYINDEX_BROTLI))
+        variants[NGX_HTTP_FANCYINDEX_BROTLI] =
+            ngx_http_fancyindex_brotli(r, page, alcf->compress_level);
+#endif /* NGX_HAVE_BROTLI */
+
+    if (page != table)
+        ngx_pfree(r->pool, page->start);
+}
+
+
+/**
+ * Adds "Vary: Accept-Encoding" to responses of locations which keep
+ * compressed variants of listings, and "Vary: Accept" to responses whose
+ * format was chosen from the Accept request header.
+ */
+static ngx_int_t
+ngx_http_fancyindex_vary(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx)
+{
+    static ngx_str_t  values[] = {
+        ngx_string("Accept-Encoding"),
+        ngx_string("Accept"),
+        ngx_string("Accept, Accept-Encoding"),
+    };
+
+    ngx_uint_t        vary;
+    ngx_table_elt_t  *h;
+#if (NGX_HTTP_GZIP)
+    ngx_http_core_loc_conf_t *clcf;
+#endif
+
+    vary = (ctx->vary ? 1 : 0) | (ctx->vary_accept ? 2 : 0);
+
+#if (NGX_HTTP_GZIP)
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if ((vary & 1) && clcf->gzip_vary) {
+        /* Let the header filter add it, as the gzip filter may do. */
+        r->gzip_vary = 1;
+        vary &= ~1;
+    }
+#endif /* NGX_HTTP_GZIP */
+
+    if (vary == 0)
+        return NGX_OK;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Vary");
+    h->value = values[vary - 1];
+
+    return NGX_OK;
+}
+
+
+
+static const char *ngx_http_fancyindex_sort_url_args[] = {
+    "?C=N&amp;O=A", "?C=S&amp;O=A", "?C=M&amp;O=A",
+    "?C=N&amp;O=D", "?C=S&amp;O=D", "?C=M&amp;O=D",
+};
+
+
+/**
+ * Determine the sorting criterion. URL arguments look like:
+ *
+ *    C=x[&O=y]
+ *
+ * Where x={M,S,N} and y={A,D}, possibly along with other arguments.
+ * Unless the criterion is the configured default one, sort_url_args is
+ * set to the arguments which have to be appended to links to
+ * subdirectories to keep the same sorting.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_sort_criterion(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf, const char **sort_url_args)
+{
+    ngx_str_t  value;
+    ngx_uint_t criterion;
+
+    *sort_url_args = "";
+
+    if (ngx_http_arg(r, (u_char *) "C", 1, &value) == NGX_OK
+        && value.len > 0)
+    {
+        /* Pick the sorting criteria */
+        switch (value.data[0]) {
+            case 'M': /* Sort by mtime */
+                criterion = NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE;
+                break;
+            case 'S': /* Sort by size */
+                criterion = NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE;
+                break;
+            case 'N': /* Sort by name */
+            default:
+                criterion = NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME;
+                break;
+        }
+
+        /* Determine whether the direction of the sorting */
+        if (ngx_http_arg(r, (u_char *) "O", 1, &value) == NGX_OK
+            && value.len > 0 && value.data[0] == 'D')
+        {
+            criterion += NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC;
+        }
+
+        if (criterion != alcf->default_sort)
+            *sort_url_args = ngx_http_fancyindex_sort_url_args[criterion];
+
+        return criterion;
+    }
+
+    return alcf->default_sort;
+}
+
+
+
+/**
+ * Length of the table row generated for an entry. Generated table rows are
+ * as follows, unneeded whitespace is stripped out:
+ *
+ *   <tr>
+ *     <td><a href="U[?sort]">fname</a></td>
+ *     <td>size</td><td>date</td>
+ *   </tr>
+ */
+#define NGX_HTTP_FANCYINDEX_DATES     256
+#define NGX_HTTP_FANCYINDEX_DATE_LEN  64
+
+/**
+ * Recently formatted timestamps, kept by the worker across rows and
+ * requests. Slots are picked from the timestamp truncated to what the time
+ * format shows, and belong to the configuration which filled them in.
+ */
+typedef struct {
+    ngx_uint_t  generation;
+    time_t      key;
+    size_t      len;
+    u_char      date[NGX_HTTP_FANCYINDEX_DATE_LEN];
+} ngx_http_fancyindex_date_t;
+
+static ngx_http_fancyindex_date_t
+    ngx_http_fancyindex_dates[NGX_HTTP_FANCYINDEX_DATES];
+
+
+/**
+ * Finds the slot of a timestamp, already adjusted to local time if needed,
+ * formatting it if needed. Only runs in the main thread, as rows are never
+ * rendered in thread pools.
+ */
+static ngx_http_fancyindex_date_t *
+ngx_http_fancyindex_date_slot(ngx_http_fancyindex_loc_conf_t *alcf, time_t t)
+{
+    ngx_http_fancyindex_date_t  *d;
+    ngx_tm_t                     tm;
+    time_t                       key;
+
+    /* Round towards minus infinity, for timestamps before the Epoch. */
+    key = t / alcf->date_resolution;
+    if (t % alcf->date_resolution < 0)
+        key--;
+
+    d = &ngx_http_fancyindex_dates[((ngx_uint_t) key * 2654435761U
+                                    ^ alcf->generation)
+                                   % NGX_HTTP_FANCYINDEX_DATES];
+
+    if (d->generation != alcf->generation || d->key != key) {
+        ngx_gmtime(t, &tm);
+        d->len = ngx_fancyindex_timefmt(d->date, alcf->time_ops, &tm)
+                 - d->date;
+        d->key = key;
+        d->generation = alcf->generation;
+    }
+
+    return d;
+}
+
+
+static u_char *
+ngx_http_fancyindex_date(u_char *p, ngx_http_fancyindex_loc_conf_t *alcf,
+    time_t t)
+{
+    ngx_http_fancyindex_date_t  *d;
+    ngx_tm_t                     tm;
+
+    if (alcf->date_len > NGX_HTTP_FANCYINDEX_DATE_LEN) {
+        ngx_gmtime(t, &tm);
+        return ngx_fancyindex_timefmt(p, alcf->time_ops, &tm);
+    }
+
+    d = ngx_http_fancyindex_date_slot(alcf, t);
+
+    return ngx_cpymem(p, d->date, d->len);
+}
+
+
+/**
+ * Length of a formatted timestamp. Timestamps are only formatted up front
+ * when the format includes names of days or months; the slot is then
+ * usually still there when the row is rendered.
+ */
+static size_t
+ngx_http_fancyindex_date_len(ngx_http_fancyindex_loc_conf_t *alcf, time_t t)
+{
+    if (alcf->date_fixed || alcf->date_len > NGX_HTTP_FANCYINDEX_DATE_LEN)
+        return alcf->date_len;
+
+    return ngx_http_fancyindex_date_slot(alcf, t)->len;
+}
+
+
+/**
+ * Time shown for an entry, in local time if configured so.
+ */
+#define ngx_http_fancyindex_mtime(alcf, entry)                               \
+    ((entry)->mtime + (ngx_timeofday())->gmtoff * 60 * (alcf)->localtime)
+
+
+/**
+ * Number of bytes of the first characters of a UTF-8 name, up to n of
+ * them. Stops where ngx_utf8_cpystrn() would, at invalid sequences.
+ */
+static size_t
+ngx_http_fancyindex_utf8_prefix(u_char *name, size_t len, size_t n)
+{
+    u_char  *p, *next, *end;
+
+    p = name;
+    end = name + len;
+
+    while (n-- && p < end) {
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+
+        next = p;
+        if (ngx_utf8_decode(&next, end - p) > 0x10ffff)
+            break;
+
+        p = next;
+    }
+
+    return p - name;
+}
+
+
+/**
+ * Number of bytes of the name of an entry shown in HTML listings. Names
+ * longer than fancyindex_name_length characters are cut, to leave room for
+ * the ellipsis.
+ */
+static size_t
+ngx_http_fancyindex_shown_len(ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_http_fancyindex_entry_t *entry)
+{
+    size_t  n;
+
+    n = (entry->utf_len > alcf->name_length) ? alcf->name_length - 3
+                                             : alcf->name_length;
+
+    if (entry->name.len == entry->utf_len)
+        return ngx_min(entry->name.len, n);
+
+    return ngx_http_fancyindex_utf8_prefix(entry->name.data, entry->name.len,
+                                           n);
+}
+
+
+/**
+ * Number of characters of a number printed in decimal.
+ */
+static size_t
+ngx_http_fancyindex_num_len(int64_t n)
+{
+    size_t    len;
+    uint64_t  u;
+
+    len = 1;
+
+    if (n < 0) {
+        u = - (uint64_t) n;
+        len++;
+    } else {
+        u = n;
+    }
+
+    while (u >= 10) {
+        u /= 10;
+        len++;
+    }
+
+    return len;
+}
+
+
+/**
+ * Pairs of decimal digits, so that numbers are written two digits at a
+ * time.
+ */
+static const u_char  ngx_http_fancyindex_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+
+/**
+ * Writes a number right aligned in width bytes, padded with spaces; numbers
+ * with more digits are written whole.
+ */
+static u_char *
+ngx_http_fancyindex_pad_num(u_char *p, uint64_t n, size_t width)
+{
+    u_char      buf[NGX_INT64_LEN], *q, *last;
+    size_t      len;
+    ngx_uint_t  d;
+
+    q = last = buf + sizeof(buf);
+
+    while (n >= 100) {
+        d = (ngx_uint_t) (n % 100) * 2;
+        n /= 100;
+        *--q = ngx_http_fancyindex_digits[d + 1];
+        *--q = ngx_http_fancyindex_digits[d];
+    }
+
+    if (n >= 10) {
+        d = (ngx_uint_t) n * 2;
+        *--q = ngx_http_fancyindex_digits[d + 1];
+        *--q = ngx_http_fancyindex_digits[d];
+    } else {
+        *--q = (u_char) ('0' + n);
+    }
+
+    len = last - q;
+
+    if (len < width) {
+        ngx_memset(p, ' ', width - len);
+        p += width - len;
+    }
+
+    return ngx_cpymem(p, q, len);
+}
+
+
+/**
+ * Writes a size in bytes up to 9999, or else rounded to kilobytes,
+ * megabytes or gigabytes: powers of 1024 with fancyindex_size_units iec,
+ * divided with shifts, or of 1000 with si. Sizes take six digits and the
+ * unit, or a space and six digits, as long as they fit.
+ */
+static u_char *
+ngx_http_fancyindex_human_size(u_char *p,
+    ngx_http_fancyindex_loc_conf_t *alcf, off_t size)
+{
+    uint64_t    n;
+    ngx_uint_t  tier, shift;
+
+    static const u_char  iec[] = " KMG";
+    static const u_char  si[] = " kMG";
+
+    n = (uint64_t) size;
+
+    if (alcf->size_units == NGX_HTTP_FANCYINDEX_UNITS_IEC) {
+        tier = (n > 9999) + (n >= 1 << 20) + (n >= 1 << 30);
+
+        /* Rounds to the nearest, and leaves bytes as they are. */
+        shift = 10 * tier;
+        n = (n + (((uint64_t) 1 << shift) >> 1)) >> shift;
+
+    } else {
+        tier = (n > 9999) + (n >= 1000000) + (n >= 1000000000);
+
+        /* Constant divisors, which compilers turn into multiplications. */
+        switch (tier) {
+        case 3:
+            n = (n + 500000000) / 1000000000;
+            break;
+        case 2:
+            n = (n + 500000) / 1000000;
+            break;
+        case 1:
+            n = (n + 500) / 1000;
+            break;
+        }
+    }
+
+    if (tier == 0)
+        *p++ = ' ';
+
+    p = ngx_http_fancyindex_pad_num(p, n, 6);
+
+    if (tier)
+        *p++ = (alcf->size_units == NGX_HTTP_FANCYINDEX_UNITS_IEC) ? iec[tier]
+                                                                  : si[tier];
+
+    return p;
+}
+
+
+static size_t
+ngx_http_fancyindex_html_row_len(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    off_t   limit;
+    size_t  len;
+
+    len = ngx_sizeof_ssz("<tr><td><a href=\"")
+        + entry->name.len + entry->escape /* Escaped URL */
+        + ngx_sizeof_ssz("\">")
+        + ngx_http_fancyindex_shown_len(alcf, entry)
+        + ngx_sizeof_ssz("</a></td><td>")
+        + ngx_sizeof_ssz("</td><td>")    /* Date prefix */
+        + ngx_http_fancyindex_date_len(alcf,
+                                       ngx_http_fancyindex_mtime(alcf, entry))
+        + ngx_sizeof_ssz("</td></tr>")   /* Date suffix */
+        + 2 /* CR LF */
+        ;
+
+    if (entry->dir) {
+        len += ngx_sizeof_ssz("/") + ngx_sizeof_ssz("-");
+        if (*ctx->sort_url_args)
+            len += ngx_sizeof_ssz("?C=x&amp;O=y"); /* URL sorting arguments */
+    } else if (alcf->exact_size) {
+        len += 19; /* Padded, and off_t never has more digits. */
+    } else {
+        /* Padded to six digits and the unit, unless over a petabyte. */
+        limit = (alcf->size_units == NGX_HTTP_FANCYINDEX_UNITS_SI)
+                ? (off_t) 999999 * 1000000000 : (off_t) 999999 << 30;
+        len += (entry->size < limit) ? 7 : 1 + NGX_OFF_T_LEN;
+    }
+
+    if (entry->utf_len > alcf->name_length) {
+        len += ngx_sizeof_ssz("..&gt;");
+    } else if (entry->dir && entry->utf_len < alcf->name_length) {
+        len += ngx_sizeof_ssz("/");
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_fancyindex_html_row(u_char *p, ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    p = ngx_cpymem_ssz(p, "<tr><td><a href=\"");
+
+    if (entry->escape) {
+        p = (u_char *) ngx_fancyindex_escape_uri(p, entry->name.data,
+                                                 entry->name.len);
+    } else {
+        p = ngx_cpymem_str(p, entry->name);
+    }
+
+    if (entry->dir) {
+        *p++ = '/';
+        if (*ctx->sort_url_args) {
+            p = ngx_cpymem(p, ctx->sort_url_args,
+                           ngx_sizeof_ssz("?C=x&amp;O=y"));
+        }
+    }
+
+    *p++ = '"';
+    *p++ = '>';
+
+    p = ngx_cpymem(p, entry->name.data,
+                   ngx_http_fancyindex_shown_len(alcf, entry));
+
+    if (entry->utf_len > alcf->name_length) {
+        p = ngx_cpymem_ssz(p, "..&gt;</a></td><td>");
+
+    } else {
+        if (entry->dir && entry->utf_len < alcf->name_length) {
+            *p++ = '/';
+        }
+
+        p = ngx_cpymem_ssz(p, "</a></td><td>");
+    }
+
+    if (entry->dir) {
+        *p++ = '-';
+
+    } else if (alcf->exact_size) {
+        p = ngx_http_fancyindex_pad_num(p, (uint64_t) entry->size, 19);
+
+    } else {
+        p = ngx_http_fancyindex_human_size(p, alcf, entry->size);
+    }
+
+    p = ngx_cpymem_ssz(p, "</td><td>");
+    p = ngx_http_fancyindex_date(p, alcf,
+                                 ngx_http_fancyindex_mtime(alcf, entry));
+    p = ngx_cpymem_ssz(p, "</td></tr>");
+
+    *p++ = CR;
+    *p++ = LF;
+
+    return p;
+}
+
+
+/**
+ * Escapes a string to be placed inside a JSON string literal. Works like
+ * ngx_escape_html(): when dst is NULL, the number of additional bytes
+ * needed is returned.
+ */
+static uintptr_t
+ngx_http_fancyindex_escape_json(u_char *dst, u_char *src, size_t size)
+{
+    static u_char  hex[] = "0123456789abcdef";
+    u_char         ch;
+    ngx_uint_t     len;
+
+    if (dst == NULL) {
+        len = 0;
+
+        while (size--) {
+            ch = *src++;
+
+            if (ch == '"' || ch == '\\') {
+                len++;
+            } else if (ch < 0x20) {
+                len += ngx_sizeof_ssz("\\u0000") - 1;
+            }
+        }
+
+        return (uintptr_t) len;
+    }
+
+    while (size--) {
+        ch = *src++;
+
+        if (ch == '"' || ch == '\\') {
+            *dst++ = '\\';
+            *dst++ = ch;
+        } else if (ch < 0x20) {
+            dst = ngx_cpymem_ssz(dst, "\\u00");
+            *dst++ = hex[ch >> 4];
+            *dst++ = hex[ch & 0xf];
+        } else {
+            *dst++ = ch;
+        }
+    }
+
+    return (uintptr_t) dst;
+}
+
+
+/**
+ * Rows of JSON listings are objects in an array:
+ *
+ *   {"name":"fname","type":"file","mtime":N,"size":N}
+ *   {"name":"dname","type":"directory","mtime":N}
+ */
+static size_t
+ngx_http_fancyindex_json_row_len(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    size_t  len;
+
+    (void) ctx;  /* unused */
+    (void) alcf; /* unused */
+
+    /* The separating comma is counted for every row, even the first. */
+    len = ngx_sizeof_ssz(",\n{\"name\":\"")
+        + entry->name.len
+        + ngx_http_fancyindex_escape_json(NULL, entry->name.data,
+                                          entry->name.len)
+        + ngx_http_fancyindex_num_len(entry->mtime)
+        + ngx_sizeof_ssz("}")
+        ;
+
+    if (entry->dir) {
+        len += ngx_sizeof_ssz("\",\"type\":\"directory\",\"mtime\":");
+    } else {
+        len += ngx_sizeof_ssz("\",\"type\":\"file\",\"mtime\":")
+            + ngx_sizeof_ssz(",\"size\":")
+            + ngx_http_fancyindex_num_len(entry->size);
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_fancyindex_json_entry(u_char *p, ngx_http_fancyindex_entry_t *entry)
+{
+    p = ngx_cpymem_ssz(p, "\n{\"name\":\"");
+    p = (u_char *) ngx_http_fancyindex_escape_json(p, entry->name.data,
+                                                   entry->name.len);
+
+    if (entry->dir) {
+        p = ngx_sprintf(p, "\",\"type\":\"directory\",\"mtime\":%T}",
+                        entry->mtime);
+    } else {
+        p = ngx_sprintf(p, "\",\"type\":\"file\",\"mtime\":%T,\"size\":%O}",
+                        entry->mtime, entry->size);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_fancyindex_json_row(u_char *p, ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    (void) alcf; /* unused */
+
+    if (entry != ctx->entries)
+        *p++ = ',';
+
+    return ngx_http_fancyindex_json_entry(p, entry);
+}
+
+
+/**
+ * Rows of XML listings are elements of a <list> document:
+ *
+ *   <file mtime="N" size="N">fname</file>
+ *   <directory mtime="N">dname</directory>
+ */
+static size_t
+ngx_http_fancyindex_xml_row_len(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    size_t  len;
+
+    (void) ctx;  /* unused */
+    (void) alcf; /* unused */
+
+    len = ngx_http_fancyindex_num_len(entry->mtime)
+        + ngx_sizeof_ssz("\">")
+        + entry->name.len
+        + ngx_escape_html(NULL, entry->name.data, entry->name.len)
+        ;
+
+    if (entry->dir) {
+        len += ngx_sizeof_ssz("<directory mtime=\"")
+            + ngx_sizeof_ssz("</directory>\n");
+    } else {
+        len += ngx_sizeof_ssz("<file mtime=\"")
+            + ngx_sizeof_ssz("\" size=\"")
+            + ngx_http_fancyindex_num_len(entry->size)
+            + ngx_sizeof_ssz("</file>\n");
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_fancyindex_xml_row(u_char *p, ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    (void) ctx;  /* unused */
+    (void) alcf; /* unused */
+
+    if (entry->dir) {
+        p = ngx_sprintf(p, "<directory mtime=\"%T\">", entry->mtime);
+    } else {
+        p = ngx_sprintf(p, "<file mtime=\"%T\" size=\"%O\">",
+                        entry->mtime, entry->size);
+    }
+
+    p = (u_char *) ngx_escape_html(p, entry->name.data, entry->name.len);
+
+    if (entry->dir) {
+        p = ngx_cpymem_ssz(p, "</directory>\n");
+    } else {
+        p = ngx_cpymem_ssz(p, "</file>\n");
+    }
+
+    return p;
+}
+
+
+/**
+ * Rows of plain text listings are lines with tab separated fields. Names
+ * are URL-encoded as in links, so they never contain separators and can be
+ * appended to the URL of the listing:
+ *
+ *   fname	size	mtime
+ *   dname/	-	mtime
+ */
+static size_t
+ngx_http_fancyindex_plain_row_len(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    (void) ctx;  /* unused */
+    (void) alcf; /* unused */
+
+    return entry->name.len + entry->escape
+        + (entry->dir ? ngx_sizeof_ssz("/\t-")
+                      : ngx_sizeof_ssz("\t")
+                        + ngx_http_fancyindex_num_len(entry->size))
+        + ngx_sizeof_ssz("\t") + ngx_http_fancyindex_num_len(entry->mtime)
+        + ngx_sizeof_ssz("\n")
+        ;
+}
+
+
+static u_char *
+ngx_http_fancyindex_plain_row(u_char *p, ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *entry)
+{
+    (void) ctx;  /* unused */
+    (void) alcf; /* unused */
+
+    if (entry->escape) {
+        p = (u_char *) ngx_fancyindex_escape_uri(p, entry->name.data,
+                                                 entry->name.len);
+    } else {
+        p = ngx_cpymem_str(p, entry->name);
+    }
+
+    if (entry->dir) {
+        p = ngx_sprintf(p, "/\t-\t%T\n", entry->mtime);
+    } else {
+        p = ngx_sprintf(p, "\t%O\t%T\n", entry->size, entry->mtime);
+    }
+
+    return p;
+}
+
+
+static ngx_http_fancyindex_format_t ngx_http_fancyindex_formats[] = {
+    { ngx_string("text/html"),
+      ngx_null_string,
+      { ngx_sizeof_ssz(t07_list2), (u_char *) t07_list2 },
+      ngx_string("</tbody></table>"
+                 "<p class=\"truncated\">Listing truncated.</p>"),
+      ngx_http_fancyindex_html_row_len,
+      ngx_http_fancyindex_html_row },
+
+    { ngx_string("application/json"),
+      ngx_string("["),
+      ngx_string("\n]\n"),
+      ngx_string("\n]\n"),
+      ngx_http_fancyindex_json_row_len,
+      ngx_http_fancyindex_json_row },
+
+    { ngx_string("text/xml"),
+      ngx_string("<?xml version=\"1.0\"?>\n<list>\n"),
+      ngx_string("</list>\n"),
+      ngx_string("<truncated/>\n</list>\n"),
+      ngx_http_fancyindex_xml_row_len,
+      ngx_http_fancyindex_xml_row },
+
+    { ngx_string("text/plain"),
+      ngx_null_string,
+      ngx_null_string,
+      ngx_null_string,
+      ngx_http_fancyindex_plain_row_len,
+      ngx_http_fancyindex_plain_row },
+
+    /*
+     * NGX_HTTP_FANCYINDEX_FORMAT_JS has no entry: it is a static viewer,
+     * see ngx_http_fancyindex_send_viewer(), which fetches the listing in
+     * the plain text format.
+     */
+};
+
+
+/**
+ * Looks up a request header by name.
+ */
+static ngx_table_elt_t *
+ngx_http_fancyindex_header_in(ngx_http_request_t *r, const char *name,
+    size_t len)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                return NULL;
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == len
+            && ngx_strncasecmp(h[i].key.data, (u_char *) name, len) == 0)
+        {
+            return &h[i];
+        }
+    }
+}
+
+
+/**
+ * Determine the output format. The "F" URL argument, e.g. "?F=json", takes
+ * precedence; otherwise the first media range listed in the Accept request
+ * header is used if it names one of the formats, and the configured format
+ * if not.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_output_format(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_uint_t *negotiated)
+{
+    u_char           *p, *last;
+    ngx_str_t         value;
+    ngx_uint_t        i;
+    ngx_table_elt_t  *accept;
+
+    *negotiated = 0;
+
+    if (ngx_http_arg(r, (u_char *) "F", 1, &value) == NGX_OK) {
+        for (i = 0; ngx_http_fancyindex_format_names[i].name.len; i++) {
+            if (value.len == ngx_http_fancyindex_format_names[i].name.len
+                && ngx_strncasecmp(value.data,
+                                   ngx_http_fancyindex_format_names[i].name.data,
+                                   value.len) == 0)
+            {
+                return ngx_http_fancyindex_format_names[i].value;
+            }
+        }
+
+        return alcf->format;
+    }
+
+    *negotiated = 1;
+
+    accept = ngx_http_fancyindex_header_in(r, "Accept",
+                                           ngx_sizeof_ssz("Accept"));
+    if (accept == NULL)
+        return alcf->format;
+
+    p = accept->value.data;
+    last = p + accept->value.len;
+
+    while (p < last && (*p == ' ' || *p == '\t'))
+        p++;
+
+    for (value.data = p; p < last && *p != ',' && *p != ';'
+                         && *p != ' ' && *p != '\t'; p++)
+        /* void */ ;
+
+    value.len = p - value.data;
+
+    if (value.len == ngx_sizeof_ssz("application/xml")
+        && ngx_strncasecmp(value.data, (u_char *) "application/xml",
+                           value.len) == 0)
+    {
+        return NGX_HTTP_FANCYINDEX_FORMAT_XML;
+    }
+
+    for (i = 0; i < sizeof(ngx_http_fancyindex_formats)
+                    / sizeof(ngx_http_fancyindex_formats[0]); i++)
+    {
+        if (value.len == ngx_http_fancyindex_formats[i].content_type.len
+            && ngx_strncasecmp(value.data,
+                               ngx_http_fancyindex_formats[i].content_type.data,
+                               value.len) == 0)
+        {
+            /* Browsers get the viewer when it is the configured format. */
+            if (i == NGX_HTTP_FANCYINDEX_FORMAT_HTML
+                && alcf->format == NGX_HTTP_FANCYINDEX_FORMAT_JS)
+            {
+                return alcf->format;
+            }
+
+            return i;
+        }
+    }
+
+    return alcf->format;
+}
+
+
+
+
+
+#if (NGX_PCRE)
+
+/**
+ * Same as ngx_regex_exec_array(). When PCRE2 is used, nginx shares a single
+ * match data block among all regex executions, so scans running in a
+ * thread pool bring their own.
+ */
+static ngx_int_t
+ngx_http_fancyindex_regex_exec_array(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_array_t *a, ngx_str_t *s, ngx_log_t *log)
+{
+#if (NGX_PCRE2 && NGX_THREADS)
+    ngx_int_t         n;
+    ngx_uint_t        i;
+    ngx_regex_elt_t  *re;
+
+    if (ctx->match_data) {
+        re = a->elts;
+
+        for (i = 0; i < a->nelts; i++) {
+            n = pcre2_match(re[i].regex, s->data, s->len, 0, 0,
+                            ctx->match_data, NULL);
+
+            if (n == PCRE2_ERROR_NOMATCH) {
+                continue;
+            }
+
+            if (n < 0) {
+                ngx_log_error(NGX_LOG_ALERT, log, 0,
+                              "pcre2_match() failed: %i on \"%V\" using \"%s\"",
+                              n, s, re[i].name);
+                return NGX_ERROR;
+            }
+
+            return NGX_OK;
+        }
+
+        return NGX_DECLINED;
+    }
+#else
+    (void) ctx; /* unused */
+#endif /* NGX_PCRE2 && NGX_THREADS */
+
+    return ngx_regex_exec_array(a, s, log);
+}
+
+#endif /* NGX_PCRE */
+
+
+/**
+ * Maps the error from opening a directory to a response status.
+ */
+static ngx_int_t
+ngx_http_fancyindex_open_error(ngx_log_t *log, ngx_err_t err,
+    const char *what, ngx_str_t *path)
+{
+    ngx_int_t rc;
+    ngx_uint_t level;
+
+    if (err == NGX_ENOENT || err == NGX_ENOTDIR || err == NGX_ENAMETOOLONG) {
+        level = NGX_LOG_ERR;
+        rc = NGX_HTTP_NOT_FOUND;
+    } else if (err == NGX_EACCES) {
+        level = NGX_LOG_ERR;
+        rc = NGX_HTTP_FORBIDDEN;
+    } else {
+        level = NGX_LOG_CRIT;
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_error(level, log, err, "%s \"%s\" failed", what, path->data);
+
+    return rc;
+}
+
+
+#if (NGX_PCRE)
+
+/**
+ * Trie of ignored name prefixes, or of reversed suffixes. Node 0 is the
+ * root; children are linked through their siblings, and index 0 ends the
+ * lists, as the root is never a child.
+ */
+typedef struct {
+    ngx_uint_t  child;
+    ngx_uint_t  sibling;
+    u_char      ch;
+    u_char      final;   /**< A pattern ends at this node. */
+} ngx_http_fancyindex_trie_node_t;
+
+
+static ngx_int_t
+ngx_http_fancyindex_trie_insert(ngx_array_t *trie, ngx_str_t *s,
+    ngx_uint_t reverse)
+{
+    ngx_http_fancyindex_trie_node_t *node;
+    ngx_uint_t                       i, n, next;
+    u_char                           ch;
+
+    for (i = 0, n = 0; i < s->len; i++, n = next) {
+        ch = s->data[reverse ? s->len - 1 - i : i];
+        node = trie->elts;
+
+        for (next = node[n].child; next; next = node[next].sibling) {
+            if (node[next].ch == ch)
+                break;
+        }
+
+        if (next == 0) {
+            if ((node = ngx_array_push(trie)) == NULL)
+                return NGX_ERROR;
+
+            next = trie->nelts - 1;
+            node->child   = 0;
+            node->ch      = ch;
+            node->final   = 0;
+
+            node = trie->elts;
+            node[next].sibling = node[n].child;
+            node[n].child = next;
+        }
+    }
+
+    ((ngx_http_fancyindex_trie_node_t *) trie->elts)[n].final = 1;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Tells whether a pattern of the trie is a prefix (or suffix, when the
+ * trie is reversed) of the name, which is compared in lowercase.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_trie_match(ngx_array_t *trie, u_char *name, size_t len,
+    ngx_uint_t reverse)
+{
+    ngx_http_fancyindex_trie_node_t *node;
+    ngx_uint_t                       i, n;
+    u_char                           ch;
+
+    node = trie->elts;
+
+    for (i = 0, n = 0; i < len; i++) {
+        ch = ngx_tolower(name[reverse ? len - 1 - i : i]);
+
+        for (n = node[n].child; n; n = node[n].sibling) {
+            if (node[n].ch == ch)
+                break;
+        }
+
+        if (n == 0)
+            return 0;
+
+        if (node[n].final)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+#define ngx_http_fancyindex_isalnum(c) \
+    (((c) >= '0' && (c) <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+
+/**
+ * Extracts the literal text of patterns which are a plain string, maybe
+ * anchored at either end, with punctuation possibly escaped. The literal
+ * is lowercased, as patterns are matched regardless of case. Returns
+ * NGX_DECLINED for any other pattern.
+ */
+static ngx_int_t
+ngx_http_fancyindex_ignore_literal(ngx_pool_t *pool, u_char *pattern,
+    ngx_str_t *literal, ngx_uint_t *start, ngx_uint_t *end)
+{
+    u_char  *p, *last, *dst;
+
+    p    = pattern;
+    last = p + ngx_strlen(p);
+
+    *start = (p < last && *p == '^');
+    if (*start)
+        p++;
+
+    if ((dst = ngx_pnalloc(pool, last - p)) == NULL)
+        return NGX_ERROR;
+
+    literal->data = dst;
+    *end = 0;
+
+    while (p < last) {
+        if (*p == '\\') {
+            if (++p == last || *p >= 0x80 || ngx_http_fancyindex_isalnum(*p))
+                return NGX_DECLINED;
+
+        } else if (*p == '$' && p + 1 == last) {
+            *end = 1;
+            break;
+
+        } else if (*p >= 0x80 || ngx_strchr(".[]()*+?{}|^$", *p)) {
+            return NGX_DECLINED;
+        }
+
+        *dst++ = ngx_tolower(*p);
+        p++;
+    }
+
+    literal->len = dst - literal->data;
+
+    /* Leave patterns which match any name to the regex library. */
+    return literal->len ? NGX_OK : NGX_DECLINED;
+}
+
+
+/**
+ * Tells whether a pattern can be made one of the alternatives of a single
+ * regex, that is, whether it does not refer to its own groups.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_ignore_combinable(u_char *p)
+{
+    for ( /* void */ ; *p; p++) {
+        if (p[0] == '\\' && p[1]) {
+            if ((p[1] >= '0' && p[1] <= '9') || p[1] == 'g' || p[1] == 'k')
+                return 0;
+            p++;
+
+        } else if (p[0] == '(' && p[1] == '?' && p[2]
+                   && ngx_strchr("P&R|+-0123456789", p[2]))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#endif /* NGX_PCRE */
+
+
+/**
+ * Builds the matcher for the patterns of fancyindex_ignore. With PCRE,
+ * literal patterns anchored at both ends go to a hash of exact names,
+ * those anchored at one end to tries of prefixes and suffixes, and the
+ * rest are combined as alternatives of a single regex. Without PCRE
+ * patterns are names, which all go to the hash.
+ */
+static char *
+ngx_http_fancyindex_ignore_compile(ngx_conf_t *cf,
+    ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_ignore_t *m;
+    ngx_hash_init_t               hinit;
+    ngx_hash_key_t               *hk;
+    ngx_array_t                   names;
+    ngx_str_t                     literal;
+    ngx_uint_t                    i;
+    size_t                        longest;
+
+#if (NGX_PCRE)
+    ngx_regex_elt_t    *re, *elt;
+    ngx_regex_compile_t rc;
+    ngx_array_t        *combined;
+    ngx_uint_t          start, end, ncombined;
+    ngx_int_t           rv;
+    u_char             *p, errstr[NGX_MAX_CONF_ERRSTR];
+    size_t              len;
+#else
+    ngx_str_t          *name;
+#endif
+
+    if ((m = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_ignore_t)))
+            == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&names, cf->temp_pool, 8, sizeof(ngx_hash_key_t))
+            != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    longest = 0;
+
+#if (NGX_PCRE)
+    m->prefixes = ngx_array_create(cf->pool, 16,
+                                   sizeof(ngx_http_fancyindex_trie_node_t));
+    m->suffixes = ngx_array_create(cf->pool, 16,
+                                   sizeof(ngx_http_fancyindex_trie_node_t));
+    m->regex = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
+    combined = ngx_array_create(cf->temp_pool, 4, sizeof(ngx_regex_elt_t));
+
+    if (m->prefixes == NULL || m->suffixes == NULL || m->regex == NULL
+        || combined == NULL
+        || ngx_array_push(m->prefixes) == NULL
+        || ngx_array_push(m->suffixes) == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(m->prefixes->elts, sizeof(ngx_http_fancyindex_trie_node_t));
+    ngx_memzero(m->suffixes->elts, sizeof(ngx_http_fancyindex_trie_node_t));
+
+    re = alcf->ignore->elts;
+    len = 0;
+
+    for (i = 0; i < alcf->ignore->nelts; i++) {
+        rv = ngx_http_fancyindex_ignore_literal(cf->pool, re[i].name,
+                                                &literal, &start, &end);
+        if (rv == NGX_ERROR)
+            return NGX_CONF_ERROR;
+
+        if (rv == NGX_OK && start && end) {
+            if ((hk = ngx_array_push(&names)) == NULL)
+                return NGX_CONF_ERROR;
+
+            hk->key = literal;
+            hk->key_hash = ngx_hash_key(literal.data, literal.len);
+            hk->value = (void *) 1;
+            longest = ngx_max(longest, literal.len);
+
+        } else if (rv == NGX_OK && (start || end)) {
+            if (ngx_http_fancyindex_trie_insert(start ? m->prefixes
+                                                      : m->suffixes,
+                                                &literal, end) != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+            if (start)
+                m->nprefixes++;
+            else
+                m->nsuffixes++;
+
+        } else {
+            elt = ngx_http_fancyindex_ignore_combinable(re[i].name)
+                  ? ngx_array_push(combined) : ngx_array_push(m->regex);
+            if (elt == NULL)
+                return NGX_CONF_ERROR;
+
+            *elt = re[i];
+            len += ngx_strlen(re[i].name);
+        }
+    }
+
+    elt = combined->elts;
+    ncombined = combined->nelts;
+
+    if (ncombined == 1) {
+        if ((re = ngx_array_push(m->regex)) == NULL)
+            return NGX_CONF_ERROR;
+        *re = elt[0];
+
+    } else if (ncombined > 1) {
+        ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+        rc.pattern.data = ngx_pnalloc(cf->pool,
+                                      len + ncombined * ngx_sizeof_ssz("|(?:)"));
+        if (rc.pattern.data == NULL)
+            return NGX_CONF_ERROR;
+
+        for (i = 0, p = rc.pattern.data; i < ncombined; i++) {
+            if (i)
+                *p++ = '|';
+            p = ngx_cpymem_ssz(p, "(?:");
+            p = ngx_cpymem(p, elt[i].name, ngx_strlen(elt[i].name));
+            *p++ = ')';
+        }
+
+        rc.pattern.len = p - rc.pattern.data;
+        *p = '\0';
+        rc.err.data = errstr;
+        rc.err.len  = NGX_MAX_CONF_ERRSTR;
+        rc.pool     = cf->pool;
+        rc.options  = NGX_REGEX_CASELESS;
+
+        if ((re = ngx_array_push(m->regex)) == NULL)
+            return NGX_CONF_ERROR;
+
+        if (ngx_regex_compile(&rc) == NGX_OK) {
+            re->name  = rc.pattern.data;
+            re->regex = rc.regex;
+
+        } else {
+            /* Keep the patterns apart, they are known to compile. */
+            m->regex->nelts--;
+
+            for (i = 0; i < ncombined; i++) {
+                if ((re = ngx_array_push(m->regex)) == NULL)
+                    return NGX_CONF_ERROR;
+                *re = elt[i];
+            }
+        }
+    }
+
+#else /* !NGX_PCRE */
+
+    name = alcf->ignore->elts;
+
+    for (i = 0; i < alcf->ignore->nelts; i++) {
+        if ((hk = ngx_array_push(&names)) == NULL)
+            return NGX_CONF_ERROR;
+
+        literal = name[i];
+
+        hk->key = literal;
+        hk->key_hash = ngx_hash_key(literal.data, literal.len);
+        hk->value = (void *) 1;
+        longest = ngx_max(longest, literal.len);
+    }
+
+#endif /* NGX_PCRE */
+
+    if (names.nelts) {
+        hinit.hash        = &m->exact;
+        hinit.key         = ngx_hash_key;
+        hinit.max_size    = 1024;
+        hinit.bucket_size = ngx_align(ngx_max(64, longest + 4 * sizeof(void *)),
+                                      ngx_cacheline_size);
+        hinit.name        = "fancyindex_ignore_hash";
+        hinit.pool        = cf->pool;
+        hinit.temp_pool   = cf->temp_pool;
+
+        if (ngx_hash_init(&hinit, names.elts, names.nelts) != NGX_OK)
+            return NGX_CONF_ERROR;
+
+        m->nexact = names.nelts;
+    }
+
+    alcf->ignore_matcher = m;
+
+    return NGX_CONF_OK;
+}
+
+
+/**
+ * Tells whether a name matches the exact names, prefixes or suffixes of
+ * the matcher. With PCRE, names are compared in lowercase.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_ignore_name(ngx_http_fancyindex_ignore_t *m,
+    u_char *name, size_t len)
+{
+#if (NGX_PCRE)
+    u_char      lowcase[NGX_HTTP_FANCYINDEX_NAME_MAX];
+    ngx_uint_t  key;
+
+    if (m->nprefixes
+        && ngx_http_fancyindex_trie_match(m->prefixes, name, len, 0))
+    {
+        return 1;
+    }
+
+    /* As in regexes, the end also matches before a final newline. */
+    for ( ;; ) {
+        if (m->nexact && len <= sizeof(lowcase)) {
+            key = ngx_hash_strlow(lowcase, name, len);
+            if (ngx_hash_find(&m->exact, key, lowcase, len))
+                return 1;
+        }
+
+        if (m->nsuffixes
+            && ngx_http_fancyindex_trie_match(m->suffixes, name, len, 1))
+        {
+            return 1;
+        }
+
+        if (len == 0 || name[len - 1] != '\n')
+            return 0;
+
+        len--;
+    }
+#else
+    return m->nexact
+           && ngx_hash_find(&m->exact, ngx_hash_key(name, len), name, len);
+#endif
+}
+
+
+/**
+ * Tells whether a directory entry is left out of the listing because of
+ * its name.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_ignored(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, u_char *name, size_t len,
+    ngx_log_t *log)
+{
+    ngx_http_fancyindex_ignore_t *m;
+
+    if (name[0] == '.')
+        return 1;
+
+    if (alcf->ignore == NULL)
+        return 0;
+
+    m = alcf->ignore_matcher;
+
+    if (ngx_http_fancyindex_ignore_name(m, name, len))
+        return 1;
+
+#if (NGX_PCRE)
+    if (m->regex->nelts) {
+        ngx_str_t str = { len, name };
+
+        return ngx_http_fancyindex_regex_exec_array(ctx, m->regex, &str, log)
+               != NGX_DECLINED;
+    }
+#else
+    (void) ctx; /* unused */
+    (void) log; /* unused */
+#endif /* NGX_PCRE */
+
+    return 0;
+}
+
+
+#define NGX_HTTP_FANCYINDEX_NAME_ESCAPE  1
+#define NGX_HTTP_FANCYINDEX_NAME_UTF8    2
+
+/*
+ * Bytes which may have to be escaped in URIs: controls, space and the
+ * characters up to the apostrophe, colons, question marks, DEL and
+ * anything outside ASCII. This is a superset of what the escaping
+ * functions handle in any nginx version, and names are checked for real
+ * only when one of these is found.
+ */
+#define ngx_http_fancyindex_may_escape(c) \
+    ((c) < 0x28 || (c) >= 0x7f || (c) == ':' || (c) == '?')
+
+
+/**
+ * Classifies the bytes of a name in a single pass, sixteen at a time when
+ * SSE2 or NEON are available. Returns NGX_HTTP_FANCYINDEX_NAME_ESCAPE if
+ * the name may need escaping in URIs, and NGX_HTTP_FANCYINDEX_NAME_UTF8
+ * if it is not plain ASCII. Most names are neither, and then need no
+ * further inspection.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_classify_name(u_char *name, size_t len)
+{
+    u_char      *last;
+    ngx_uint_t   flags;
+
+    last  = name + len;
+    flags = 0;
+
+#if defined(__SSE2__)
+    {
+        __m128i  v, m;
+
+        for ( /* void */ ; last - name >= 16; name += 16) {
+            v = _mm_loadu_si128((const __m128i *) name);
+
+            /* Signed comparison: bytes past 0x7f are negative. */
+            m = _mm_or_si128(
+                    _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x28)),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('?'))));
+
+            if (_mm_movemask_epi8(m))
+                flags |= NGX_HTTP_FANCYINDEX_NAME_ESCAPE;
+            if (_mm_movemask_epi8(v))
+                flags |= NGX_HTTP_FANCYINDEX_NAME_UTF8;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    {
+        uint8x16_t  v, m;
+
+        for ( /* void */ ; last - name >= 16; name += 16) {
+            v = vld1q_u8(name);
+
+            m = vorrq_u8(
+                    vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x28)),
+                             vcgeq_u8(v, vdupq_n_u8(0x7f))),
+                    vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                             vceqq_u8(v, vdupq_n_u8('?'))));
+
+            if (vmaxvq_u8(m))
+                flags |= NGX_HTTP_FANCYINDEX_NAME_ESCAPE;
+            if (vmaxvq_u8(v) >= 0x80)
+                flags |= NGX_HTTP_FANCYINDEX_NAME_UTF8;
+        }
+    }
+#endif
+
+    for ( /* void */ ; name < last; name++) {
+        if (ngx_http_fancyindex_may_escape(*name))
+            flags |= NGX_HTTP_FANCYINDEX_NAME_ESCAPE;
+        if (*name >= 0x80)
+            flags |= NGX_HTTP_FANCYINDEX_NAME_UTF8;
+    }
+
+    return flags;
+}
+
+
+/**
+ * Fills in the name related fields of an entry. The name is not copied: it
+ * has to be null-terminated and to stay around as long as the entry.
+ */
+static void
+ngx_http_fancyindex_set_name(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_entry_t *entry, u_char *name, size_t len)
+{
+    ngx_uint_t  flags;
+
+    entry->name.len  = len;
+    entry->name.data = name;
+    entry->key.len   = 0;
+    entry->key.data  = NULL;
+
+    flags = ngx_http_fancyindex_classify_name(name, len);
+
+    entry->escape = (flags & NGX_HTTP_FANCYINDEX_NAME_ESCAPE)
+        ? 2 * ngx_fancyindex_escape_uri(NULL, name, len)
+        : 0;
+
+    entry->utf_len = (ctx->utf8 && (flags & NGX_HTTP_FANCYINDEX_NAME_UTF8))
+        ?  ngx_utf8_length(entry->name.data, entry->name.len)
+        : len;
+}
+
+
+/**
+ * Appends an entry to the listing. Only the name related fields are
+ * filled in, as by ngx_http_fancyindex_set_name().
+ */
+static ngx_http_fancyindex_entry_t *
+ngx_http_fancyindex_push_entry(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_array_t *entries, u_char *name, size_t len)
+{
+    ngx_http_fancyindex_entry_t *entry;
+
+    if ((entry = ngx_array_push(entries)) == NULL)
+        return NULL;
+
+    ngx_http_fancyindex_set_name(ctx, entry, name, len);
+
+    return entry;
+}
+
+
+/**
+ * Builds the collation key of an entry, so that names are still compared
+ * as bytes, and sorted by the radix sort. Keys have ASCII letters folded
+ * to lower case; natural keys also have each run of digits, without its
+ * leading zeros, preceded by a '0' and its length, so that numbers compare
+ * by value. Names which collate the same are told apart by their bytes.
+ * The key is built into buf if given, which has room for 2 * len + 1 bytes,
+ * or into memory from the pool.
+ */
+static ngx_int_t
+ngx_http_fancyindex_collate(ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_http_fancyindex_entry_t *entry, u_char *buf, ngx_pool_t *pool)
+{
+    u_char  *p, *q, *last, *run;
+
+    if (alcf->collation == NGX_HTTP_FANCYINDEX_COLLATION_BYTES)
+        return NGX_OK;
+
+    p = entry->name.data;
+    last = p + entry->name.len;
+
+    /* A run takes two more bytes, and it takes at least one byte. */
+    q = buf ? buf : ngx_pnalloc(pool, 2 * entry->name.len + 1);
+    if (q == NULL)
+        return NGX_ERROR;
+
+    entry->key.data = q;
+
+    while (p < last) {
+        if (alcf->collation != NGX_HTTP_FANCYINDEX_COLLATION_NATURAL
+            || *p < '0' || *p > '9')
+        {
+            *q++ = ngx_tolower(*p);
+            p++;
+            continue;
+        }
+
+        while (p + 1 < last && *p == '0' && p[1] >= '0' && p[1] <= '9')
+            p++;
+
+        for (run = p; p < last && *p >= '0' && *p <= '9'; p++)
+            /* void */ ;
+
+        *q++ = '0';
+        *q++ = (u_char) (p - run);
+        q = ngx_cpymem(q, run, p - run);
+    }
+
+    entry->key.len = q - entry->key.data;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Copies a name into chunks shared by the names of all entries, which are
+ * as large as the directory up to a limit.
+ */
+static u_char *
+ngx_http_fancyindex_copy_name(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_pool_t *pool, u_char *name, size_t len)
+{
+    size_t  size;
+    u_char *p;
+
+    if ((size_t) (ctx->names_end - ctx->names) < len + 1) {
+        size = ngx_max(ctx->dir_size, NGX_HTTP_FANCYINDEX_NAMES_SIZE);
+        size = ngx_max(size, len + 1);
+
+        if ((ctx->names = ngx_pnalloc(pool, size)) == NULL)
+            return NULL;
+
+        ctx->names_end = ctx->names + size;
+    }
+
+    p = ctx->names;
+    ctx->names = ngx_cpystrn(p, name, len + 1) + 1;
+
+    return p;
+}
+
+
+/**
+ * Whether an entry goes before another one in the listing.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_before(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *one,
+    ngx_http_fancyindex_entry_t *two)
+{
+    if (alcf->directories_first && one->dir != two->dir)
+        return one->dir;
+
+    return ngx_http_fancyindex_sort_cmp[ctx->sort_criterion](one, two) < 0;
+}
+
+
+/**
+ * Moves down the entry at position i of a heap of n entries, whose top is
+ * the entry which goes last in the listing.
+ */
+static void
+ngx_http_fancyindex_heap_down(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *heap,
+    ngx_uint_t n, ngx_uint_t i)
+{
+    ngx_uint_t                   child;
+    ngx_http_fancyindex_entry_t  tmp;
+
+    for ( ;; ) {
+        child = 2 * i + 1;
+        if (child >= n)
+            break;
+
+        if (child + 1 < n
+            && ngx_http_fancyindex_before(ctx, alcf, &heap[child],
+                                          &heap[child + 1]))
+        {
+            child++;
+        }
+
+        if (!ngx_http_fancyindex_before(ctx, alcf, &heap[i], &heap[child]))
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+
+/*
+ * Listings of trees have their own limit, and deltas need every entry.
+ */
+#define ngx_http_fancyindex_limited(ctx) \
+    ((ctx)->walk == NULL && !(ctx)->delta)
+
+
+/**
+ * Adds an entry read from a directory to the listing, with the information
+ * in info. Once fancyindex_max_entries are read, reading stops; or, if the
+ * entries going first in the listing are kept, they become a heap whose
+ * top is the entry going last, replaced by any better entry read later.
+ * Names of replacing entries are copied, so the buffers of the directory
+ * can be reused; names are always copied when asked for.
+ *
+ * Returns NGX_OK when the entry points to the given name, NGX_DECLINED
+ * when it does not, having been dropped or copied, NGX_DONE when no more
+ * entries are needed and NGX_ERROR on failure.
+ */
+static ngx_int_t
+ngx_http_fancyindex_keep_entry(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_array_t *entries,
+    ngx_http_fancyindex_entry_t *info, u_char *name, size_t len,
+    ngx_uint_t copy, ngx_pool_t *pool)
+{
+    ngx_uint_t                    i, limit;
+    ngx_http_fancyindex_entry_t  *entry;
+    u_char                        key[2 * NGX_HTTP_FANCYINDEX_NAME_MAX + 1];
+
+    limit = ngx_http_fancyindex_limited(ctx) ? alcf->max_entries : 0;
+
+    if (limit == 0 || entries->nelts < limit) {
+        if (copy) {
+            name = ngx_http_fancyindex_copy_name(ctx, pool, name, len);
+            if (name == NULL)
+                return NGX_ERROR;
+        }
+
+        entry = ngx_http_fancyindex_push_entry(ctx, entries, name, len);
+        if (entry == NULL)
+            return NGX_ERROR;
+
+        entry->dir   = info->dir;
+        entry->mtime = info->mtime;
+        entry->size  = info->size;
+
+        /* Names of trees are only complete once merged. */
+        if (ngx_http_fancyindex_limited(ctx)
+            && ngx_http_fancyindex_collate(alcf, entry, NULL, pool) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (alcf->max_entries_top && entries->nelts == limit) {
+            for (i = limit / 2; i-- > 0; /* void */) {
+                ngx_http_fancyindex_heap_down(ctx, alcf, entries->elts,
+                                              limit, i);
+            }
+        }
+
+        return copy ? NGX_DECLINED : NGX_OK;
+    }
+
+    ctx->truncated |= NGX_HTTP_FANCYINDEX_TRUNCATED_ENTRIES;
+
+    if (!alcf->max_entries_top)
+        return NGX_DONE;
+
+    entry = entries->elts;
+    info->name.data = name;
+    info->name.len  = len;
+    info->key.len   = 0;
+    info->key.data  = NULL;
+
+    /* Keys of entries which are dropped are not kept. */
+    if (ngx_http_fancyindex_collate(alcf, info,
+                                    (len <= NGX_HTTP_FANCYINDEX_NAME_MAX)
+                                        ? key : NULL,
+                                    pool)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (!ngx_http_fancyindex_before(ctx, alcf, info, entry))
+        return NGX_DECLINED;
+
+    if ((name = ngx_http_fancyindex_copy_name(ctx, pool, name, len)) == NULL)
+        return NGX_ERROR;
+
+    if (info->key.data == key) {
+        info->key.data = ngx_http_fancyindex_copy_name(ctx, pool, key,
+                                                       info->key.len);
+        if (info->key.data == NULL)
+            return NGX_ERROR;
+    }
+
+    ngx_http_fancyindex_set_name(ctx, entry, name, len);
+    entry->key   = info->key;
+    entry->dir   = info->dir;
+    entry->mtime = info->mtime;
+    entry->size  = info->size;
+
+    ngx_http_fancyindex_heap_down(ctx, alcf, entry, limit, 0);
+
+    return NGX_DECLINED;
+}
+
+
+/**
+ * Current time in microseconds. The cached time of nginx is only updated
+ * between events, which is too coarse to tell the phases of a listing
+ * apart; this is also usable from threads.
+ */
+static uint64_t
+ngx_http_fancyindex_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/**
+ * When reading a directory has to stop because of fancyindex_max_scan_time,
+ * or zero if it does not.
+ */
+static uint64_t
+ngx_http_fancyindex_deadline(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    if (alcf->max_scan_time == 0 || !ngx_http_fancyindex_limited(ctx))
+        return 0;
+
+    return ngx_http_fancyindex_usec() + (uint64_t) alcf->max_scan_time * 1000;
+}
+
+
+/**
+ * Whether the deadline for reading a directory has passed. The clock is
+ * only looked at every few entries.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_expired(ngx_http_fancyindex_ctx_t *ctx, uint64_t deadline)
+{
+    if (deadline == 0
+        || ctx->stats.scanned % NGX_HTTP_FANCYINDEX_CLOCK_ENTRIES != 0
+        || ngx_http_fancyindex_usec() < deadline)
+    {
+        return 0;
+    }
+
+    ctx->truncated |= NGX_HTTP_FANCYINDEX_TRUNCATED_TIME;
+
+    return 1;
+}
+
+
+#if (NGX_LINUX)
+
+/**
+ * Layout of the records returned by getdents64(2).
+ */
+typedef struct {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+} ngx_http_fancyindex_dirent64_t;
+
+
+/**
+ * Retrieves the information shown for a directory entry, relative to the
+ * descriptor of its directory. Only the type, size and modification time
+ * are requested if statx(2) is available.
+ */
+static int
+ngx_http_fancyindex_stat_at(int fd, const char *name, int flags,
+    ngx_http_fancyindex_entry_t *entry, ngx_uint_t *link)
+{
+#if (NGX_HAVE_STATX)
+    struct statx stx;
+
+    if (statx(fd, name, flags | AT_NO_AUTOMOUNT,
+              STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == -1)
+        return -1;
+
+    entry->dir   = S_ISDIR(stx.stx_mode);
+    entry->mtime = stx.stx_mtime.tv_sec;
+    entry->size  = stx.stx_size;
+    *link        = S_ISLNK(stx.stx_mode);
+#else
+    struct stat st;
+
+    if (fstatat(fd, name, &st, flags) == -1)
+        return -1;
+
+    entry->dir   = S_ISDIR(st.st_mode);
+    entry->mtime = st.st_mtime;
+    entry->size  = st.st_size;
+    *link        = S_ISLNK(st.st_mode);
+#endif
+
+    return 0;
+}
+
+
+/**
+ * Reads the directory in large getdents64(2) batches and retrieves the
+ * information of each entry relative to the directory descriptor, which
+ * avoids building and resolving the full path of every entry.
+ */
+static ngx_int_t
+ngx_http_fancyindex_read_dir(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_array_t *entries,
+    ngx_pool_t *pool, ngx_log_t *log)
+{
+    ngx_http_fancyindex_dirent64_t *de;
+    ngx_http_fancyindex_entry_t     info;
+
+    u_char      *buf, *p, *name;
+    ssize_t      n;
+    size_t       len, size;
+    ngx_int_t    rc;
+    ngx_uint_t   link, used;
+    uint64_t     deadline;
+    int          fd, flags;
+
+    fd = open((const char *) ctx->path.data,
+              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return ngx_http_fancyindex_open_error(log, ngx_errno, "open()",
+                                              &ctx->path);
+
+    /*
+     * Names of entries point into the buffers, which thus are kept and a
+     * new one is used for the next batch. Most file systems report sizes
+     * of directories close to the size of their records, so most listings
+     * are read in a single batch.
+     */
+    size = ngx_max(ctx->dir_size, NGX_HTTP_FANCYINDEX_GETDENTS_SIZE);
+    buf  = NULL;
+    used = 1;
+    rc   = NGX_OK;
+
+    deadline = ngx_http_fancyindex_deadline(ctx, alcf);
+
+    for ( ;; ) {
+        if (used) {
+            if ((buf = ngx_palloc(pool, size)) == NULL) {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                goto done;
+            }
+            used = 0;
+        }
+
+        n = syscall(SYS_getdents64, fd, buf, size);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                    "getdents64() \"%V\" failed", &ctx->path);
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        if (n == 0)
+            break;
+
+        for (p = buf; p < buf + n; p += de->d_reclen) {
+            de = (ngx_http_fancyindex_dirent64_t *) p;
+            name = (u_char *) de->d_name;
+            len = ngx_strlen(name);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                           "http fancyindex file: \"%s\"", name);
+
+            if (ngx_http_fancyindex_expired(ctx, deadline))
+                goto done;
+
+            ctx->stats.scanned++;
+
+            if (ngx_http_fancyindex_ignored(ctx, alcf, name, len, log)
+                || (alcf->hide_symlinks && de->d_type == DT_LNK))
+            {
+                ctx->stats.filtered++;
+                continue;
+            }
+
+            /*
+             * When the file system does not report entry types, whether the
+             * entry is a link has to be found out with the stat call. For
+             * anything but links both calls give the same result.
+             */
+            flags = (alcf->hide_symlinks && de->d_type == DT_UNKNOWN)
+                    ? AT_SYMLINK_NOFOLLOW : 0;
+
+            ctx->stats.stat_calls++;
+
+            if (ngx_http_fancyindex_stat_at(fd, de->d_name, flags,
+                                            &info, &link) == -1)
+            {
+                ngx_err_t err = ngx_errno;
+
+                if (err != NGX_ENOENT) {
+                    ngx_log_error(NGX_LOG_ERR, log, err,
+                            "fstatat() \"%V/%s\" failed", &ctx->path, name);
+                    continue;
+                }
+
+                /* Dangling symbolic link */
+                ctx->stats.stat_calls++;
+
+                if (ngx_http_fancyindex_stat_at(fd, de->d_name,
+                                                AT_SYMLINK_NOFOLLOW,
+                                                &info, &link) == -1)
+                {
+                    ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                            "fstatat() \"%V/%s\" failed", &ctx->path, name);
+                    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    goto done;
+                }
+            }
+
+            if (flags && link) {
+                ctx->stats.filtered++;
+                continue;
+            }
+
+            switch (ngx_http_fancyindex_keep_entry(ctx, alcf, entries, &info,
+                                                   name, len, 0, pool))
+            {
+            case NGX_OK:
+                used = 1;
+                break;
+            case NGX_DECLINED:
+                break;
+            case NGX_DONE:
+                goto done;
+            default:
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    if (buf && !used)
+        ngx_pfree(pool, buf);
+
+    if (close(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                "close() \"%V\" failed", &ctx->path);
+    }
+
+    return rc;
+}
+
+#else /* !NGX_LINUX */
+
+static ngx_int_t
+ngx_http_fancyindex_read_dir(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_array_t *entries,
+    ngx_pool_t *pool, ngx_log_t *log)
+{
+    ngx_http_fancyindex_entry_t  info;
+
+    size_t       len, allocated;
+    u_char      *filename, *last;
+    ngx_int_t    rc;
+    ngx_str_t    path;
+    ngx_dir_t    dir;
+    uint64_t     deadline;
+
+    path      = ctx->path;
+    allocated = ctx->allocated;
+    last      = path.data + path.len + 1;
+
+    if (ngx_open_dir(&path, &dir) == NGX_ERROR)
+        return ngx_http_fancyindex_open_error(log, ngx_errno,
+                                              ngx_open_dir_n, &path);
+
+    filename = path.data;
+    filename[path.len] = '/';
+
+    deadline = ngx_http_fancyindex_deadline(ctx, alcf);
+
+    /* Read directory entries and their associated information. */
+    for (;;) {
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(&dir) == NGX_ERROR) {
+            ngx_int_t err = ngx_errno;
+
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, log, err,
+                        ngx_read_dir_n " \"%V\" failed", &path);
+                return ngx_http_fancyindex_error(log, &dir, &path);
+            }
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http fancyindex file: \"%s\"", ngx_de_name(&dir));
+
+        len = ngx_de_namelen(&dir);
+
+        if (ngx_http_fancyindex_expired(ctx, deadline))
+            break;
+
+        ctx->stats.scanned++;
+
+        if (ngx_http_fancyindex_ignored(ctx, alcf, ngx_de_name(&dir), len,
+                                        log)
+            || (alcf->hide_symlinks && ngx_de_is_link (&dir)))
+        {
+            ctx->stats.filtered++;
+            continue;
+        }
+
+        if (!dir.valid_info) {
+            /* 1 byte for '/' and 1 byte for terminating '\0' */
+            if (path.len + 1 + len + 1 > allocated) {
+                allocated = path.len + 1 + len + 1
+                          + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+                if ((filename = ngx_palloc(pool, allocated)) == NULL)
+                    return ngx_http_fancyindex_error(log, &dir, &path);
+
+                last = ngx_cpystrn(filename, path.data, path.len + 1);
+                *last++ = '/';
+            }
+
+            ngx_cpystrn(last, ngx_de_name(&dir), len + 1);
+
+            ctx->stats.stat_calls++;
+
+            if (ngx_de_info(filename, &dir) == NGX_FILE_ERROR) {
+                ngx_int_t err = ngx_errno;
+
+                if (err != NGX_ENOENT) {
+                    ngx_log_error(NGX_LOG_ERR, log, err,
+                            ngx_de_info_n " \"%s\" failed", filename);
+                    continue;
+                }
+
+                ctx->stats.stat_calls++;
+
+                if (ngx_de_link_info(filename, &dir) == NGX_FILE_ERROR) {
+                    ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                            ngx_de_link_info_n " \"%s\" failed", filename);
+                    return ngx_http_fancyindex_error(log, &dir, &path);
+                }
+            }
+        }
+
+        info.dir   = ngx_de_is_dir(&dir);
+        info.mtime = ngx_de_mtime(&dir);
+        info.size  = ngx_de_size(&dir);
+
+        rc = ngx_http_fancyindex_keep_entry(ctx, alcf, entries, &info,
+                                            ngx_de_name(&dir), len, 1, pool);
+        if (rc == NGX_DONE)
+            break;
+
+        if (rc == NGX_ERROR)
+            return ngx_http_fancyindex_error(log, &dir, &path);
+    }
+
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                ngx_close_dir_n " \"%s\" failed", &path);
+    }
+
+    return NGX_OK;
+}
+
+#endif /* NGX_LINUX */
+
+
+/**
+ * Upper bound of the length of the navigation links of paginated HTML
+ * listings, which look like:
+ *
+ *   <p class="pages">
+ *     <a href="?[sort&amp;]page=n[&amp;per_page=m]">&laquo; Previous</a>
+ *     Page n of m
+ *     <a href="?[sort&amp;]page=n[&amp;per_page=m]">Next &raquo;</a>
+ *   </p>
+ */
+#define NGX_HTTP_FANCYINDEX_PAGE_LINK_LEN \
+    (ngx_sizeof_ssz("<a href=\"?C=N&amp;O=A&amp;page=&amp;per_page=\">") \
+     + 2 * NGX_INT_T_LEN)
+
+#define NGX_HTTP_FANCYINDEX_PAGES_LEN \
+    (ngx_sizeof_ssz("<p class=\"pages\"></p>\n") \
+     + 2 * NGX_HTTP_FANCYINDEX_PAGE_LINK_LEN \
+     + ngx_sizeof_ssz("&laquo; Previous</a> ") \
+     + ngx_sizeof_ssz("Page  of ") + 2 * NGX_INT_T_LEN \
+     + ngx_sizeof_ssz(" Next &raquo;</a>"))
+
+
+static u_char *
+ngx_http_fancyindex_page_link(u_char *p, ngx_http_fancyindex_ctx_t *ctx,
+    ngx_uint_t page)
+{
+    p = ngx_cpymem_ssz(p, "<a href=\"?");
+
+    /* Keep the sorting, without the leading question mark. */
+    if (*ctx->sort_url_args) {
+        p = ngx_cpymem(p, ctx->sort_url_args + 1,
+                       ngx_sizeof_ssz("C=N&amp;O=A"));
+        p = ngx_cpymem_ssz(p, "&amp;");
+    }
+
+    p = ngx_sprintf(p, "page=%ui", page);
+
+    if (ctx->per_page_arg) {
+        p = ngx_sprintf(p, "&amp;per_page=%ui", ctx->per_page);
+    }
+
+    return ngx_cpymem_ssz(p, "\">");
+}
+
+
+static u_char *
+ngx_http_fancyindex_pages(u_char *p, ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_uint_t pages;
+
+    pages = (ctx->total + ctx->per_page - 1) / ctx->per_page;
+
+    p = ngx_cpymem_ssz(p, "<p class=\"pages\">");
+
+    if (ctx->page > 1) {
+        /* Pages past the end link back to the last one. */
+        p = ngx_http_fancyindex_page_link(p, ctx,
+                ngx_min(ctx->page - 1, ngx_max(pages, 1)));
+        p = ngx_cpymem_ssz(p, "&laquo; Previous</a> ");
+    }
+
+    p = ngx_sprintf(p, "Page %ui of %ui", ctx->page, pages);
+
+    if (ctx->page < pages) {
+        *p++ = ' ';
+        p = ngx_http_fancyindex_page_link(p, ctx, ctx->page + 1);
+        p = ngx_cpymem_ssz(p, "Next &raquo;</a>");
+    }
+
+    return ngx_cpymem_ssz(p, "</p>\n");
+}
+
+
+/**
+ * Partially sorts entries so that the one at position k is where a full
+ * sort would put it, all entries before it compare lower or equal, and all
+ * after it compare greater or equal. This is a quickselect with a median
+ * of three pivot, which takes linear time on average.
+ */
+static void
+ngx_http_fancyindex_select(ngx_http_fancyindex_entry_t *entries,
+    ngx_uint_t n, ngx_uint_t k, int (*cmp)(const void *, const void *))
+{
+    ngx_int_t                    lo, hi, i, j, mid;
+    ngx_http_fancyindex_entry_t  pivot, tmp;
+
+#define ENTRY_SWAP(a, b) \
+    do { tmp = entries[a]; entries[a] = entries[b]; entries[b] = tmp; } while (0)
+
+    lo = 0;
+    hi = (ngx_int_t) n - 1;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        /* Ordering the three also keeps the scans below within bounds. */
+        if (cmp(&entries[mid], &entries[lo]) < 0)
+            ENTRY_SWAP(mid, lo);
+        if (cmp(&entries[hi], &entries[lo]) < 0)
+            ENTRY_SWAP(hi, lo);
+        if (cmp(&entries[hi], &entries[mid]) < 0)
+            ENTRY_SWAP(hi, mid);
+
+        pivot = entries[mid];
+
+        for (i = lo, j = hi; i <= j; i++, j--) {
+            while (cmp(&entries[i], &pivot) < 0)
+                i++;
+            while (cmp(&entries[j], &pivot) > 0)
+                j--;
+            if (i > j)
+                break;
+            ENTRY_SWAP(i, j);
+        }
+
+        /* Now [lo..j] <= pivot <= [i..hi], and entries in between equal it. */
+        if ((ngx_int_t) k <= j) {
+            hi = j;
+        } else if ((ngx_int_t) k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+
+#undef ENTRY_SWAP
+}
+
+
+/**
+ * Sort keys of entries: the sort criterion packed into an unsigned integer
+ * which orders the same way, that is the size or mtime with the sign bit
+ * flipped, or the first eight bytes of the collation key, or else of the
+ * name, in big endian order. Keys are negated for descending criteria.
+ */
+typedef struct {
+    uint64_t                     key;
+    ngx_http_fancyindex_entry_t *entry;
+} ngx_http_fancyindex_sort_key_t;
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_keys_name_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_sort_key_t *first = (ngx_http_fancyindex_sort_key_t *) one;
+    ngx_http_fancyindex_sort_key_t *second = (ngx_http_fancyindex_sort_key_t *) two;
+
+    return ngx_http_fancyindex_cmp_names(first->entry, second->entry);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_keys_name_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_sort_key_t *first = (ngx_http_fancyindex_sort_key_t *) one;
+    ngx_http_fancyindex_sort_key_t *second = (ngx_http_fancyindex_sort_key_t *) two;
+
+    return ngx_http_fancyindex_cmp_names(second->entry, first->entry);
+}
+
+
+/**
+ * Sorts entries by packing their keys in an array which is sorted with a
+ * least significant digit radix sort, one byte at a time; passes over
+ * bytes which are the same for all keys are skipped. Entries with the same
+ * key, i.e. names sharing their first eight bytes or equal sizes or dates,
+ * are then ordered with full comparisons of their names. Returns
+ * NGX_ERROR if memory cannot be allocated, leaving entries untouched.
+ */
+static ngx_int_t
+ngx_http_fancyindex_radix_sort(ngx_http_fancyindex_entry_t *entries,
+    ngx_uint_t n, ngx_uint_t criterion, ngx_pool_t *pool)
+{
+    ngx_http_fancyindex_sort_key_t  *base, *keys, *tmp, *swap;
+    ngx_http_fancyindex_entry_t     *sorted;
+    ngx_uint_t                       i, j, pass, sum, count[8][256];
+    uint64_t                         key;
+    u_char                          *name;
+    size_t                           len;
+
+    base = ngx_palloc(pool, 2 * n * sizeof(ngx_http_fancyindex_sort_key_t));
+    if (base == NULL)
+        return NGX_ERROR;
+
+    if ((sorted = ngx_palloc(pool, n * sizeof(ngx_http_fancyindex_entry_t)))
+            == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    keys = base;
+    tmp = base + n;
+    ngx_memzero(count, sizeof(count));
+
+    for (i = 0; i < n; i++) {
+        switch (criterion) {
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
+                key = (uint64_t) entries[i].size ^ ((uint64_t) 1 << 63);
+                break;
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
+            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
+                key = (uint64_t) (int64_t) entries[i].mtime
+                      ^ ((uint64_t) 1 << 63);
+                break;
+            default:
+                if (entries[i].key.data) {
+                    name = entries[i].key.data;
+                    len = ngx_min(entries[i].key.len, 8);
+                } else {
+                    name = entries[i].name.data;
+                    len = ngx_min(entries[i].name.len, 8);
+                }
+                for (key = 0, j = 0; j < 8; j++)
+                    key = (key << 8) | (j < len ? name[j] : 0);
+                break;
+        }
+
+        if (criterion >= NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC)
+            key = ~key;
+
+        keys[i].key = key;
+        keys[i].entry = &entries[i];
+
+        for (pass = 0; pass < 8; pass++)
+            count[pass][(key >> (pass * 8)) & 0xff]++;
+    }
+
+    for (pass = 0; pass < 8; pass++) {
+        if (count[pass][(keys[0].key >> (pass * 8)) & 0xff] == n)
+            continue;
+
+        for (sum = 0, j = 0; j < 256; j++) {
+            i = count[pass][j];
+            count[pass][j] = sum;
+            sum += i;
+        }
+
+        for (i = 0; i < n; i++)
+            tmp[count[pass][(keys[i].key >> (pass * 8)) & 0xff]++] = keys[i];
+
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    /* Ties are broken by name, in the same direction, as comparators do. */
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && keys[j].key == keys[i].key; j++)
+            /* void */ ;
+
+        if (j - i > 1) {
+            ngx_qsort(&keys[i], (size_t) (j - i),
+                      sizeof(ngx_http_fancyindex_sort_key_t),
+                      (criterion < NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC)
+                          ? ngx_http_fancyindex_cmp_keys_name_asc
+                          : ngx_http_fancyindex_cmp_keys_name_desc);
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        sorted[i] = *keys[i].entry;
+
+    ngx_memcpy(entries, sorted, n * sizeof(ngx_http_fancyindex_entry_t));
+
+    ngx_pfree(pool, sorted);
+    ngx_pfree(pool, base);
+
+    return NGX_OK;
+}
+
+
+/**
+ * Sorts the entries in positions [first, last) of an array of n entries,
+ * which then are where a full sort would put them. Whole arrays of more
+ * than a few entries are radix sorted; windows are selected and then only
+ * their entries are sorted.
+ */
+static void
+ngx_http_fancyindex_sort(ngx_http_fancyindex_entry_t *entries, ngx_uint_t n,
+    ngx_uint_t first, ngx_uint_t last, ngx_uint_t criterion,
+    ngx_pool_t *pool)
+{
+    if (last <= first)
+        return;
+
+    if (first == 0 && last == n) {
+        if (n >= NGX_HTTP_FANCYINDEX_RADIX_SORT_MIN
+            && ngx_http_fancyindex_radix_sort(entries, n, criterion, pool)
+               == NGX_OK)
+        {
+            return;
+        }
+
+    } else {
+        if (last < n) {
+            ngx_http_fancyindex_select(entries, n, last,
+                                       ngx_http_fancyindex_sort_cmp[criterion]);
+        }
+        if (first > 0) {
+            ngx_http_fancyindex_select(entries, last, first,
+                                       ngx_http_fancyindex_sort_cmp[criterion]);
+        }
+    }
+
+    if (last - first > 1) {
+        ngx_qsort(entries + first, (size_t) (last - first),
+                  sizeof(ngx_http_fancyindex_entry_t),
+                  ngx_http_fancyindex_sort_cmp[criterion]);
+    }
+}
+
+
+/**
+ * Moves directories before files, returning how many there are. The order
+ * of entries is not kept, as they are sorted afterwards.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_directories_first(ngx_http_fancyindex_entry_t *entries,
+    ngx_uint_t n)
+{
+    ngx_uint_t                   i, d;
+    ngx_http_fancyindex_entry_t  tmp;
+
+    for (i = 0, d = 0; i < n; i++) {
+        if (entries[i].dir) {
+            if (i != d) {
+                tmp = entries[d];
+                entries[d] = entries[i];
+                entries[i] = tmp;
+            }
+            d++;
+        }
+    }
+
+    return d;
+}
+
+
+/**
+ * Positions [first, last) of the entries of the requested page, among the
+ * n entries of a listing.
+ */
+static void
+ngx_http_fancyindex_window(ngx_http_fancyindex_ctx_t *ctx, ngx_uint_t n,
+    ngx_uint_t *first, ngx_uint_t *last)
+{
+    *first = 0;
+    *last  = n;
+
+    if (ctx->per_page) {
+        if (ctx->page - 1 > n / ctx->per_page) {
+            *first = n;
+        } else {
+            *first = ngx_min((ctx->page - 1) * ctx->per_page, n);
+            *last  = ngx_min(*first + ctx->per_page, n);
+        }
+    }
+}
+
+
+/**
+ * Picks the entries of the requested page and sorts them.
+ */
+static void
+ngx_http_fancyindex_arrange(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_http_fancyindex_entry_t *elts,
+    ngx_uint_t n, ngx_pool_t *pool)
+{
+    ngx_uint_t  first, last, dirs;
+
+    ctx->read = elts;
+
+    /* Deltas are computed from unsorted entries. */
+    if (ctx->delta) {
+        ctx->entries = elts;
+        ctx->nentries = ctx->total = n;
+        return;
+    }
+
+    ngx_http_fancyindex_window(ctx, n, &first, &last);
+
+    /*
+     * Sort entries. Directories and files are sorted separately when
+     * directories go first, each group getting its part of the window.
+     */
+    dirs = alcf->directories_first
+           ? ngx_http_fancyindex_directories_first(elts, n) : 0;
+
+    if (first < dirs) {
+        ngx_http_fancyindex_sort(elts, dirs, first, ngx_min(last, dirs),
+                                 ctx->sort_criterion, pool);
+    }
+    if (last > dirs) {
+        ngx_http_fancyindex_sort(elts + dirs, n - dirs,
+                                 ngx_max(first, dirs) - dirs, last - dirs,
+                                 ctx->sort_criterion, pool);
+    }
+
+    ctx->entries  = elts + first;
+    ctx->nentries = last - first;
+    ctx->total    = n;
+}
+
+
+/**
+ * Reads the entries of the directory at ctx->path, skipping those which
+ * are ignored, and sorts them. For paginated listings only the entries of
+ * the requested page are sorted, after selecting them in linear time.
+ * Everything is allocated from the given pool and the request is not
+ * touched, so this can run in a thread.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan(ngx_http_fancyindex_ctx_t *ctx,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_pool_t *pool, ngx_log_t *log)
+{
+    ngx_array_t                   entries;
+    ngx_int_t                     rc;
+    ngx_file_info_t               fi;
+    uint64_t                      start, now;
+
+    /*
+     * The size of the directory hints at how much space names and entries
+     * need; records of most file systems take a few dozen bytes each.
+     */
+    if (ctx->have_fi) {
+        ctx->dir_size = ngx_file_size(&ctx->fi);
+    } else if (ngx_file_info(ctx->path.data, &fi) != NGX_FILE_ERROR) {
+        ctx->dir_size = ngx_file_size(&fi);
+    }
+
+    ctx->dir_size = ngx_min(ctx->dir_size, NGX_HTTP_FANCYINDEX_HINT_MAX);
+
+    if (ngx_array_init(&entries, pool, ngx_max(ctx->dir_size / 32, 40),
+                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    start = ngx_http_fancyindex_usec();
+
+    rc = ngx_http_fancyindex_read_dir(ctx, alcf, &entries, pool, log);
+    if (rc != NGX_OK)
+        return rc;
+
+    now = ngx_http_fancyindex_usec();
+    ctx->stats.read_time += now - start;
+
+    if (ctx->truncated & NGX_HTTP_FANCYINDEX_TRUNCATED_TIME) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "listing of \"%V\" truncated after %M ms, "
+                      "%ui entries read", &ctx->path, alcf->max_scan_time,
+                      ctx->stats.scanned);
+
+    } else if (ctx->truncated & NGX_HTTP_FANCYINDEX_TRUNCATED_ENTRIES) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "listing of \"%V\" truncated to %ui entries",
+                      &ctx->path, alcf->max_entries);
+    }
+
+    ngx_http_fancyindex_arrange(ctx, alcf, entries.elts, entries.nelts, pool);
+
+    ctx->stats.sort_time += ngx_http_fancyindex_usec() - now;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Delta listings compare the entries of a directory with a snapshot of a
+ * previous state, identified by a token: the sum of hashes of the entries,
+ * which does not depend on the order in which they are read. Snapshots are
+ * kept in the cache zone, with the entries sorted by the bytes of their
+ * names so they can be searched, and are only stored when the directory
+ * did change:
+ *
+ *   uint32_t n;  uint32_t offsets[n];  records (aligned)
+ *
+ * Listings sorted differently than cached ones are built from a snapshot
+ * of the directory, validated like cached listings, which also has the
+ * positions of the entries sorted by name in the configured collation, by
+ * size and by date. Descending orders read those backwards:
+ *
+ *   uint32_t n;  uint32_t offsets[n];  uint32_t by_name[n];
+ *   uint32_t by_size[n];  uint32_t by_date[n];  records (aligned)
+ *
+ * Names in records are null-terminated.
+ */
+#define NGX_HTTP_FANCYINDEX_TOKEN_LEN  16
+
+typedef struct {
+    off_t          size;
+    time_t         mtime;
+    u_short        len;
+    u_char         dir;
+    u_char         name[1];
+} ngx_http_fancyindex_snapshot_entry_t;
+
+
+static uint64_t
+ngx_http_fancyindex_entry_hash(ngx_http_fancyindex_entry_t *entry)
+{
+    uint64_t h;
+
+    h = (uint64_t) ngx_crc32_short(entry->name.data, entry->name.len) << 32
+        | ngx_murmur_hash2(entry->name.data, entry->name.len);
+
+    h ^= (uint64_t) entry->size * 0x9e3779b97f4a7c15ULL
+         + (uint64_t) entry->mtime * 0xbf58476d1ce4e5b9ULL
+         + entry->dir;
+
+    /* Mix well, the hashes are summed. */
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_snapshot_find(u_char *snapshot, uint32_t n,
+    ngx_str_t *name)
+{
+    uint32_t                               lo, hi, mid, *offsets;
+    ngx_int_t                              rc;
+    ngx_http_fancyindex_snapshot_entry_t  *se;
+
+    offsets = (uint32_t *) snapshot + 1;
+    lo = 0;
+    hi = n;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        se = (ngx_http_fancyindex_snapshot_entry_t *) (snapshot + offsets[mid]);
+
+        rc = ngx_memn2cmp(name->data, se->name, name->len, se->len);
+
+        if (rc == 0)
+            return mid;
+
+        if (rc < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+/**
+ * Stores n entries under the given snapshot key, with the permutations by
+ * name, by size and by date if asked for, and validated against fi unless
+ * it is NULL. The entries are sorted by the bytes of their names first,
+ * changing their order; their escape fields are overwritten when building
+ * permutations.
+ */
+static void
+ngx_http_fancyindex_snapshot_put(ngx_http_request_t *r,
+    ngx_http_fancyindex_loc_conf_t *alcf, ngx_str_t *key, ngx_file_info_t *fi,
+    ngx_http_fancyindex_entry_t *entry, ngx_uint_t n, ngx_uint_t perms)
+{
+    size_t                                 len;
+    u_char                                *p;
+    uint32_t                              *offsets, *perm;
+    ngx_uint_t                             i, k;
+    ngx_buf_t                             *b, *variants[NGX_HTTP_FANCYINDEX_ENCODINGS];
+    ngx_http_fancyindex_snapshot_entry_t  *se;
+
+    static const ngx_uint_t  criteria[] = {
+        NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME,
+        NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE,
+        NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE
+    };
+
+    len = sizeof(uint32_t) * (1 + n + (perms ? 3 * n : 0));
+    for (i = 0; i < n; i++) {
+        len = ngx_align(len, sizeof(off_t));
+        len += offsetof(ngx_http_fancyindex_snapshot_entry_t, name)
+               + entry[i].name.len + 1;
+    }
+
+    if (len > NGX_MAX_UINT32_VALUE)
+        return;
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return;
+
+    /* Looked up by name, which does not depend on the collation. */
+    ngx_qsort(entry, (size_t) n, sizeof(ngx_http_fancyindex_entry_t),
+              ngx_http_fancyindex_cmp_entries_bytes);
+
+    offsets = (uint32_t *) b->pos;
+    offsets[0] = (uint32_t) n;
+    p = b->pos + sizeof(uint32_t) * (1 + n + (perms ? 3 * n : 0));
+
+    for (i = 0; i < n; i++) {
+        p = b->pos + ngx_align((size_t) (p - b->pos), sizeof(off_t));
+        offsets[i + 1] = (uint32_t) (p - b->pos);
+
+        se = (ngx_http_fancyindex_snapshot_entry_t *) p;
+        se->size  = entry[i].size;
+        se->mtime = entry[i].mtime;
+        se->len   = (u_short) entry[i].name.len;
+        se->dir   = (u_char) entry[i].dir;
+
+        p = ngx_cpymem(se->name, entry[i].name.data, entry[i].name.len);
+        *p++ = '\0';
+    }
+
+    b->last = p;
+
+    /*
+     * Entries remember their position in the escape field, which is not
+     * looked at when sorting.
+     */
+    if (perms) {
+        for (i = 0; i < n; i++) {
+            entry[i].escape = i;
+        }
+
+        for (k = 0; k < 3; k++) {
+            ngx_http_fancyindex_sort(entry, n, 0, n, criteria[k], r->pool);
+
+            perm = offsets + 1 + (k + 1) * n;
+            for (i = 0; i < n; i++) {
+                perm[i] = (uint32_t) entry[i].escape;
+            }
+        }
+    }
+
+    ngx_memzero(variants, sizeof(variants));
+    variants[NGX_HTTP_FANCYINDEX_IDENTITY] = b;
+
+    ngx_http_fancyindex_cache_put(r, alcf->cache, key, fi, 0, variants, NULL);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_entries_key(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_str_t *key)
+{
+    key->len = NGX_INT_T_LEN + ngx_sizeof_ssz(":entries:") + ctx->path.len;
+    if ((key->data = ngx_pnalloc(r->pool, key->len)) == NULL)
+        return NGX_ERROR;
+
+    key->len = ngx_sprintf(key->data, "%ui:entries:%V", alcf->generation,
+                           &ctx->path)
+               - key->data;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Keeps the entries which were read, along with their orders, so that the
+ * same directory sorted differently does not have to be read again.
+ */
+static void
+ngx_http_fancyindex_entries_put(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_str_t                     key;
+    ngx_http_fancyindex_entry_t  *entries;
+
+    if (ngx_http_fancyindex_entries_key(r, ctx, alcf, &key) != NGX_OK)
+        return;
+
+    /* The entries read are being rendered, sort a copy. */
+    entries = ngx_palloc(r->pool,
+                         ctx->total * sizeof(ngx_http_fancyindex_entry_t));
+    if (entries == NULL)
+        return;
+
+    ngx_memcpy(entries, ctx->read,
+               ctx->total * sizeof(ngx_http_fancyindex_entry_t));
+
+    ngx_http_fancyindex_snapshot_put(r, alcf, &key, &ctx->fi, entries,
+                                     ctx->total, 1);
+
+    ngx_pfree(r->pool, entries);
+}
+
+
+/**
+ * Picks the entries of the requested page from the snapshot of the entries
+ * of the directory, if there is a fresh one in the cache zone. Returns
+ * NGX_DECLINED when the directory has to be read.
+ */
+static ngx_int_t
+ngx_http_fancyindex_entries_get(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    u_char                                *snapshot;
+    uint32_t                               n, *offsets, *perm, *order;
+    uint64_t                               start;
+    ngx_int_t                              rc;
+    ngx_str_t                              key;
+    ngx_buf_t                             *b;
+    ngx_uint_t                             i, j, k, d, groups, desc;
+    ngx_uint_t                             first, last, encoding;
+    ngx_http_fancyindex_entry_t           *entry;
+    ngx_http_fancyindex_snapshot_entry_t  *se;
+
+    if (ngx_http_fancyindex_entries_key(r, ctx, alcf, &key) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    rc = ngx_http_fancyindex_cache_get(r, alcf->cache, &key, &ctx->fi,
+                                       NGX_HTTP_FANCYINDEX_CACHE_STAT,
+                                       1 << NGX_HTTP_FANCYINDEX_IDENTITY,
+                                       &encoding, &b, NULL);
+    if (rc == NGX_ERROR)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (rc != NGX_OK)
+        return NGX_DECLINED;
+
+    start = ngx_http_fancyindex_usec();
+
+    snapshot = b->pos;
+    n = *(uint32_t *) snapshot;
+    offsets = (uint32_t *) snapshot + 1;
+
+    switch (ctx->sort_criterion) {
+    case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
+    case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
+        perm = offsets + 2 * n;
+        break;
+    case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
+    case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
+        perm = offsets + 3 * n;
+        break;
+    default:
+        perm = offsets + n;
+    }
+
+    desc = ctx->sort_criterion >= NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC;
+
+    /*
+     * Positions of the records of the entries in the order they are listed;
+     * when directories go first, they are picked in a first pass.
+     */
+    if ((order = ngx_palloc(r->pool, (n + 1) * sizeof(uint32_t))) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    groups = alcf->directories_first ? 2 : 1;
+
+    for (k = 0, d = 0; d < groups; d++) {
+        for (i = 0; i < n; i++) {
+            j = perm[desc ? n - 1 - i : i];
+
+            if (groups == 2) {
+                se = (ngx_http_fancyindex_snapshot_entry_t *)
+                         (snapshot + offsets[j]);
+                if (se->dir != (d == 0))
+                    continue;
+            }
+
+            order[k++] = (uint32_t) j;
+        }
+    }
+
+    ngx_http_fancyindex_window(ctx, n, &first, &last);
+
+    entry = ngx_palloc(r->pool, (last - first + 1)
+                                * sizeof(ngx_http_fancyindex_entry_t));
+    if (entry == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    for (i = first; i < last; i++) {
+        se = (ngx_http_fancyindex_snapshot_entry_t *)
+                 (snapshot + offsets[order[i]]);
+
+        ngx_http_fancyindex_set_name(ctx, &entry[i - first], se->name, se->len);
+        entry[i - first].dir   = se->dir;
+        entry[i - first].mtime = se->mtime;
+        entry[i - first].size  = se->size;
+    }
+
+    ngx_pfree(r->pool, order);
+
+    ctx->entries  = entry;
+    ctx->nentries = last - first;
+    ctx->total    = n;
+
+    ctx->stats.sort_time += ngx_http_fancyindex_usec() - start;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: %ui of %uD entries from snapshot",
+                   ctx->nentries, n);
+
+    return NGX_OK;
+}
+
+
+/**
+ * Generates a delta listing: a JSON object with the token of the current
+ * state of the directory, and the entries which were added, modified or
+ * removed since the state given in the since argument. When there is no
+ * snapshot for that state every entry is reported as added, and reset is
+ * set to tell clients to discard what they know about the directory.
+ *
+ *   {"token":"T","reset":false,
+ *    "added":[...],"modified":[...],"removed":[...]}
+ */
+static ngx_int_t
+ngx_http_fancyindex_render_delta(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    size_t                                 len;
+    u_char                                *p, *state, *seen, *snapshot;
+    uint32_t                               n, *offsets;
+    uint64_t                               token;
+    ngx_int_t                              k, rc;
+    ngx_str_t                              key;
+    ngx_buf_t                             *b, *sb;
+    ngx_uint_t                             i, s, encoding, first;
+    ngx_http_fancyindex_entry_t           *entry, removed;
+    ngx_http_fancyindex_snapshot_entry_t  *se;
+    u_char                                 tok[NGX_HTTP_FANCYINDEX_TOKEN_LEN];
+
+    static const ngx_str_t  sections[] = {
+        ngx_string(",\n\"added\":["),
+        ngx_string("],\n\"modified\":["),
+        ngx_string("],\n\"removed\":[")
+    };
+
+    entry = ctx->entries;
+
+    for (token = ctx->nentries, i = 0; i < ctx->nentries; i++) {
+        token += ngx_http_fancyindex_entry_hash(&entry[i]);
+    }
+
+    (void) ngx_sprintf(tok, "%016xL", token);
+
+    if ((state = ngx_pcalloc(r->pool, ctx->nentries + 1)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    /*
+     * Look up the snapshot of the previous state: entries not found there
+     * were added, those found with other attributes were modified.
+     */
+    snapshot = NULL;
+    seen = NULL;
+    n = 0;
+    key.len = 0;
+
+    if (alcf->cache) {
+        key.len = NGX_INT_T_LEN + ngx_sizeof_ssz(":since=:")
+                  + NGX_HTTP_FANCYINDEX_TOKEN_LEN
+                  + r->uri.len + 1 + ctx->path.len;
+        if ((key.data = ngx_pnalloc(r->pool, key.len)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (alcf->cache && ctx->since.len == NGX_HTTP_FANCYINDEX_TOKEN_LEN) {
+        key.len = ngx_sprintf(key.data, "%ui:since=%V:%V%Z%V",
+                              alcf->generation, &ctx->since, &r->uri,
+                              &ctx->path)
+                  - key.data;
+
+        rc = ngx_http_fancyindex_cache_get(r, alcf->cache, &key, NULL,
+                                           NGX_HTTP_FANCYINDEX_CACHE_ANY,
+                                           1 << NGX_HTTP_FANCYINDEX_IDENTITY,
+                                           &encoding, &sb, NULL);
+        if (rc == NGX_ERROR)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        if (rc == NGX_OK) {
+            snapshot = sb->pos;
+            n = *(uint32_t *) snapshot;
+
+            if ((seen = ngx_pcalloc(r->pool, n + 1)) == NULL)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    len = ngx_sizeof_ssz("{\"token\":\"\",\n\"reset\":false")
+          + NGX_HTTP_FANCYINDEX_TOKEN_LEN
+          + ngx_sizeof_ssz(",\n\"added\":[],\n\"modified\":[],\n\"removed\":[")
+          + ngx_sizeof_ssz("\n]}\n");
+
+    for (i = 0; i < ctx->nentries; i++) {
+        state[i] = 1;
+
+        if (snapshot) {
+            k = ngx_http_fancyindex_snapshot_find(snapshot, n,
+                                                  &entry[i].name);
+            if (k != NGX_ERROR) {
+                offsets = (uint32_t *) snapshot + 1;
+                se = (ngx_http_fancyindex_snapshot_entry_t *)
+                         (snapshot + offsets[k]);
+                seen[k] = 1;
+
+                if (se->dir == (u_char) entry[i].dir
+                    && se->mtime == entry[i].mtime
+                    && (se->dir || se->size == entry[i].size))
+                {
+                    state[i] = 0;
+                    continue;
+                }
+
+                state[i] = 2;
+            }
+        }
+
+        len += ngx_http_fancyindex_json_row_len(ctx, alcf, &entry[i]);
+    }
+
+    ngx_memzero(&removed, sizeof(ngx_http_fancyindex_entry_t));
+
+    offsets = snapshot ? (uint32_t *) snapshot + 1 : NULL;
+
+    for (k = 0; (uint32_t) k < n; k++) {
+        if (seen[k])
+            continue;
+
+        se = (ngx_http_fancyindex_snapshot_entry_t *) (snapshot + offsets[k]);
+        removed.name.data = se->name;
+        removed.name.len = se->len;
+        len += ngx_http_fancyindex_json_row_len(ctx, alcf, &removed);
+    }
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    p = ngx_cpymem_ssz(b->last, "{\"token\":\"");
+    p = ngx_cpymem(p, tok, NGX_HTTP_FANCYINDEX_TOKEN_LEN);
+    p = snapshot ? ngx_cpymem_ssz(p, "\",\n\"reset\":false")
+                 : ngx_cpymem_ssz(p, "\",\n\"reset\":true");
+
+    /* States of entries are 1 for added and 2 for modified ones. */
+    for (s = 0; s < 2; s++) {
+        p = ngx_cpymem_str(p, sections[s]);
+
+        for (first = 1, i = 0; i < ctx->nentries; i++) {
+            if (state[i] != s + 1)
+                continue;
+
+            if (!first)
+                *p++ = ',';
+
+            p = ngx_http_fancyindex_json_entry(p, &entry[i]);
+            first = 0;
+        }
+    }
+
+    p = ngx_cpymem_str(p, sections[2]);
+
+    for (first = 1, k = 0; (uint32_t) k < n; k++) {
+        if (seen[k])
+            continue;
+
+        se = (ngx_http_fancyindex_snapshot_entry_t *) (snapshot + offsets[k]);
+        removed.name.data = se->name;
+        removed.name.len  = se->len;
+        removed.dir       = se->dir;
+        removed.mtime     = se->mtime;
+        removed.size      = se->size;
+
+        if (!first)
+            *p++ = ',';
+
+        p = ngx_http_fancyindex_json_entry(p, &removed);
+        first = 0;
+    }
+
+    b->last = ngx_cpymem_ssz(p, "\n]}\n");
+    ctx->content = b;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: delta since \"%V\", %s, %ui entries",
+                   &ctx->since, snapshot ? "found" : "reset",
+                   ctx->nentries);
+
+    /* Keep a snapshot of the current state, if it is a new one. */
+    if (alcf->cache
+        && (ctx->since.len != NGX_HTTP_FANCYINDEX_TOKEN_LEN
+            || ngx_strncmp(ctx->since.data, tok,
+                           NGX_HTTP_FANCYINDEX_TOKEN_LEN) != 0
+            || snapshot == NULL))
+    {
+        key.len = ngx_sprintf(key.data, "%ui:since=%*s:%V%Z%V",
+                              alcf->generation,
+                              (size_t) NGX_HTTP_FANCYINDEX_TOKEN_LEN, tok,
+                              &r->uri, &ctx->path)
+                  - key.data;
+
+        ngx_http_fancyindex_snapshot_put(r, alcf, &key, NULL, ctx->entries,
+                                         ctx->nentries, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Generates the listing from the scanned entries. Listings which would not
+ * fit in the stream buffers are rendered piecewise as the client accepts
+ * data, so only the beginning of the table goes into the content buffer.
+ */
+static ngx_int_t
+ngx_http_fancyindex_render_page(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_format_t *fmt;
+    ngx_http_fancyindex_entry_t  *entry;
+    ngx_http_fancyindex_cache_t  *cache;
+
+    size_t       len, rows, n;
+    ngx_str_t   *tail;
+    ngx_uint_t   i, pages, watched;
+    ngx_buf_t   *b, *variants[NGX_HTTP_FANCYINDEX_ENCODINGS];
+
+    if (ctx->delta)
+        return ngx_http_fancyindex_render_delta(r, ctx, alcf);
+
+    /* Complete listings of directories can be sorted again later. */
+    if (ctx->read && ctx->key.len && !ctx->truncated)
+        ngx_http_fancyindex_entries_put(r, ctx, alcf);
+
+    fmt = &ngx_http_fancyindex_formats[ctx->format];
+    tail = ctx->truncated ? &fmt->truncated : &fmt->tail;
+    pages = 0;
+
+    /*
+     * Calculate needed buffer length.
+     */
+    if (ctx->format == NGX_HTTP_FANCYINDEX_FORMAT_HTML) {
+        len = r->uri.len
+            + ngx_sizeof_ssz(t05_body2)
+            + ngx_sizeof_ssz(t06_list1)
+            + ngx_sizeof_ssz(t_parentdir_entry)
+            ;
+
+        /*
+         * If we are a the root of the webserver (URI =  "/" --> length of 1),
+         * do not display the "Parent Directory" link.
+         */
+        if (r->uri.len == 1) {
+            len -= ngx_sizeof_ssz(t_parentdir_entry);
+        }
+
+        pages = ctx->per_page
+                && (ctx->page > 1 || ctx->total > ctx->per_page);
+
+        if (pages) {
+            len += NGX_HTTP_FANCYINDEX_PAGES_LEN;
+        }
+
+    } else {
+        len = fmt->head.len;
+    }
+
+    entry = ctx->entries;
+    rows = tail->len;
+    for (i = 0; i < ctx->nentries; i++) {
+        rows += fmt->row_len(ctx, alcf, &entry[i]);
+    }
+
+    ctx->stream = alcf->stream
+        && rows > (size_t) alcf->stream_bufs.num * alcf->stream_bufs.size;
+
+    if (ctx->stream) {
+        ctx->bufs = ngx_palloc(r->pool,
+                               sizeof(ngx_buf_t *) * alcf->stream_bufs.num);
+        if (ctx->bufs == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    } else {
+        len += rows;
+    }
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (ctx->format == NGX_HTTP_FANCYINDEX_FORMAT_HTML) {
+        b->last = ngx_cpymem_str(b->last, r->uri);
+        b->last = ngx_cpymem_ssz(b->last, t05_body2);
+
+        if (pages) {
+            b->last = ngx_http_fancyindex_pages(b->last, ctx);
+        }
+
+        b->last = ngx_cpymem_ssz(b->last, t06_list1);
+
+        /* "Parent dir" entry, always first if displayed */
+        if (r->uri.len > 1) {
+            b->last = ngx_cpymem_ssz(b->last,
+                                     "<tr>"
+                                     "<td><a href=\"../");
+            if (*ctx->sort_url_args) {
+                b->last = ngx_cpymem(b->last,
+                                     ctx->sort_url_args,
+                                     ngx_sizeof_ssz("?C=N&amp;O=A"));
+            }
+            b->last = ngx_cpymem_ssz(b->last,
+                                     "\">Parent directory/</a></td>"
+                                     "<td>-</td>"
+                                     "<td>-</td>"
+                                     "</tr>");
+        }
+
+    } else {
+        b->last = ngx_cpymem_str(b->last, fmt->head);
+    }
+
+    ctx->content = b;
+
+    if (ctx->stream) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: streaming %ui entries",
+                       ctx->nentries);
+        return NGX_OK;
+    }
+
+    /* Entries for directories and files */
+    for (i = 0; i < ctx->nentries; i++) {
+        b->last = fmt->render_row(b->last, ctx, alcf, &entry[i]);
+    }
+
+    /* Output table bottom */
+    b->last = ngx_cpymem_str(b->last, *tail);
+
+    /* Listings cut short in time may be complete the next time. */
+    if (ctx->key.len == 0
+        || (ctx->truncated & NGX_HTTP_FANCYINDEX_TRUNCATED_TIME))
+    {
+        return NGX_OK;
+    }
+
+    ngx_memzero(variants, sizeof(variants));
+    variants[NGX_HTTP_FANCYINDEX_IDENTITY] = b;
+
+    /*
+     * Only compress listings which can be cached, leaving the others to the
+     * gzip filter: those which are too recent, or too big for the zone.
+     */
+    cache = alcf->cache->data;
+    n = ngx_http_fancyindex_cache_node_size(&ctx->key, b->last - b->pos,
+                                            alcf->cache_path);
+
+    if (ctx->vary && ngx_file_mtime(&ctx->fi) < ngx_time()
+        && n != 0 && n <= cache->max_len)
+    {
+        ngx_http_fancyindex_compress_page(r, ctx, alcf, variants);
+    }
+
+    watched = 0;
+#if (NGX_HAVE_INOTIFY)
+    if (alcf->cache_watch)
+        watched = ngx_http_fancyindex_watch_key(ctx, alcf->cache);
+#endif
+
+    ngx_http_fancyindex_cache_put(r, alcf->cache, &ctx->key, &ctx->fi,
+                                  watched, variants, alcf->cache_path);
+
+    for (i = NGX_HTTP_FANCYINDEX_ENCODINGS - 1; i > 0; i--) {
+        if (variants[i] && (ctx->accept & (1 << i))) {
+            ctx->content  = variants[i];
+            ctx->encoding = i;
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Renders the listing, accounting for the time taken and the size of what
+ * was produced, compressed or not.
+ */
+static ngx_int_t
+ngx_http_fancyindex_render(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_int_t  rc;
+    uint64_t   start;
+
+    start = ngx_http_fancyindex_usec();
+
+    rc = ngx_http_fancyindex_render_page(r, ctx, alcf);
+
+    if (rc == NGX_OK && ctx->content)
+        ctx->stats.bytes += ngx_buf_size(ctx->content);
+
+    /* Whether it was stored or not, others need not wait any longer. */
+    if (ctx->lock.expires)
+        ngx_http_fancyindex_cache_unlock(alcf->cache, &ctx->key, &ctx->lock);
+
+    ctx->stats.render_time += ngx_http_fancyindex_usec() - start;
+
+    return rc;
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_fancyindex_scan_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_task_ctx_t *t = data;
+
+    (void) log; /* unused */
+
+#if (NGX_PCRE2)
+    if (t->alcf->ignore) {
+        t->ctx->match_data = pcre2_match_data_create(1, NULL);
+        if (t->ctx->match_data == NULL) {
+            t->ctx->scan_rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return;
+        }
+    }
+#endif /* NGX_PCRE2 */
+
+    t->ctx->scan_rc = ngx_http_fancyindex_scan(t->ctx, t->alcf, t->pool,
+                                               t->log);
+
+#if (NGX_PCRE2)
+    if (t->ctx->match_data) {
+        pcre2_match_data_free(t->ctx->match_data);
+        t->ctx->match_data = NULL;
+    }
+#endif /* NGX_PCRE2 */
+}
+
+
+static void
+ngx_http_fancyindex_scan_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c;
+    ngx_http_request_t *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http fancyindex: thread scan done \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    /*
+     * If the request was terminated meanwhile, the write event handler has
+     * been replaced by ngx_http_request_finalizer().
+     */
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/**
+ * Continues a request once its directory has been scanned in a thread,
+ * on the event loop.
+ */
+static void
+ngx_http_fancyindex_scan_done(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+
+    if (r->aio) {
+        /* Spurious write event while the scan is still running. */
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ctx  = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    rc = ctx->scan_rc;
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_render(r, ctx, alcf);
+    else
+        rc = ngx_http_fancyindex_failed(r, ctx, rc);
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, ctx, alcf);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+/**
+ * Hands over the directory scan to a thread pool. Entries are allocated
+ * from a pool of their own, as request pools must only be used from the
+ * event loop.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_post(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_task_ctx_t *t;
+    ngx_thread_task_t              *task;
+    ngx_pool_cleanup_t             *cln;
+    ngx_pool_t                     *pool;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+    if (pool == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    cln->handler = (ngx_pool_cleanup_pt) ngx_destroy_pool;
+    cln->data = pool;
+
+    task = ngx_thread_task_alloc(r->pool,
+                                 sizeof(ngx_http_fancyindex_task_ctx_t));
+    if (task == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    t = task->ctx;
+    t->ctx  = ctx;
+    t->alcf = alcf;
+    t->pool = pool;
+    t->log  = r->connection->log;
+
+    task->handler = ngx_http_fancyindex_scan_thread;
+    task->event.data = r;
+    task->event.handler = ngx_http_fancyindex_scan_event_handler;
+
+    if (ngx_thread_task_post(alcf->thread_pool, task) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    r->main->blocked++;
+    r->aio = 1;
+    r->write_event_handler = ngx_http_fancyindex_scan_done;
+
+    return NGX_DONE;
+}
+
+#endif /* NGX_THREADS */
+
+
+/*
+ * Trees are listed as a flat manifest of their entries, named by their
+ * path relative to the top directory. Directories are read breadth first,
+ * several of them at once when a thread pool is used, and the entries are
+ * sorted as a whole once every directory has been read.
+ */
+#define NGX_HTTP_FANCYINDEX_WALK_TASKS  4
+
+/**
+ * A directory of a tree.
+ */
+typedef struct {
+    ngx_str_t   path;    /**< Path, NUL-terminated. */
+    ngx_str_t   prefix;  /**< Prepended to the names of its entries. */
+    ngx_uint_t  escape;  /**< Same as in entries, for the prefix. */
+    size_t      utf_len; /**< Same as in entries, for the prefix. */
+    ngx_uint_t  depth;   /**< Zero for the top directory. */
+} ngx_http_fancyindex_walk_dir_t;
+
+struct ngx_http_fancyindex_walk_s {
+    ngx_array_t   dirs;    /**< Directories found, in order. */
+    ngx_uint_t    next;    /**< First directory not read yet. */
+    ngx_uint_t    depth;   /**< Levels to list. */
+    ngx_array_t   entries; /**< Entries of the tree. */
+    ngx_int_t     rc;
+#if (NGX_THREADS)
+    ngx_uint_t    running; /**< Directories being read in threads. */
+    ngx_uint_t    nidle;
+    ngx_thread_task_t *idle[NGX_HTTP_FANCYINDEX_WALK_TASKS];
+#endif
+    unsigned      truncated:1;
+};
+
+/**
+ * Reads one directory of a tree, possibly in a thread. The copy of the
+ * request context points to the directory, and has its own state.
+ */
+typedef struct {
+    ngx_http_fancyindex_ctx_t       ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_request_t             *r;
+    ngx_uint_t                      dir;   /**< Index in the directories. */
+    ngx_pool_t                     *pool;  /**< Pool for entries read. */
+    ngx_array_t                     entries;
+    ngx_int_t                       rc;
+} ngx_http_fancyindex_walk_task_t;
+
+
+/**
+ * Prepares a task to read the next directory of the tree.
+ */
+static ngx_int_t
+ngx_http_fancyindex_walk_task(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_walk_task_t *t)
+{
+    ngx_http_fancyindex_walk_t      *walk;
+    ngx_http_fancyindex_walk_dir_t  *dir;
+
+    walk = ctx->walk;
+    dir = (ngx_http_fancyindex_walk_dir_t *) walk->dirs.elts + walk->next;
+
+    t->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+    if (t->pool == NULL)
+        return NGX_ERROR;
+
+    t->ctx = *ctx;
+    t->ctx.path = dir->path;
+    t->ctx.dir_size = 0;
+    t->ctx.names = NULL;
+    t->ctx.names_end = NULL;
+    ngx_memzero(&t->ctx.stats, sizeof(ngx_http_fancyindex_stats_t));
+#if (NGX_PCRE2 && NGX_THREADS)
+    t->ctx.match_data = NULL;
+#endif
+    t->r = r;
+    t->dir = walk->next++;
+    t->rc = NGX_OK;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_fancyindex_walk_read(ngx_http_fancyindex_walk_task_t *t,
+    ngx_log_t *log)
+{
+    uint64_t  start;
+
+    if (ngx_array_init(&t->entries, t->pool, 40,
+                       sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+    {
+        t->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return;
+    }
+
+    start = ngx_http_fancyindex_usec();
+
+    t->rc = ngx_http_fancyindex_read_dir(&t->ctx, t->alcf, &t->entries,
+                                         t->pool, log);
+
+    t->ctx.stats.read_time = ngx_http_fancyindex_usec() - start;
+}
+
+
+/**
+ * Adds the entries read by a task to the tree, and the directories among
+ * them to those to read. Directories below the top one which can not be
+ * read are skipped, their contents are just not listed. Must be called
+ * from the event loop; the pool of the task can be destroyed afterwards.
+ */
+static ngx_int_t
+ngx_http_fancyindex_walk_merge(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf,
+    ngx_http_fancyindex_walk_task_t *t)
+{
+    u_char                          *p;
+    size_t                           len;
+    ngx_uint_t                       i;
+    ngx_http_fancyindex_walk_t      *walk;
+    ngx_http_fancyindex_entry_t     *e, *entry;
+    ngx_http_fancyindex_walk_dir_t   parent, *dir;
+
+    walk = ctx->walk;
+
+    ctx->stats.scanned    += t->ctx.stats.scanned;
+    ctx->stats.filtered   += t->ctx.stats.filtered;
+    ctx->stats.stat_calls += t->ctx.stats.stat_calls;
+    ctx->stats.read_time  += t->ctx.stats.read_time;
+
+    if (t->rc != NGX_OK)
+        return (t->dir == 0) ? t->rc : NGX_OK;
+
+    /* The array of directories may grow while adding entries. */
+    parent = ((ngx_http_fancyindex_walk_dir_t *) walk->dirs.elts)[t->dir];
+
+    e = t->entries.elts;
+
+    for (i = 0; i < t->entries.nelts; i++) {
+        if (walk->entries.nelts >= alcf->recursive_max) {
+            walk->truncated = 1;
+            return NGX_OK;
+        }
+
+        len = parent.prefix.len + e[i].name.len;
+
+        if ((entry = ngx_array_push(&walk->entries)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        /* Keys collate the whole path, tasks leave them out. */
+        *entry = e[i];
+        entry->escape  += parent.escape;
+        entry->utf_len += parent.utf_len;
+
+        if (!e[i].dir || parent.depth + 1 >= walk->depth) {
+            if ((p = ngx_pnalloc(r->pool, len + 1)) == NULL)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+            entry->name.data = p;
+            entry->name.len  = len;
+
+            p = ngx_cpymem_str(p, parent.prefix);
+            p = ngx_cpymem_str(p, e[i].name);
+            *p = '\0';
+
+            if (ngx_http_fancyindex_collate(alcf, entry, NULL, r->pool)
+                != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            continue;
+        }
+
+        /*
+         * The path of a subdirectory ends with a slash, and the name of its
+         * entry and the prefix of its own entries point into it.
+         */
+        if ((dir = ngx_array_push(&walk->dirs)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        dir->path.len = ctx->path.len + 1 + len + 1;
+        dir->path.data = ngx_pnalloc(r->pool, dir->path.len + 1 + len + 1);
+        if (dir->path.data == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        p = ngx_cpymem_str(dir->path.data, ctx->path);
+        *p++ = '/';
+        dir->prefix.data = p;
+        p = ngx_cpymem_str(p, parent.prefix);
+        p = ngx_cpymem_str(p, e[i].name);
+        *p++ = '/';
+        *p++ = '\0';
+        dir->prefix.len = len + 1;
+
+        ngx_memcpy(p, dir->prefix.data, len);
+        p[len] = '\0';
+        entry->name.data = p;
+        entry->name.len  = len;
+
+        dir->escape  = entry->escape;
+        dir->utf_len = entry->utf_len + 1;
+        dir->depth   = parent.depth + 1;
+
+        if (ngx_http_fancyindex_collate(alcf, entry, NULL, r->pool) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_walk_finish(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_walk_t  *walk;
+    uint64_t                     start;
+
+    walk = ctx->walk;
+
+    if (walk->truncated) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "listing of \"%V\" truncated to %ui entries",
+                      &ctx->path, alcf->recursive_max);
+        ctx->truncated |= NGX_HTTP_FANCYINDEX_TRUNCATED_ENTRIES;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: tree \"%V\", %ui directories, "
+                   "%ui entries", &ctx->path, walk->dirs.nelts,
+                   walk->entries.nelts);
+
+    start = ngx_http_fancyindex_usec();
+
+    ngx_http_fancyindex_arrange(ctx, alcf, walk->entries.elts,
+                                walk->entries.nelts, r->pool);
+
+    ctx->stats.sort_time += ngx_http_fancyindex_usec() - start;
+
+    return ngx_http_fancyindex_render(r, ctx, alcf);
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t ngx_http_fancyindex_walk_post(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf);
+
+static void ngx_http_fancyindex_walk_done(ngx_http_request_t *r);
+
+
+static void
+ngx_http_fancyindex_walk_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_walk_task_t *t = data;
+
+#if (NGX_PCRE2)
+    if (t->alcf->ignore) {
+        t->ctx.match_data = pcre2_match_data_create(1, NULL);
+        if (t->ctx.match_data == NULL) {
+            t->rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return;
+        }
+    }
+#endif /* NGX_PCRE2 */
+
+    ngx_http_fancyindex_walk_read(t, log);
+
+#if (NGX_PCRE2)
+    if (t->ctx.match_data) {
+        pcre2_match_data_free(t->ctx.match_data);
+        t->ctx.match_data = NULL;
+    }
+#endif /* NGX_PCRE2 */
+}
+
+
+/**
+ * Merges what a thread read, and keeps reading the tree. The request
+ * continues in ngx_http_fancyindex_walk_done() once nothing is running.
+ */
+static void
+ngx_http_fancyindex_walk_event_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                       reading;
+    ngx_connection_t                *c;
+    ngx_thread_task_t               *task;
+    ngx_http_request_t              *r;
+    ngx_http_fancyindex_ctx_t       *ctx;
+    ngx_http_fancyindex_walk_t      *walk;
+    ngx_http_fancyindex_walk_task_t *t;
+    ngx_http_fancyindex_loc_conf_t  *alcf;
+
+    task = ev->data;
+    t = task->ctx;
+    r = t->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ctx  = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = t->alcf;
+    walk = ctx->walk;
+
+    r->main->blocked--;
+    walk->running--;
+
+    /*
+     * Once the request was terminated the write event handler has been
+     * replaced by ngx_http_request_finalizer(), stop reading then.
+     */
+    reading = (r->write_event_handler == ngx_http_fancyindex_walk_done);
+
+    if (walk->rc == NGX_OK && reading)
+        walk->rc = ngx_http_fancyindex_walk_merge(r, ctx, alcf, t);
+
+    ngx_destroy_pool(t->pool);
+    walk->idle[walk->nidle++] = task;
+
+    if (walk->rc == NGX_OK && reading)
+        walk->rc = ngx_http_fancyindex_walk_post(r, ctx, alcf);
+
+    if (walk->running)
+        return;
+
+    r->aio = 0;
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/**
+ * Continues a request once its tree has been read, on the event loop.
+ */
+static void
+ngx_http_fancyindex_walk_done(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+
+    if (r->aio) {
+        /* Spurious write event while directories are still being read. */
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    ctx  = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    rc = ctx->walk->rc;
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_walk_finish(r, ctx, alcf);
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, ctx, alcf);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+/**
+ * Hands over directories to the thread pool, as long as there are idle
+ * tasks and the tree has not grown too big.
+ */
+static ngx_int_t
+ngx_http_fancyindex_walk_post(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_thread_task_t           *task;
+    ngx_http_fancyindex_walk_t  *walk;
+
+    walk = ctx->walk;
+
+    while (walk->nidle && walk->next < walk->dirs.nelts
+           && !walk->truncated)
+    {
+        task = walk->idle[walk->nidle - 1];
+
+        if (ngx_http_fancyindex_walk_task(r, ctx, task->ctx) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        if (ngx_thread_task_post(alcf->thread_pool, task) != NGX_OK) {
+            ngx_destroy_pool(((ngx_http_fancyindex_walk_task_t *)
+                              task->ctx)->pool);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        walk->nidle--;
+        walk->running++;
+        r->main->blocked++;
+        r->aio = 1;
+    }
+
+    return NGX_OK;
+}
+
+#endif /* NGX_THREADS */
+
+
+/**
+ * Lists the tree below the directory of the request. Returns NGX_DONE when
+ * directories are read in a thread pool; the request then continues in
+ * ngx_http_fancyindex_walk_done().
+ */
+static ngx_int_t
+ngx_http_fancyindex_walk(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_int_t                        rc;
+    ngx_http_fancyindex_walk_t      *walk;
+    ngx_http_fancyindex_walk_dir_t  *dir;
+    ngx_http_fancyindex_walk_task_t  t;
+#if (NGX_THREADS)
+    ngx_uint_t                       i;
+    ngx_thread_task_t               *task;
+#endif
+
+    if ((walk = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_walk_t)))
+            == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ctx->walk = walk;
+    walk->depth = ctx->depth;
+
+    if (ngx_array_init(&walk->dirs, r->pool, 16,
+                       sizeof(ngx_http_fancyindex_walk_dir_t)) != NGX_OK
+        || ngx_array_init(&walk->entries, r->pool, 256,
+                          sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK
+        || (dir = ngx_array_push(&walk->dirs)) == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memzero(dir, sizeof(ngx_http_fancyindex_walk_dir_t));
+    dir->path = ctx->path;
+
+#if (NGX_THREADS)
+    if (alcf->thread_pool) {
+        for (i = 0; i < NGX_HTTP_FANCYINDEX_WALK_TASKS; i++) {
+            task = ngx_thread_task_alloc(r->pool,
+                                 sizeof(ngx_http_fancyindex_walk_task_t));
+            if (task == NULL)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+            ((ngx_http_fancyindex_walk_task_t *) task->ctx)->alcf = alcf;
+            task->handler = ngx_http_fancyindex_walk_thread;
+            task->event.data = task;
+            task->event.handler = ngx_http_fancyindex_walk_event_handler;
+
+            walk->idle[walk->nidle++] = task;
+        }
+
+        r->write_event_handler = ngx_http_fancyindex_walk_done;
+
+        /* With tasks running, errors are sent once they are done. */
+        walk->rc = ngx_http_fancyindex_walk_post(r, ctx, alcf);
+        if (walk->running)
+            return NGX_DONE;
+
+        r->write_event_handler = ngx_http_request_empty_handler;
+        return walk->rc;
+    }
+#endif /* NGX_THREADS */
+
+    t.alcf = alcf;
+
+    while (walk->next < walk->dirs.nelts && !walk->truncated) {
+        if (ngx_http_fancyindex_walk_task(r, ctx, &t) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        ngx_http_fancyindex_walk_read(&t, r->connection->log);
+        rc = ngx_http_fancyindex_walk_merge(r, ctx, alcf, &t);
+
+        ngx_destroy_pool(t.pool);
+
+        if (rc != NGX_OK)
+            return rc;
+    }
+
+    return ngx_http_fancyindex_walk_finish(r, ctx, alcf);
+}
+
+
+/**
+ * Tells whether an If-None-Match header lists the given entity tag, using
+ * the weak comparison function.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_etag_match(ngx_table_elt_t *header, ngx_str_t *etag)
+{
+    u_char *start, *end;
+
+    start = header->value.data;
+    end = start + header->value.len;
+
+    if (header->value.len == 1 && *start == '*')
+        return 1;
+
+    while (start < end) {
+        if (end - start > 2 && start[0] == 'W' && start[1] == '/')
+            start += 2;
+
+        if ((size_t) (end - start) < etag->len)
+            return 0;
+
+        if (ngx_strncmp(start, etag->data, etag->len) == 0) {
+            start += etag->len;
+
+            while (start < end && (*start == ' ' || *start == '\t'))
+                start++;
+
+            if (start == end || *start == ',')
+                return 1;
+        }
+
+        while (start < end && *start != ',')
+            start++;
+
+        while (start < end && (*start == ',' || *start == ' '
+                               || *start == '\t'))
+            start++;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Sets Last-Modified and ETag from the directory information. The entity
+ * tag covers everything the listing depends on: the directory inode and
+ * modification time, the configuration, the sort criterion, whether
+ * names are measured as UTF-8, the output format and the page. Returns
+ * whether the conditional headers of the request match, in which case the
+ * listing needs not be generated.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_validators(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    time_t                     ims;
+    ngx_table_elt_t           *etag;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    r->headers_out.last_modified_time = ngx_file_mtime(&ctx->fi);
+
+    if (clcf->etag) {
+        if ((etag = ngx_list_push(&r->headers_out.headers)) == NULL)
+            return 0;
+
+        etag->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+        etag->next = NULL;
+#endif
+        ngx_str_set(&etag->key, "ETag");
+
+        etag->value.data = ngx_pnalloc(r->pool, ngx_sizeof_ssz("\"-----\"")
+                                                + 3 * NGX_INT64_LEN
+                                                + 3 * NGX_INT_T_LEN + 2);
+        if (etag->value.data == NULL) {
+            etag->hash = 0;
+            return 0;
+        }
+
+        etag->value.len = ngx_sprintf(etag->value.data,
+                                      "\"%xT-%xL-%xi-%ui%ui%ui-%xi-%xi\"",
+                                      ngx_file_mtime(&ctx->fi),
+                                      (uint64_t) ngx_file_uniq(&ctx->fi),
+                                      alcf->generation,
+                                      ctx->sort_criterion, ctx->utf8,
+                                      ctx->format, ctx->page, ctx->per_page)
+                          - etag->value.data;
+
+        r->headers_out.etag = etag;
+    }
+
+    if (r->headers_in.if_none_match) {
+        return r->headers_out.etag
+               && ngx_http_fancyindex_etag_match(r->headers_in.if_none_match,
+                                                 &r->headers_out.etag->value);
+    }
+
+    if (r->headers_in.if_modified_since == NULL
+        || clcf->if_modified_since == NGX_HTTP_IMS_OFF)
+    {
+        return 0;
+    }
+
+    ims = ngx_http_parse_time(r->headers_in.if_modified_since->value.data,
+                              r->headers_in.if_modified_since->value.len);
+
+    if (ims == NGX_ERROR)
+        return 0;
+
+    if (clcf->if_modified_since == NGX_HTTP_IMS_EXACT)
+        return ims == r->headers_out.last_modified_time;
+
+    return ims >= r->headers_out.last_modified_time;
+}
+
+
+/**
+ * Determine the page of the listing to render. URL arguments look like:
+ *
+ *    page=n[&per_page=m]
+ *
+ * Pages are numbered from 1. Without per_page the configured page size is
+ * used, and listings are not paginated if that is zero.
+ */
+static void
+ngx_http_fancyindex_pagination(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_str_t  value;
+    ngx_int_t  n;
+
+    ctx->page = 1;
+    ctx->per_page = alcf->page_size;
+
+    if (ngx_http_arg(r, (u_char *) "per_page", 8, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+        if (n != NGX_ERROR) {
+            ctx->per_page = n;
+            ctx->per_page_arg = 1;
+        }
+    }
+
+    if (ctx->per_page == 0)
+        return;
+
+    if (ngx_http_arg(r, (u_char *) "page", 4, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+        if (n > 0)
+            ctx->page = n;
+    }
+}
+
+
+static void ngx_http_fancyindex_lock_event_handler(ngx_event_t *ev);
+
+static void ngx_http_fancyindex_lock_done(ngx_http_request_t *r);
+
+
+/**
+ * Looks up the listing of the request in the cache zone, once the
+ * directory information is known, and then a snapshot of the entries of
+ * the directory to render it from. Returns NGX_DECLINED when the directory
+ * has to be read, and NGX_AGAIN when another request is building the
+ * listing.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cached(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  how;
+
+    how = NGX_HTTP_FANCYINDEX_CACHE_STAT;
+
+#if (NGX_HAVE_INOTIFY)
+    if (alcf->cache_watch
+        && ngx_http_fancyindex_watch_key(ctx, alcf->cache))
+    {
+        how = NGX_HTTP_FANCYINDEX_CACHE_WATCH;
+    }
+#endif
+
+    rc = ngx_http_fancyindex_cache_get(r, alcf->cache, &ctx->key,
+                                       &ctx->fi, how, ctx->accept,
+                                       &ctx->encoding, &ctx->content,
+                                       ((ctx->lock.wait || ctx->lock.stale)
+                                        && !r->header_only)
+                                           ? &ctx->lock : NULL);
+    if (rc == NGX_ERROR)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (rc == NGX_AGAIN)
+        return NGX_AGAIN;
+
+    if (rc == NGX_OK && ctx->lock.updating) {
+        /* Validators are those of the directory, not of the listing. */
+        ngx_http_clear_last_modified(r);
+
+        if (r->headers_out.etag) {
+            r->headers_out.etag->hash = 0;
+            r->headers_out.etag = NULL;
+        }
+
+        ctx->stats.lookup = NGX_HTTP_FANCYINDEX_LOOKUP_UPDATING;
+        return NGX_OK;
+    }
+
+    ctx->stats.lookup = (rc == NGX_OK) ? NGX_HTTP_FANCYINDEX_LOOKUP_HIT
+                                       : NGX_HTTP_FANCYINDEX_LOOKUP_MISS;
+    if (rc == NGX_OK || r->header_only)
+        return rc;
+
+    /* The same directory may have been listed in another order. */
+    rc = ngx_http_fancyindex_entries_get(r, ctx, alcf);
+    if (rc == NGX_OK)
+        return ngx_http_fancyindex_render(r, ctx, alcf);
+
+    return rc;
+}
+
+
+/**
+ * Checks that the directory can be read, which is all that requests for
+ * headers only need when the listing is not cached: ctx->content is left
+ * NULL, and the responses are the same as when reading the directory.
+ */
+static ngx_int_t
+ngx_http_fancyindex_probe(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_dir_t  dir;
+
+    if (ngx_open_dir(&ctx->path, &dir) == NGX_ERROR)
+        return ngx_http_fancyindex_failed(r, ctx,
+                   ngx_http_fancyindex_open_error(r->connection->log,
+                                                  ngx_errno, ngx_open_dir_n,
+                                                  &ctx->path));
+
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", &ctx->path);
+    }
+
+    return NGX_OK;
+}
+
+
+/**
+ * Reads the directory, or the tree, and renders its listing. Returns
+ * NGX_DONE when reading was handed over to a thread pool.
+ */
+static ngx_int_t
+ngx_http_fancyindex_build(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_int_t  rc;
+
+    if (r->header_only)
+        return ngx_http_fancyindex_probe(r, ctx);
+
+    if (ctx->depth)
+        return ngx_http_fancyindex_walk(r, ctx, alcf);
+
+#if (NGX_THREADS)
+    if (alcf->thread_pool)
+        return ngx_http_fancyindex_scan_post(r, ctx, alcf);
+#endif /* NGX_THREADS */
+
+    rc = ngx_http_fancyindex_scan(ctx, alcf, r->pool, r->connection->log);
+    if (rc != NGX_OK)
+        return ngx_http_fancyindex_failed(r, ctx, rc);
+
+    return ngx_http_fancyindex_render(r, ctx, alcf);
+}
+
+
+/**
+ * Waits for another request to build the listing, looking it up again
+ * every NGX_HTTP_FANCYINDEX_CACHE_LOCK_POLL milliseconds until the lock is
+ * released or the deadline is reached. The request then continues in
+ * ngx_http_fancyindex_lock_done().
+ */
+static ngx_int_t
+ngx_http_fancyindex_lock_wait(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_msec_t  timer;
+
+    timer = (ngx_msec_t) (ctx->lock.deadline - ngx_current_msec);
+
+    ctx->lock_event.handler = ngx_http_fancyindex_lock_event_handler;
+    ctx->lock_event.data = r;
+    ctx->lock_event.log = r->connection->log;
+
+    ngx_add_timer(&ctx->lock_event,
+                  ngx_min(timer, NGX_HTTP_FANCYINDEX_CACHE_LOCK_POLL));
+
+    r->main->blocked++;
+    r->write_event_handler = ngx_http_fancyindex_lock_done;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_fancyindex_lock_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c;
+    ngx_http_request_t *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http fancyindex: cache lock wait \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    r->main->blocked--;
+
+    /*
+     * If the request was terminated meanwhile, the write event handler has
+     * been replaced by ngx_http_request_finalizer().
+     */
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/**
+ * Continues a request which waited for another one to build its listing,
+ * on the event loop.
+ */
+static void
+ngx_http_fancyindex_lock_done(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+
+    ctx  = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (ctx->lock_event.timer_set) {
+        /* Spurious write event while still waiting. */
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    rc = ngx_http_fancyindex_cached(r, ctx, alcf);
+
+    if (rc == NGX_AGAIN) {
+        (void) ngx_http_fancyindex_lock_wait(r, ctx);
+        return;
+    }
+
+    if (rc == NGX_DECLINED)
+        rc = ngx_http_fancyindex_build(r, ctx, alcf);
+
+    if (rc == NGX_DONE) {
+        /* Continues in ngx_http_fancyindex_scan_done() */
+        return;
+    }
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, ctx, alcf);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+/**
+ * Releases the cache lock of a request which ends without rendering its
+ * listing, and stops waiting for another one.
+ */
+static void
+ngx_http_fancyindex_lock_cleanup(void *data)
+{
+    ngx_http_request_t             *r = data;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+
+    ctx  = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (ctx->lock_event.timer_set)
+        ngx_del_timer(&ctx->lock_event);
+
+    ngx_http_fancyindex_cache_unlock(alcf->cache, &ctx->key, &ctx->lock);
+}
+
+
+/**
+ * Prepares the listing in ctx->content, either from the cache or by
+ * scanning the directory. Returns NGX_DONE when the scan was handed over
+ * to a thread pool, or when waiting for another request to build the
+ * listing; the request then continues in ngx_http_fancyindex_scan_done(),
+ * or in ngx_http_fancyindex_lock_done().
+ */
+static ngx_int_t
+make_content_buf(
+        ngx_http_request_t *r, ngx_http_fancyindex_ctx_t *ctx,
+        ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    size_t       root;
+    u_char      *last;
+    ngx_int_t    rc;
+    ngx_str_t    path, value;
+    ngx_int_t    n;
+    ngx_uint_t   validate, standalone, negotiated;
+    ngx_pool_cleanup_t  *cln;
+
+    /*
+     * NGX_DIR_MASK_LEN is lesser than NGX_HTTP_FANCYINDEX_PREALLOCATE
+     */
+    if ((last = ngx_http_map_uri_to_path(r, &path, &root,
+                    NGX_HTTP_FANCYINDEX_PREALLOCATE)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ctx->allocated = path.len;
+    path.len  = last - path.data - 1;
+    path.data[path.len] = '\0';
+    ctx->path = path;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: \"%s\"", path.data);
+
+    /* Directories which could not be listed recently fail at once. */
+    if (alcf->cache && alcf->cache_errors) {
+        rc = ngx_http_fancyindex_error_get(r, ctx, alcf);
+        if (rc != NGX_DECLINED) {
+            ctx->stats.lookup = NGX_HTTP_FANCYINDEX_LOOKUP_HIT;
+            return rc;
+        }
+    }
+
+    /* Nothing is rendered for HEAD requests, see probe(). */
+    if (r->method == NGX_HTTP_HEAD)
+        r->header_only = 1;
+
+    ctx->sort_criterion = ngx_http_fancyindex_sort_criterion(r, alcf,
+                                                   &ctx->sort_url_args);
+
+    ctx->utf8 = r->headers_out.charset.len == 5 &&
+        ngx_strncasecmp(r->headers_out.charset.data, (u_char*) "utf-8", 5) == 0;
+
+    ctx->format = ngx_http_fancyindex_output_format(r, alcf, &negotiated);
+    ctx->vary_accept = negotiated;
+
+    /*
+     * The viewer is the same for every directory, and only needs to know
+     * that the directory can be listed; it fetches the listing itself.
+     */
+    if (ctx->format == NGX_HTTP_FANCYINDEX_FORMAT_JS)
+        return ngx_http_fancyindex_probe(r, ctx);
+
+    ngx_http_fancyindex_pagination(r, ctx, alcf);
+
+    if (alcf->cache)
+        ctx->stats.lookup = NGX_HTTP_FANCYINDEX_LOOKUP_BYPASS;
+
+    /*
+     * Trees are listed when asked for with the R argument, down to the
+     * given number of levels, up to the configured one. They are neither
+     * cached nor validated, as any directory of the tree may change.
+     */
+    if (alcf->recursive_depth
+        && ngx_http_arg(r, (u_char *) "R", 1, &value) == NGX_OK
+        && (n = ngx_atoi(value.data, value.len)) != 0)
+    {
+        ctx->depth = (n == NGX_ERROR)
+                     ? alcf->recursive_depth
+                     : ngx_min((ngx_uint_t) n, alcf->recursive_depth);
+    }
+
+    /*
+     * Delta listings report the changes since a previous state of the
+     * directory, and are neither cached nor validated as a whole.
+     */
+    if (ngx_http_arg(r, (u_char *) "since", 5, &ctx->since) == NGX_OK) {
+        ctx->delta = 1;
+        ctx->format = NGX_HTTP_FANCYINDEX_FORMAT_JSON;
+        ctx->vary_accept = 0;
+        ctx->per_page = 0;
+        goto scan;
+    }
+
+    if (ctx->depth)
+        goto scan;
+
+    /*
+     * Compressed variants can be kept only for pages which do not include
+     * the output of subrequests; only HTML pages include them.
+     */
+    ctx->accept = 1 << NGX_HTTP_FANCYINDEX_IDENTITY;
+
+    standalone = ctx->format != NGX_HTTP_FANCYINDEX_FORMAT_HTML
+                 || (alcf->header == NULL && alcf->footer == NULL);
+
+    if (alcf->cache && alcf->compress && standalone) {
+        ctx->vary = 1;
+        ctx->accept = ngx_http_fancyindex_accepted(r, alcf);
+    }
+
+    /*
+     * Validators are not sent when the page includes the output of
+     * subrequests, which may change independently.
+     */
+    validate = standalone;
+
+    /*
+     * Listings are cached by (configuration, sort criterion, charset,
+     * format, page, URI, path).
+     */
+    if (alcf->cache) {
+        ctx->key.len = 3 * (NGX_INT_T_LEN + 1) + 3 * 2
+                       + r->uri.len + 1 + path.len;
+        if ((ctx->key.data = ngx_pnalloc(r->pool, ctx->key.len)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        ctx->key.len = ngx_sprintf(ctx->key.data,
+                                   "%ui:%ui:%ui:%ui:%ui:%ui:%V%Z%V",
+                                   alcf->generation, ctx->sort_criterion,
+                                   ctx->utf8, ctx->format, ctx->page,
+                                   ctx->per_page, &r->uri, &path)
+                       - ctx->key.data;
+
+#if (NGX_HAVE_INOTIFY)
+        /*
+         * Listings of directories which are being watched are known to be
+         * fresh, and are served without looking at the directory at all.
+         */
+        if (alcf->cache_watch) {
+            rc = ngx_http_fancyindex_cache_get(r, alcf->cache, &ctx->key,
+                                     &ctx->fi,
+                                     NGX_HTTP_FANCYINDEX_CACHE_WATCHED,
+                                     ctx->accept, &ctx->encoding,
+                                     &ctx->content, NULL);
+            if (rc == NGX_ERROR)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+            if (rc == NGX_OK) {
+                ctx->stats.lookup = NGX_HTTP_FANCYINDEX_LOOKUP_HIT;
+                if (validate && ngx_http_fancyindex_validators(r, ctx, alcf))
+                    ctx->not_modified = 1;
+                return NGX_OK;
+            }
+
+            ngx_http_fancyindex_watch(r, ctx);
+        }
+#endif
+    }
+
+    /*
+     * A single stat() of the directory provides the validators and tells
+     * whether a cached listing is still fresh; if it fails let the scan
+     * report the error.
+     */
+    if (!(alcf->cache || validate))
+        goto scan;
+
+    if (ngx_file_info(path.data, &ctx->fi) == NGX_FILE_ERROR) {
+        ctx->key.len = 0;
+        goto scan;
+    }
+
+    ctx->have_fi = 1;
+
+    if (validate && ngx_http_fancyindex_validators(r, ctx, alcf)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: not modified \"%V\"", &r->uri);
+        ctx->not_modified = 1;
+        return NGX_OK;
+    }
+
+    if (alcf->cache) {
+        if (alcf->cache_lock
+            || alcf->cache_use_stale != NGX_HTTP_FANCYINDEX_STALE_OFF)
+        {
+            if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+            cln->handler = ngx_http_fancyindex_lock_cleanup;
+            cln->data = r;
+
+            ctx->lock.timeout = alcf->cache_lock_timeout;
+            ctx->lock.wait    = alcf->cache_lock ? 1 : 0;
+            ctx->lock.stale   = (alcf->cache_use_stale
+                                 == NGX_HTTP_FANCYINDEX_STALE_UPDATING);
+        }
+
+        rc = ngx_http_fancyindex_cached(r, ctx, alcf);
+
+        if (rc == NGX_AGAIN)
+            return ngx_http_fancyindex_lock_wait(r, ctx);
+
+        if (rc != NGX_DECLINED)
+            return rc;
+    }
+
+scan:
+
+    return ngx_http_fancyindex_build(r, ctx, alcf);
+}
+
+
+
+/**
+ * Renders rows of a streamed listing into the stream buffers, passing each
+ * one down the filter chain as soon as it is filled. Buffers are reused
+ * once they have been sent; NGX_AGAIN is returned when all of them are
+ * still waiting to be sent.
+ */
+static ngx_int_t
+ngx_http_fancyindex_stream(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_format_t *fmt;
+    ngx_http_fancyindex_entry_t  *entry;
+    ngx_chain_t                   out;
+    ngx_uint_t                    i;
+    ngx_buf_t                    *b;
+    ngx_str_t                    *tail;
+    size_t                        len;
+    ngx_int_t                     rc;
+    uint64_t                      start;
+
+    fmt = &ngx_http_fancyindex_formats[ctx->format];
+    tail = ctx->truncated ? &fmt->truncated : &fmt->tail;
+    start = ngx_http_fancyindex_usec();
+    rc = NGX_OK;
+
+    while (!ctx->done) {
+        for (b = NULL, i = 0; i < ctx->nbufs; i++) {
+            if (ctx->bufs[i]->pos == ctx->bufs[i]->last) {
+                b = ctx->bufs[i];
+                break;
+            }
+        }
+
+        if (b == NULL) {
+            if (ctx->nbufs == (ngx_uint_t) alcf->stream_bufs.num) {
+                rc = NGX_AGAIN;
+                break;
+            }
+
+            b = ngx_create_temp_buf(r->pool, alcf->stream_bufs.size);
+            if (b == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            b->tag = (ngx_buf_tag_t) &ngx_http_fancyindex_module;
+            ctx->bufs[ctx->nbufs++] = b;
+        }
+
+        /* Make the write filter send out the buffer so it can be reused. */
+        b->pos = b->last = b->start;
+        b->recycled = 1;
+
+        len = 0;
+        while (ctx->next < ctx->nentries) {
+            entry = &ctx->entries[ctx->next];
+            len = fmt->row_len(ctx, alcf, entry);
+            if ((size_t) (b->end - b->last) < len)
+                break;
+
+            b->last = fmt->render_row(b->last, ctx, alcf, entry);
+            ctx->next++;
+        }
+
+        if (ctx->next == ctx->nentries) {
+            len = tail->len;
+            if ((size_t) (b->end - b->last) >= len) {
+                b->last = ngx_cpymem_str(b->last, *tail);
+                ctx->done = 1;
+            }
+        }
+
+        if (b->last == b->pos) {
+            /*
+             * A row which does not fit in an empty stream buffer, render it
+             * into a buffer of its own which is not reused afterwards.
+             */
+            if ((b = ngx_create_temp_buf(r->pool, len)) == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+
+            if (ctx->next < ctx->nentries) {
+                b->last = fmt->render_row(b->last, ctx, alcf,
+                                          &ctx->entries[ctx->next++]);
+            } else {
+                b->last = ngx_cpymem_str(b->last, *tail);
+                ctx->done = 1;
+            }
+        }
+
+        out.buf  = b;
+        out.next = NULL;
+
+        ctx->stats.bytes += b->last - b->pos;
+
+        if (ngx_http_output_filter(r, &out) == NGX_ERROR) {
+            rc = NGX_ERROR;
+            break;
+        }
+    }
+
+    ctx->stats.render_time += ngx_http_fancyindex_usec() - start;
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_stream_wait(ngx_http_request_t *r)
+{
+    ngx_event_t              *wev;
+    ngx_http_core_loc_conf_t *clcf;
+
+    wev = r->connection->write;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    r->write_event_handler = ngx_http_fancyindex_stream_handler;
+
+    if (!wev->delayed) {
+        ngx_add_timer(wev, clcf->send_timeout);
+    }
+
+    return ngx_handle_write_event(wev, clcf->send_lowat);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_send_footer(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_request_t *sr;
+    ngx_str_t          *sr_uri;
+    ngx_str_t           rel_uri;
+    ngx_int_t           rc;
+    ngx_chain_t         out = { NULL, NULL };
+
+    if (ctx->format != NGX_HTTP_FANCYINDEX_FORMAT_HTML) {
+        return ngx_http_send_special(r, NGX_HTTP_LAST);
+    }
+
+    if (alcf->footer == NULL || alcf->footer->local) {
+        goto add_builtin_footer;
+    }
+
+    /* URI is configured, make Nginx take care of with a subrequest. */
+    sr_uri = &alcf->footer->path;
+
+    if (*sr_uri->data != '/') {
+        /* Relative path */
+        rel_uri.len  = r->uri.len + sr_uri->len;
+        rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
+        if (rel_uri.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
+                sr_uri->data, sr_uri->len);
+        sr_uri = &rel_uri;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "http fancyindex: footer subrequest \"%V\"", sr_uri);
+
+    rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
+    if (rc == NGX_ERROR || rc == NGX_DONE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: footer subrequest for \"%V\" failed", sr_uri);
+        return rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "http fancyindex: header subrequest status = %i",
+            sr->headers_out.status);
+
+    /* see above: ngx_http_subrequest resturns NGX_OK (0) not NGX_HTTP_OK (200) */
+    if (sr->headers_out.status != NGX_OK) {
+        /*
+         * XXX: Should we write a message to the error log just in case
+         * we get something different from a 404?
+         */
+        goto add_builtin_footer;
+    }
+
+    return (r != r->main) ? rc : ngx_http_send_special(r, NGX_HTTP_LAST);
+
+add_builtin_footer:
+    if (ngx_http_fancyindex_footer_buf(r, alcf, &out.buf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    if (out.buf == NULL) {
+        return ngx_http_send_special(r, NGX_HTTP_LAST);
+    }
+    out.buf->last_in_chain = 1;
+    out.buf->last_buf = 1;
+    /* Directly send out the builtin footer */
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void
+ngx_http_fancyindex_stream_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_event_t                    *wev;
+    ngx_connection_t               *c;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+
+    c = r->connection;
+    wev = c->write;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ctx  = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http fancyindex: resuming stream at entry %ui",
+                   ctx->next);
+
+    /* Push out data which could not be sent before. */
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    rc = ngx_http_fancyindex_stream(r, ctx, alcf);
+
+    if (rc == NGX_AGAIN) {
+        if (ngx_http_fancyindex_stream_wait(r) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    ngx_http_finalize_request(r, ngx_http_fancyindex_send_footer(r, ctx, alcf));
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+
+
+    if (r->uri.data[r->uri.len - 1] != '/') {
+        return NGX_DECLINED;
+    }
+
+    /* TODO: Win32 */
+#if defined(nginx_version) \
+    && ((nginx_version < 7066) \
+        || ((nginx_version > 8000) && (nginx_version < 8038)))
+    if (r->zero_in_uri) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_DECLINED;
+    }
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (!alcf->enable) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_fancyindex_module);
+
+    rc = make_content_buf(r, ctx, alcf);
+
+    if (rc == NGX_DONE) {
+        /* Continues in ngx_http_fancyindex_scan_done() or lock_done() */
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    if (rc != NGX_OK)
+        return rc;
+
+    return ngx_http_fancyindex_send(r, ctx, alcf);
+}
+
+
+/**
+ * Sends a compressed variant of a listing, which holds the complete page.
+ */
+static ngx_int_t
+ngx_http_fancyindex_send_encoded(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx)
+{
+    static ngx_str_t  encodings[] = {
+        ngx_null_string, ngx_string("gzip"), ngx_string("br")
+    };
+
+    ngx_int_t         rc;
+    ngx_chain_t       out;
+    ngx_table_elt_t  *h;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "Content-Encoding");
+    h->value = encodings[ctx->encoding];
+    r->headers_out.content_encoding = h;
+
+#if defined(nginx_version) && (nginx_version >= 1007003)
+    /* The entity tag is for the uncompressed listing. */
+    ngx_http_weak_etag(r);
+#endif
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ngx_buf_size(ctx->content);
+    r->headers_out.content_type =
+        ngx_http_fancyindex_formats[ctx->format].content_type;
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc != NGX_OK || r->header_only)
+        return rc;
+
+    ctx->content->last_in_chain = 1;
+    ctx->content->last_buf = 1;
+
+    out.buf  = ctx->content;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/**
+ * Sends the static viewer page, which renders the listing in the browser
+ * from its plain text format. The page is the same for every directory,
+ * but not from one build of the module to the next: its entity tag is the
+ * CRC32 of the page, which the not modified filter checks, and when asked
+ * for explicitly, with "?F=js", it may be cached for an hour.
+ */
+static ngx_int_t
+ngx_http_fancyindex_send_viewer(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_int_t                  rc;
+    ngx_uint_t                 i;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out[3];
+    ngx_table_elt_t           *h;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    static uint32_t   crc;
+    static ngx_str_t  parts[] = {
+        { ngx_sizeof_ssz(t01_head1), (u_char *) t01_head1 },
+        { ngx_sizeof_ssz(t09_viewer), (u_char *) t09_viewer },
+        { ngx_sizeof_ssz(t08_foot1), (u_char *) t08_foot1 },
+    };
+
+    if (crc == 0) {
+        ngx_crc32_init(crc);
+        for (i = 0; i < 3; i++)
+            ngx_crc32_update(&crc, parts[i].data, parts[i].len);
+        ngx_crc32_final(crc);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = parts[0].len + parts[1].len
+                                      + parts[2].len;
+    ngx_str_set(&r->headers_out.content_type, "text/html");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    if (!ctx->vary_accept) {
+        if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+        h->next = NULL;
+#endif
+        ngx_str_set(&h->key, "Cache-Control");
+        ngx_str_set(&h->value, "max-age=3600");
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->etag) {
+        if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+        h->next = NULL;
+#endif
+        ngx_str_set(&h->key, "ETag");
+
+        if ((h->value.data = ngx_pnalloc(r->pool, 2 + 8)) == NULL) {
+            h->hash = 0;
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        h->value.len = ngx_sprintf(h->value.data, "\"%08xD\"", crc)
+                       - h->value.data;
+
+        r->headers_out.etag = h;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc != NGX_OK || r->header_only)
+        return rc;
+
+    for (i = 0; i < 3; i++) {
+        if ((b = ngx_calloc_buf(r->pool)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        b->memory = 1;
+        b->start = b->pos = parts[i].data;
+        b->end = b->last = parts[i].data + parts[i].len;
+
+        out[i].buf = b;
+        out[i].next = (i < 2) ? &out[i + 1] : NULL;
+    }
+
+    b->last_in_chain = 1;
+    b->last_buf = 1;
+
+    return ngx_http_output_filter(r, &out[0]);
+}
+
+
+/**
+ * Sends the response once the listing is in ctx->content.
+ */
+static ngx_int_t
+ngx_http_fancyindex_send(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_request_t *sr;
+    ngx_str_t          *sr_uri;
+    ngx_str_t           rel_uri;
+    ngx_int_t           rc;
+    ngx_chain_t        *first, *cl;
+    ngx_chain_t         header = { NULL, NULL };
+    ngx_chain_t         out[2] = { { NULL, NULL }, { NULL, NULL } };
+
+    if ((ctx->vary || ctx->vary_accept)
+        && ngx_http_fancyindex_vary(r, ctx) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ctx->not_modified) {
+        r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+        r->header_only = 1;
+        return ngx_http_send_header(r);
+    }
+
+    if (ctx->format == NGX_HTTP_FANCYINDEX_FORMAT_JS)
+        return ngx_http_fancyindex_send_viewer(r, ctx);
+
+    if (ctx->encoding != NGX_HTTP_FANCYINDEX_IDENTITY)
+        return ngx_http_fancyindex_send_encoded(r, ctx);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type =
+        ngx_http_fancyindex_formats[ctx->format].content_type;
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    /* Listings sent as a single buffer have a known length. */
+    if (ctx->content && ctx->format != NGX_HTTP_FANCYINDEX_FORMAT_HTML
+        && !ctx->stream)
+    {
+        r->headers_out.content_length_n = ngx_buf_size(ctx->content);
+    }
+
+    rc = ngx_http_send_header(r);
+
+    /* Requests for headers only may have no listing at all. */
+    if (rc != NGX_OK || r->header_only)
+        return rc;
+
+    out[0].buf = ctx->content;
+    out[0].buf->last_in_chain = 1;
+    first = &out[0];
+
+    /* Only HTML pages have a header and a footer. */
+    if (ctx->format != NGX_HTTP_FANCYINDEX_FORMAT_HTML) {
+        if (ngx_buf_size(out[0].buf) == 0) {
+            /* Plain text listings have no head, and may have no rows. */
+            if (!ctx->stream)
+                return ngx_http_send_special(r, NGX_HTTP_LAST);
+
+            goto stream_rows;
+        }
+
+        if (!ctx->stream) {
+            out[0].buf->last_buf = 1;
+            return ngx_http_output_filter(r, &out[0]);
+        }
+
+        goto send_rows;
+    }
+
+    if (alcf->header && alcf->header->local) {
+        rc = ngx_http_fancyindex_local_file(r, alcf->header, &header.buf);
+        if (rc == NGX_ERROR)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        if (rc == NGX_DECLINED)
+            goto add_builtin_header;
+
+        if (header.buf) {
+            header.next = &out[0];
+            first = &header;
+        }
+    }
+    else if (alcf->header) {
+        /* URI is configured, make Nginx take care of with a subrequest. */
+        sr_uri = &alcf->header->path;
+
+        if (*sr_uri->data != '/') {
+            /* Relative path */
+            rel_uri.len  = r->uri.len + sr_uri->len;
+            rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
+            if (rel_uri.data == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
+                    sr_uri->data, sr_uri->len);
+            sr_uri = &rel_uri;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: header subrequest \"%V\"", sr_uri);
+
+        rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
+        if (rc == NGX_ERROR || rc == NGX_DONE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "http fancyindex: header subrequest for \"%V\" failed", sr_uri);
+            return rc;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: header subrequest status = %i",
+                sr->headers_out.status);
+        /* ngx_http_subrequest returns NGX_OK(0), not NGX_HTTP_OK(200) */
+        if (sr->headers_out.status != NGX_OK) {
+            /*
+             * XXX: Should we write a message to the error log just in case
+             * we get something different from a 404?
+             */
+            goto add_builtin_header;
+        }
+    }
+    else {
+add_builtin_header:
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: adding built-in header");
+        /* Chain header buffers before the table */
+        if ((first = make_header_chain(r, alcf)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        for (cl = first; cl->next; cl = cl->next)
+            /* void */ ;
+        cl->next = &out[0];
+    }
+
+    /* Unless the footer needs a subrequest, chain up footer buffer. */
+    if ((alcf->footer == NULL || alcf->footer->local) && !ctx->stream) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: adding footer buffer");
+
+        if (ngx_http_fancyindex_footer_buf(r, alcf, &out[1].buf) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        if (out[1].buf) {
+            out[0].next = &out[1];
+
+            out[0].buf->last_in_chain = 0;
+            out[1].buf->last_in_chain = 1;
+            out[1].buf->last_buf      = 1;
+        } else {
+            out[0].buf->last_buf      = 1;
+        }
+
+        /* Send everything with a single call :D */
+        return ngx_http_output_filter(r, first);
+    }
+
+    /*
+     * If we reach here, we were asked to send a custom footer, or the
+     * table rows are streamed. We need to: partially send whatever is
+     * referenced from first, then the rows, and then send the footer as
+     * a subrequest. If the subrequest fails, we should send the standard
+     * footer as well.
+     */
+send_rows:
+    rc = ngx_http_output_filter(r, first);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+stream_rows:
+    if (ctx->stream) {
+        rc = ngx_http_fancyindex_stream(r, ctx, alcf);
+
+        if (rc == NGX_ERROR)
+            return NGX_ERROR;
+
+        if (rc == NGX_AGAIN) {
+            /* Continue from the write event handler. */
+            if (ngx_http_fancyindex_stream_wait(r) != NGX_OK)
+                return NGX_ERROR;
+
+            r->main->count++;
+            return NGX_DONE;
+        }
+    }
+
+    return ngx_http_fancyindex_send_footer(r, ctx, alcf);
+}
+
+
+/**
+ * Compares names through their collation keys, if any.
+ */
+static int
+ngx_http_fancyindex_cmp_names(ngx_http_fancyindex_entry_t *first,
+    ngx_http_fancyindex_entry_t *second)
+{
+    ngx_int_t  rc;
+
+    if (first->key.data && second->key.data) {
+        rc = ngx_memn2cmp(first->key.data, second->key.data,
+                          first->key.len, second->key.len);
+        if (rc != 0)
+            return (int) rc;
+    }
+
+    return (int) ngx_strcmp(first->name.data, second->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_names(second, first);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_size_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    int                          rc;
+
+    rc = (second->size > first->size) - (second->size < first->size);
+
+    return rc ? rc : ngx_http_fancyindex_cmp_names(second, first);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_mtime_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    int                          rc;
+
+    rc = (second->mtime > first->mtime) - (second->mtime < first->mtime);
+
+    return rc ? rc : ngx_http_fancyindex_cmp_names(second, first);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return ngx_http_fancyindex_cmp_names(first, second);
+}
+
+
+/**
+ * Orders entries by the bytes of their names, whatever the collation.
+ */
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_bytes(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcmp(first->name.data, second->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    int                          rc;
+
+    rc = (first->size > second->size) - (first->size < second->size);
+
+    return rc ? rc : ngx_http_fancyindex_cmp_names(first, second);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    int                          rc;
+
+    rc = (first->mtime > second->mtime) - (first->mtime < second->mtime);
+
+    return rc ? rc : ngx_http_fancyindex_cmp_names(first, second);
+}
+
+
+#if !(NGX_LINUX)
+static ngx_int_t
+ngx_http_fancyindex_error(ngx_log_t *log, ngx_dir_t *dir, ngx_str_t *name)
+{
+    if (ngx_close_dir(dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", name);
+    }
+
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+#endif /* !NGX_LINUX */
+
+
+static void *
+ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_fancyindex_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_loc_conf_t));
+    if (conf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * Set by ngx_pcalloc:
+     *    conf->css_href.len     = 0
+     *    conf->css_href.data    = NULL
+     *    conf->time_format.len  = 0
+     *    conf->time_format.data = NULL
+     *    conf->stream_bufs.num  = 0
+     */
+    conf->enable        = NGX_CONF_UNSET;
+    conf->header        = NGX_CONF_UNSET_PTR;
+    conf->footer        = NGX_CONF_UNSET_PTR;
+    conf->default_sort  = NGX_CONF_UNSET_UINT;
+    conf->localtime     = NGX_CONF_UNSET;
+    conf->name_length   = NGX_CONF_UNSET_UINT;
+    conf->exact_size    = NGX_CONF_UNSET;
+    conf->size_units    = NGX_CONF_UNSET_UINT;
+    conf->ignore        = NGX_CONF_UNSET_PTR;
+    conf->hide_symlinks = NGX_CONF_UNSET;
+    conf->directories_first = NGX_CONF_UNSET;
+    conf->stream        = NGX_CONF_UNSET;
+    conf->aio           = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    conf->thread_pool   = NGX_CONF_UNSET_PTR;
+#endif
+    conf->cache         = NGX_CONF_UNSET_PTR;
+    conf->collation     = NGX_CONF_UNSET_UINT;
+    conf->cache_path    = NGX_CONF_UNSET_PTR;
+    conf->compress      = NGX_CONF_UNSET_UINT;
+    conf->compress_level = NGX_CONF_UNSET_UINT;
+    conf->cache_watch   = NGX_CONF_UNSET;
+    conf->cache_lock    = NGX_CONF_UNSET;
+    conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->cache_use_stale = NGX_CONF_UNSET_UINT;
+    conf->cache_errors  = NGX_CONF_UNSET;
+    conf->format        = NGX_CONF_UNSET_UINT;
+    conf->page_size     = NGX_CONF_UNSET_UINT;
+    conf->recursive_depth = NGX_CONF_UNSET_UINT;
+    conf->recursive_max = NGX_CONF_UNSET_UINT;
+    conf->max_entries = NGX_CONF_UNSET_UINT;
+    conf->max_entries_top = NGX_CONF_UNSET;
+    conf->max_scan_time = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+/**
+ * Records that the listings of the zone of a location are kept under its
+ * cache path, which tells at startup whether files there may be in use.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_path_use(ngx_conf_t *cf,
+    ngx_http_fancyindex_loc_conf_t *conf)
+{
+    ngx_uint_t                        i;
+    ngx_http_fancyindex_cache_use_t  *use;
+    ngx_http_fancyindex_main_conf_t  *amcf;
+
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (amcf->cache_paths == NULL) {
+        amcf->cache_paths = ngx_array_create(cf->pool, 2,
+                                sizeof(ngx_http_fancyindex_cache_use_t));
+        if (amcf->cache_paths == NULL)
+            return NGX_ERROR;
+    }
+
+    use = amcf->cache_paths->elts;
+    for (i = 0; i < amcf->cache_paths->nelts; i++) {
+        if (use[i].cp == conf->cache_path && use[i].zone == conf->cache)
+            return NGX_OK;
+    }
+
+    if ((use = ngx_array_push(amcf->cache_paths)) == NULL)
+        return NGX_ERROR;
+
+    use->cp = conf->cache_path;
+    use->zone = conf->cache;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_fancyindex_crc32_str(uint32_t *crc, ngx_str_t *s)
+{
+    ngx_crc32_update(crc, (u_char *) &s->len, sizeof(size_t));
+    ngx_crc32_update(crc, s->data, s->len);
+}
+
+
+/**
+ * Identifies the listings rendered with a merged configuration, with a
+ * CRC32 of the settings which change them. Locations rendering listings
+ * the same way share it, and it stays the same across reloads and
+ * restarts, so neither validators nor cached listings are lost as long as
+ * the settings do not change. Cache keys tell apart the locations anyway,
+ * as they include the URI and the path.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_generation(ngx_http_fancyindex_loc_conf_t *conf)
+{
+    uint32_t     crc;
+    ngx_str_t    s;
+    ngx_uint_t   i, v[12];
+#if (NGX_PCRE)
+    ngx_regex_elt_t  *re;
+#else
+    ngx_str_t        *re;
+#endif
+
+    v[0]  = conf->default_sort;
+    v[1]  = conf->collation;
+    v[2]  = conf->localtime;
+    v[3]  = conf->exact_size;
+    v[4]  = conf->size_units;
+    v[5]  = conf->name_length;
+    v[6]  = conf->hide_symlinks;
+    v[7]  = conf->directories_first;
+    v[8]  = conf->max_entries;
+    v[9]  = conf->max_entries_top;
+    v[10] = conf->header ? conf->header->local + 1 : 0;
+    v[11] = conf->footer ? conf->footer->local + 1 : 0;
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, (u_char *) v, sizeof(v));
+
+    ngx_http_fancyindex_crc32_str(&crc, &conf->css_href);
+    ngx_http_fancyindex_crc32_str(&crc, &conf->time_format);
+
+    if (conf->header)
+        ngx_http_fancyindex_crc32_str(&crc, &conf->header->path);
+
+    if (conf->footer)
+        ngx_http_fancyindex_crc32_str(&crc, &conf->footer->path);
+
+    if (conf->ignore) {
+        re = conf->ignore->elts;
+        for (i = 0; i < conf->ignore->nelts; i++) {
+#if (NGX_PCRE)
+            s.data = re[i].name;
+            s.len = ngx_strlen(re[i].name);
+#else
+            s = re[i];
+#endif
+            ngx_http_fancyindex_crc32_str(&crc, &s);
+        }
+    }
+
+    ngx_crc32_final(crc);
+
+    /* Slots of formatted timestamps with generation zero are empty. */
+    return crc ? crc : 1;
+}
+
+
+static char *
+ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_fancyindex_loc_conf_t *prev = parent;
+    ngx_http_fancyindex_loc_conf_t *conf = child;
+    u_char                         *p;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_uint_value(conf->default_sort, prev->default_sort, NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME);
+    ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
+    ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
+    ngx_conf_merge_uint_value(conf->size_units, prev->size_units,
+                              NGX_HTTP_FANCYINDEX_UNITS_IEC);
+    ngx_conf_merge_uint_value(conf->name_length, prev->name_length, 50);
+
+    ngx_conf_merge_ptr_value(conf->header, prev->header, NULL);
+    ngx_conf_merge_ptr_value(conf->footer, prev->footer, NULL);
+    ngx_conf_merge_str_value(conf->css_href, prev->css_href, "");
+    ngx_conf_merge_str_value(conf->time_format, prev->time_format, "%Y-%b-%d %H:%M");
+
+    conf->time_ops = ngx_fancyindex_timefmt_compile(cf->pool,
+                                                    &conf->time_format,
+                                                    &conf->date_len,
+                                                    &conf->date_resolution,
+                                                    &conf->date_fixed);
+    if (conf->time_ops == NULL)
+        return NGX_CONF_ERROR;
 
     /*
-     * Determine the sorting criteria. URL arguments look like:
-     *
-     *    C=x[&O=y]
-     *
-     * Where x={M,S,N} and y={A,D}
+     * The beginning of the built-in header only depends on the stylesheet,
+     * so it is put together once and shared by all requests.
      */
-    if ((r->args.len == 3 || (r->args.len == 7 && r->args.data[3] == '&')) &&
-        r->args.data[0] == 'C' && r->args.data[1] == '=')
+    conf->head.len = ngx_sizeof_ssz(t01_head1) + ngx_sizeof_ssz(t02_head2);
+    if (conf->css_href.len) {
+        conf->head.len += css_href_pre.len + conf->css_href.len
+                          + css_href_post.len;
+    }
+
+    if ((conf->head.data = ngx_pnalloc(cf->pool, conf->head.len)) == NULL)
+        return NGX_CONF_ERROR;
+
+    p = ngx_cpymem_ssz(conf->head.data, t01_head1);
+    if (conf->css_href.len) {
+        p = ngx_cpymem_str(p, css_href_pre);
+        p = ngx_cpymem_str(p, conf->css_href);
+        p = ngx_cpymem_str(p, css_href_post);
+    }
+    ngx_memcpy(p, t02_head2, ngx_sizeof_ssz(t02_head2));
+
+    ngx_conf_merge_ptr_value(conf->ignore, prev->ignore, NULL);
+
+    if (conf->ignore) {
+        if (conf->ignore == prev->ignore && prev->ignore_matcher) {
+            conf->ignore_matcher = prev->ignore_matcher;
+
+        } else if (ngx_http_fancyindex_ignore_compile(cf, conf)
+                   != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+    ngx_conf_merge_value(conf->hide_symlinks, prev->hide_symlinks, 0);
+    ngx_conf_merge_value(conf->directories_first, prev->directories_first, 0);
+    ngx_conf_merge_value(conf->stream, prev->stream, 0);
+    ngx_conf_merge_bufs_value(conf->stream_bufs, prev->stream_bufs,
+                              4, 32 * 1024);
+    ngx_conf_merge_value(conf->aio, prev->aio, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_uint_value(conf->collation, prev->collation,
+                              NGX_HTTP_FANCYINDEX_COLLATION_BYTES);
+    ngx_conf_merge_ptr_value(conf->cache_path, prev->cache_path, NULL);
+
+    if (conf->cache && conf->cache_path
+        && ngx_http_fancyindex_cache_path_use(cf, conf) != NGX_OK)
     {
-        /* Determine whether the direction of the sorting */
-        ngx_int_t sort_descending = r->args.len == 7
-                                 && r->args.data[4] == 'O'
-                                 && r->args.data[5] == '='
-                                 && r->args.data[6] == 'D';
+        return NGX_CONF_ERROR;
+    }
 
-        /* Pick the sorting criteria */
-        switch (r->args.data[2]) {
-            case 'M': /* Sort by mtime */
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC)
-                        sort_url_args = "?C=M&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE)
-                        sort_url_args = "?C=M&amp;O=A";
-                }
-                break;
-            case 'S': /* Sort by size */
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC)
-                        sort_url_args = "?C=S&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
-                        if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE)
-                    sort_url_args = "?C=S&amp;O=A";
+    ngx_conf_merge_uint_value(conf->compress, prev->compress, 0);
+    ngx_conf_merge_uint_value(conf->compress_level, prev->compress_level, 6);
+    ngx_conf_merge_value(conf->cache_watch, prev->cache_watch, 0);
+    ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout,
+                              prev->cache_lock_timeout, 5000);
+    ngx_conf_merge_uint_value(conf->cache_use_stale, prev->cache_use_stale,
+                              NGX_HTTP_FANCYINDEX_STALE_OFF);
+    ngx_conf_merge_sec_value(conf->cache_errors, prev->cache_errors, 0);
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              NGX_HTTP_FANCYINDEX_FORMAT_HTML);
+    ngx_conf_merge_uint_value(conf->page_size, prev->page_size, 0);
+    ngx_conf_merge_uint_value(conf->recursive_depth, prev->recursive_depth, 0);
+    ngx_conf_merge_uint_value(conf->recursive_max, prev->recursive_max,
+                              NGX_HTTP_FANCYINDEX_RECURSIVE_MAX);
+    ngx_conf_merge_uint_value(conf->max_entries, prev->max_entries, 0);
+    ngx_conf_merge_value(conf->max_entries_top, prev->max_entries_top, 0);
+    ngx_conf_merge_msec_value(conf->max_scan_time, prev->max_scan_time, 0);
+
+    conf->generation = ngx_http_fancyindex_generation(conf);
+
+    return NGX_CONF_OK;
+}
+
+
+static char*
+ngx_http_fancyindex_ignore(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value;
+
+    (void) cmd; /* unused */
+
+#if (NGX_PCRE)
+    ngx_uint_t          i;
+    ngx_regex_elt_t    *re;
+    ngx_regex_compile_t rc;
+    u_char              errstr[NGX_MAX_CONF_ERRSTR];
+
+    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
+        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
+        if (alcf->ignore == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.err.data = errstr;
+    rc.err.len  = NGX_MAX_CONF_ERRSTR;
+    rc.pool     = cf->pool;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        re = ngx_array_push(alcf->ignore);
+        if (re == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rc.pattern = value[i];
+        rc.options = NGX_REGEX_CASELESS;
+
+        if (ngx_regex_compile(&rc) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+            return NGX_CONF_ERROR;
+        }
+
+        re->name  = value[i].data;
+        re->regex = rc.regex;
+    }
+
+    return NGX_CONF_OK;
+#else /* !NGX_PCRE */
+    ngx_uint_t i;
+    ngx_str_t *str;
+
+    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
+        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
+        if (alcf->ignore == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        str = ngx_array_push(alcf->ignore);
+        if (str == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        str->data = value[i].data;
+        str->len  = value[i].len;
+    }
+
+    return NGX_CONF_OK;
+#endif /* NGX_PCRE */
+
+}
+
+
+static char*
+ngx_http_fancyindex_aio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value;
+#if (NGX_THREADS)
+    ngx_str_t                       name;
+#endif
+
+    (void) cmd; /* unused */
+
+    if (alcf->aio != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->aio = 0;
+#if (NGX_THREADS)
+        alcf->thread_pool = NULL;
+#endif
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) == 0
+        && (value[1].len == 7 || value[1].data[7] == '='))
+    {
+#if (NGX_THREADS)
+        alcf->aio = 1;
+
+        if (value[1].len > 8) {
+            name.len  = value[1].len - 8;
+            name.data = value[1].data + 8;
+            alcf->thread_pool = ngx_thread_pool_add(cf, &name);
+        } else {
+            alcf->thread_pool = ngx_thread_pool_add(cf, NULL);
+        }
+
+        if (alcf->thread_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_aio threads\" "
+                           "is unsupported on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+}
+
+
+static char*
+ngx_http_fancyindex_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_http_fancyindex_cache_t    *cache;
+    ngx_str_t                      *value, name, s;
+    ssize_t                         size;
+    u_char                         *p;
+
+    (void) cmd; /* unused */
+
+    if (alcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * Either "zone=name:size" to declare the zone, or "zone=name" to use
+     * a zone declared elsewhere.
+     */
+    name.data = value[1].data + 5;
+    size = 0;
+
+    if ((p = (u_char *) ngx_strchr(name.data, ':')) != NULL) {
+        name.len = p - name.data;
+
+        s.data = p + 1;
+        s.len  = value[1].data + value[1].len - s.data;
+
+        size = ngx_parse_size(&s);
+
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid zone size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is too small", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    } else {
+        name.len = value[1].data + value[1].len - name.data;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    alcf->cache = ngx_shared_memory_add(cf, &name, size,
+                                        &ngx_http_fancyindex_module);
+    if (alcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (alcf->cache->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        alcf->cache->init = ngx_http_fancyindex_cache_init_zone;
+        alcf->cache->data = cache;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_fancyindex_cache_path(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t   *alcf = conf;
+    ngx_http_fancyindex_cache_path_t *cp;
+    ngx_path_t                       *path;
+    ngx_str_t                        *value, s;
+    ngx_uint_t                        i, n;
+    ssize_t                           size;
+    u_char                           *p, *last;
+
+    (void) cmd; /* unused */
+
+    if (alcf->cache_path != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        alcf->cache_path = NULL;
+        return NGX_CONF_OK;
+    }
+
+    cp = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_cache_path_t));
+    if (cp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if ((path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t))) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    path->name = value[1];
+
+    if (path->name.len > 1 && path->name.data[path->name.len - 1] == '/') {
+        path->name.len--;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &path->name, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    path->conf_file = cf->conf_file->file.name.data;
+    path->line = cf->conf_file->line;
+
+    cp->path = path;
+    cp->min_size = NGX_HTTP_FANCYINDEX_CACHE_FILE_MIN;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        /* Like in proxy_cache_path, "levels=1:2" and such. */
+        if (ngx_strncmp(value[i].data, "levels=", 7) == 0) {
+            p = value[i].data + 7;
+            last = value[i].data + value[i].len;
+
+            for (n = 0; n < NGX_MAX_PATH_LEVEL && p < last; n++) {
+                if (*p != '1' && *p != '2') {
+                    goto invalid;
                 }
-                break;
-            case 'N': /* Sort by name */
-            default:
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_name_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC)
-                        sort_url_args = "?C=N&amp;O=D";
+
+                path->level[n] = *p++ - '0';
+                path->len += path->level[n] + 1;
+
+                if (p == last) {
+                    break;
                 }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_name_asc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME)
-                        sort_url_args = "?C=N&amp;O=A";
+
+                if (*p++ != ':' || n == NGX_MAX_PATH_LEVEL - 1 || p == last) {
+                    goto invalid;
                 }
-                break;
+            }
+
+            continue;
         }
-    }
-    else {
-        switch (alcf->default_sort) {
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_name_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME:
-            default:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_name_asc;
-                break;
+
+        if (ngx_strncmp(value[i].data, "min_size=", 9) == 0) {
+            s.data = value[i].data + 9;
+            s.len  = value[i].len - 9;
+
+            if ((size = ngx_parse_size(&s)) == NGX_ERROR) {
+                goto invalid;
+            }
+
+            cp->min_size = size;
+            continue;
         }
+
+        goto invalid;
     }
 
-    /* Sort entries, if needed */
-    if (entries.nelts > 1) {
-        ngx_qsort(entry, (size_t) entries.nelts,
-                  sizeof(ngx_http_fancyindex_entry_t),
-                  sort_cmp_func);
+    if (ngx_add_path(cf, &cp->path) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
-    b->last = ngx_cpymem_str(b->last, r->uri);
-    b->last = ngx_cpymem_ssz(b->last, t05_body2);
-    b->last = ngx_cpymem_ssz(b->last, t06_list1);
+    alcf->cache_path = cp;
 
-    tp = ngx_timeofday();
+    return NGX_CONF_OK;
 
-    /* "Parent dir" entry, always first if displayed */
-    if (r->uri.len > 1) {
-        b->last = ngx_cpymem_ssz(b->last,
-                                 "<tr>"
-                                 "<td><a href=\"../");
-        if (*sort_url_args) {
-            b->last = ngx_cpymem(b->last,
-                                 sort_url_args,
-                                 ngx_sizeof_ssz("?C=N&amp;O=A"));
-        }
-        b->last = ngx_cpymem_ssz(b->last,
-                                 "\">Parent directory/</a></td>"
-                                 "<td>-</td>"
-                                 "<td>-</td>"
-                                 "</tr>");
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+/**
+ * Parses fancyindex_header and fancyindex_footer. Locations which inherit
+ * them share the include, and thus the contents of local files.
+ */
+static char*
+ngx_http_fancyindex_include(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_include_t **include, *inc;
+    ngx_str_t                      *value;
+
+    include = (ngx_http_fancyindex_include_t **) ((char *) conf + cmd->offset);
+
+    if (*include != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    /* Entries for directories and files */
-    for (i = 0; i < entries.nelts; i++) {
-        b->last = ngx_cpymem_ssz(b->last, "<tr><td><a href=\"");
+    value = cf->args->elts;
 
-        if (entry[i].escape) {
-            ngx_fancyindex_escape_uri(b->last,
-                                      entry[i].name.data,
-                                      entry[i].name.len);
+    /* An empty path stands for the built-in one, as it always did. */
+    if (value[1].len == 0) {
+        *include = NULL;
+        return NGX_CONF_OK;
+    }
 
-            b->last += entry[i].name.len + entry[i].escape;
+    inc = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_include_t));
+    if (inc == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-        } else {
-            b->last = ngx_cpymem_str(b->last, entry[i].name);
-        }
+    inc->path = value[1];
 
-        if (entry[i].dir) {
-            *b->last++ = '/';
-            if (*sort_url_args) {
-                b->last = ngx_cpymem(b->last,
-                                     sort_url_args,
-                                     ngx_sizeof_ssz("?C=x&amp;O=y"));
+    if (cf->args->nelts == 3) {
+        if (ngx_strcmp(value[2].data, "local") == 0) {
+            inc->local = 1;
+
+            if (ngx_conf_full_name(cf->cycle, &inc->path, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
             }
+
+        } else if (ngx_strcmp(value[2].data, "subrequest") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
         }
+    }
+
+    *include = inc;
+
+    return NGX_CONF_OK;
+}
 
-        *b->last++ = '"';
-        *b->last++ = '>';
 
-        len = entry[i].utf_len;
+static char*
+ngx_http_fancyindex_cache_compress(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value;
+    ngx_uint_t                      i;
 
-        if (entry[i].name.len - len) {
-            if (len > alcf->name_length) {
-                copy = alcf->name_length - 3 + 1;
-            } else {
-                copy = alcf->name_length + 1;
-            }
+    (void) cmd; /* unused */
 
-            b->last = ngx_utf8_cpystrn(b->last, entry[i].name.data,
-                                          copy, entry[i].name.len);
-            last = b->last;
+    if (alcf->compress != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
 
-        } else {
-            b->last = ngx_cpystrn(b->last, entry[i].name.data,
-                                  alcf->name_length + 1);
-            last = b->last - 3;
-        }
+    value = cf->args->elts;
+    alcf->compress = 0;
 
-        if (len > alcf->name_length) {
-            b->last = ngx_cpymem_ssz(last, "..&gt;</a></td><td>");
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
 
-        } else {
-            if (entry[i].dir && alcf->name_length - len > 0) {
-                *b->last++ = '/';
-                len++;
-            }
+    for (i = 1; i < cf->args->nelts; i++) {
+#if (NGX_HTTP_GZIP && NGX_ZLIB)
+        if (ngx_strcmp(value[i].data, "gzip") == 0) {
+            alcf->compress |= 1 << NGX_HTTP_FANCYINDEX_GZIP;
+            continue;
+        }
+#endif
 
-            b->last = ngx_cpymem_ssz(b->last, "</a></td><td>");
+#if (NGX_HTTP_GZIP && NGX_HAVE_BROTLI)
+        if (ngx_strcmp(value[i].data, "br") == 0) {
+            alcf->compress |= 1 << NGX_HTTP_FANCYINDEX_BROTLI;
+            continue;
         }
+#endif
 
-        if (alcf->exact_size) {
-            if (entry[i].dir) {
-                *b->last++ = '-';
-            } else {
-                b->last = ngx_sprintf(b->last, "%19O", entry[i].size);
-            }
+        if (ngx_strcmp(value[i].data, "gzip") == 0
+            || ngx_strcmp(value[i].data, "br") == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"%V\" compression is not supported "
+                               "by this build", &value[i]);
+            return NGX_CONF_ERROR;
+        }
 
-        } else {
-            if (entry[i].dir) {
-                *b->last++ = '-';
-            } else {
-                length = entry[i].size;
-
-                if (length > 1024 * 1024 * 1024 - 1) {
-                    size = (ngx_int_t) (length / (1024 * 1024 * 1024));
-                    if ((length % (1024 * 1024 * 1024))
-                                                > (1024 * 1024 * 1024 / 2 - 1))
-                    {
-                        size++;
-                    }
-                    scale = 'G';
-
-                } else if (length > 1024 * 1024 - 1) {
-                    size = (ngx_int_t) (length / (1024 * 1024));
-                    if ((length % (1024 * 1024)) > (1024 * 1024 / 2 - 1)) {
-                        size++;
-                    }
-                    scale = 'M';
-
-                } else if (length > 9999) {
-                    size = (ngx_int_t) (length / 1024);
-                    if (length % 1024 > 511) {
-                        size++;
-                    }
-                    scale = 'K';
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
 
-                } else {
-                    size = (ngx_int_t) length;
-                    scale = '\0';
-                }
+    return NGX_CONF_OK;
+}
 
-                if (scale) {
-                    b->last = ngx_sprintf(b->last, "%6i%c", size, scale);
 
-                } else {
-                    b->last = ngx_sprintf(b->last, " %6i", size);
-                }
+static char*
+ngx_http_fancyindex_recursive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+    ngx_uint_t                      i;
+
+    (void) cmd; /* unused */
+
+    if (alcf->recursive_depth != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        alcf->recursive_depth = 0;
+        return NGX_CONF_OK;
+    }
+
+    i = 1;
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+        goto invalid;
+    }
+
+    alcf->recursive_depth = NGX_HTTP_FANCYINDEX_RECURSIVE_DEPTH;
+    alcf->recursive_max = NGX_HTTP_FANCYINDEX_RECURSIVE_MAX;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "depth=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
             }
+
+            alcf->recursive_depth = n;
+            continue;
         }
 
-        ngx_gmtime(entry[i].mtime + tp->gmtoff * 60 * alcf->localtime, &tm);
-        b->last = ngx_cpymem_ssz(b->last, "</td><td>");
-        b->last = ngx_fancyindex_timefmt(b->last, &alcf->time_format, &tm);
-        b->last = ngx_cpymem_ssz(b->last, "</td></tr>");
+        if (ngx_strncmp(value[i].data, "max_entries=", 12) == 0) {
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            alcf->recursive_max = n;
+            continue;
+        }
 
-        *b->last++ = CR;
-        *b->last++ = LF;
+        goto invalid;
     }
 
-    /* Output table bottom */
-    b->last = ngx_cpymem_ssz(b->last, t07_list2);
+    return NGX_CONF_OK;
 
-    *pb = b;
-    return NGX_OK;
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
 }
 
 
+static char*
+ngx_http_fancyindex_max_entries(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+
+    (void) cmd; /* unused */
+
+    if (alcf->max_entries != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    alcf->max_entries_top = 0;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        alcf->max_entries = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of entries \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    alcf->max_entries = n;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strcmp(value[2].data, "top") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        alcf->max_entries_top = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
 
 static ngx_int_t
-ngx_http_fancyindex_handler(ngx_http_request_t *r)
+ngx_http_fancyindex_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_http_request_t             *sr;
-    ngx_str_t                      *sr_uri;
-    ngx_str_t                       rel_uri;
-    ngx_int_t                       rc;
-    ngx_http_fancyindex_loc_conf_t *alcf;
-    ngx_chain_t                     out[3] = {
-        { NULL, NULL }, { NULL, NULL}, { NULL, NULL }};
+    ngx_http_fancyindex_cache_t *ocache = data;
+    ngx_http_fancyindex_cache_t *cache = shm_zone->data;
 
+    /*
+     * Do not cache listings bigger than a quarter of the zone, they would
+     * evict most of the other entries.
+     */
+    cache->max_len = shm_zone->shm.size / 4;
 
-    if (r->uri.data[r->uri.len - 1] != '/') {
-        return NGX_DECLINED;
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
     }
 
-    /* TODO: Win32 */
-#if defined(nginx_version) \
-    && ((nginx_version < 7066) \
-        || ((nginx_version > 8000) && (nginx_version < 8038)))
-    if (r->zero_in_uri) {
-        return NGX_DECLINED;
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
     }
-#endif
 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-        return NGX_DECLINED;
+    cache->fresh = 1;
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_fancyindex_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
     }
 
-    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    cache->shpool->data = cache->sh;
 
-    if (!alcf->enable) {
-        return NGX_DECLINED;
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_fancyindex_cache_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+
+    /* Entries which were never watched have zero there. */
+    cache->sh->epoch = 1;
+
+#if defined(nginx_version) && (nginx_version >= 1005013)
+    /* Running out of memory is expected, entries are evicted then. */
+    cache->shpool->log_nomem = 0;
+#endif
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_fancyindex_cache_watch_check(ngx_conf_t *cf, void *post, void *data)
+{
+    (void) cf;   /* unused */
+    (void) post; /* unused */
+
+#if !(NGX_HAVE_INOTIFY)
+    if (*(ngx_flag_t *) data) {
+        return "is unsupported on this platform";
     }
+#else
+    (void) data; /* unused */
+#endif
 
-    if ((rc = make_content_buf(r, &out[0].buf, alcf) != NGX_OK))
-        return rc;
+    return NGX_CONF_OK;
+}
 
-    out[0].buf->last_in_chain = 1;
 
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/html");
-    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/html");
-    r->headers_out.content_type.data = (u_char *) "text/html";
+static ngx_int_t
+ngx_http_fancyindex_cache_status_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    static ngx_str_t  lookups[] = {
+        ngx_null_string, ngx_string("HIT"), ngx_string("MISS"),
+        ngx_string("BYPASS"), ngx_string("UPDATING")
+    };
 
-    rc = ngx_http_send_header(r);
+    ngx_http_fancyindex_ctx_t  *ctx;
 
-    if (rc != NGX_OK || r->header_only)
-        return rc;
+    (void) data; /* unused */
 
-    if (alcf->header.len > 0) {
-        /* URI is configured, make Nginx take care of with a subrequest. */
-        sr_uri = &alcf->header;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
 
-        if (*sr_uri->data != '/') {
-            /* Relative path */
-            rel_uri.len  = r->uri.len + alcf->header.len;
-            rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
-            if (rel_uri.data == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-            ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
-                    alcf->header.data, alcf->header.len);
-            sr_uri = &rel_uri;
-        }
+    if (ctx == NULL || ctx->stats.lookup == NGX_HTTP_FANCYINDEX_LOOKUP_NONE) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: header subrequest \"%V\"", sr_uri);
+    v->len = lookups[ctx->stats.lookup].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = lookups[ctx->stats.lookup].data;
 
-        rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
-        if (rc == NGX_ERROR || rc == NGX_DONE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "http fancyindex: header subrequest for \"%V\" failed", sr_uri);
-            return rc;
-        }
+    return NGX_OK;
+}
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: header subrequest status = %i",
-                sr->headers_out.status);
-        /* ngx_http_subrequest returns NGX_OK(0), not NGX_HTTP_OK(200) */
-        if (sr->headers_out.status != NGX_OK) {
-            /*
-             * XXX: Should we write a message to the error log just in case
-             * we get something different from a 404?
-             */
-            goto add_builtin_header;
-        }
+
+/**
+ * Why the listing was truncated, empty if it was not.
+ */
+static ngx_int_t
+ngx_http_fancyindex_truncated_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    static ngx_str_t  reasons[] = {
+        ngx_null_string, ngx_string("entries"), ngx_string("time"),
+        ngx_string("entries,time")
+    };
+
+    ngx_http_fancyindex_ctx_t  *ctx;
+
+    (void) data; /* unused */
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
-    else {
-add_builtin_header:
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: adding built-in header");
-        /* Make space before */
-        out[1].next = out[0].next;
-        out[1].buf  = out[0].buf;
-        /* Chain header buffer */
-        out[0].next = &out[1];
-        out[0].buf  = make_header_buf(r, alcf->css_href);
+
+    v->len = reasons[ctx->truncated].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = reasons[ctx->truncated].data;
+
+    return NGX_OK;
+}
+
+
+/**
+ * Counters of the listing, data is their offset in the statistics.
+ */
+static ngx_int_t
+ngx_http_fancyindex_count_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                     *p;
+    ngx_http_fancyindex_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    /* If footer is disabled, chain up footer buffer. */
-    if (alcf->footer.len == 0) {
-        ngx_uint_t last  = (alcf->header.len == 0) ? 2 : 1;
+    if ((p = ngx_pnalloc(r->pool, NGX_INT_T_LEN)) == NULL)
+        return NGX_ERROR;
+
+    v->len = ngx_sprintf(p, "%ui",
+                         *(ngx_uint_t *) ((u_char *) &ctx->stats + data))
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: adding built-in footer at %i", last);
 
-        out[last-1].next = &out[last];
-        out[last].buf    = make_footer_buf(r);
+/**
+ * Times of the listing, in seconds with millisecond resolution like
+ * $request_time; data is their offset in the statistics.
+ */
+static ngx_int_t
+ngx_http_fancyindex_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                     *p;
+    uint64_t                    usec;
+    ngx_http_fancyindex_ctx_t  *ctx;
 
-        out[last-1].buf->last_in_chain = 0;
-        out[last].buf->last_in_chain   = 1;
-        out[last].buf->last_buf        = 1;
-        /* Send everything with a single call :D */
-        return ngx_http_output_filter(r, &out[0]);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    /*
-     * If we reach here, we were asked to send a custom footer. We need to:
-     * partially send whatever is referenced from out[0] and then send the
-     * footer as a subrequest. If the subrequest fails, we should send the
-     * standard footer as well.
-     */
-    rc = ngx_http_output_filter(r, &out[0]);
+    if ((p = ngx_pnalloc(r->pool, NGX_INT64_LEN + 4)) == NULL)
+        return NGX_ERROR;
 
-    if (rc != NGX_OK && rc != NGX_AGAIN)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    usec = *(uint64_t *) ((u_char *) &ctx->stats + data);
 
-    /* URI is configured, make Nginx take care of with a subrequest. */
-    sr_uri = &alcf->footer;
+    v->len = ngx_sprintf(p, "%uL.%03uL", usec / 1000000,
+                         (usec / 1000) % 1000)
+             - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
-    if (*sr_uri->data != '/') {
-        /* Relative path */
-        rel_uri.len  = r->uri.len + alcf->footer.len;
-        rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
-        if (rel_uri.data == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
-                alcf->footer.data, alcf->footer.len);
-        sr_uri = &rel_uri;
-    }
+    return NGX_OK;
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "http fancyindex: footer subrequest \"%V\"", sr_uri);
 
-    rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
-    if (rc == NGX_ERROR || rc == NGX_DONE) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: footer subrequest for \"%V\" failed", sr_uri);
-        return rc;
-    }
+static ngx_http_variable_t  ngx_http_fancyindex_variables[] = {
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "http fancyindex: header subrequest status = %i",
-            sr->headers_out.status);
+    { ngx_string("fancyindex_cache_status"), NULL,
+      ngx_http_fancyindex_cache_status_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    /* see above: ngx_http_subrequest resturns NGX_OK (0) not NGX_HTTP_OK (200) */
-    if (sr->headers_out.status != NGX_OK) {
-        /*
-         * XXX: Should we write a message to the error log just in case
-         * we get something different from a 404?
-         */
-        out[0].next = NULL;
-        out[0].buf  = make_footer_buf(r);
-        out[0].buf->last_in_chain = 1;
-        out[0].buf->last_buf = 1;
-        /* Directly send out the builtin footer */
-        return ngx_http_output_filter(r, &out[0]);
-    }
+    { ngx_string("fancyindex_truncated"), NULL,
+      ngx_http_fancyindex_truncated_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    return (r != r->main) ? rc : ngx_http_send_special(r, NGX_HTTP_LAST);
-}
+    { ngx_string("fancyindex_entries_scanned"), NULL,
+      ngx_http_fancyindex_count_variable,
+      offsetof(ngx_http_fancyindex_stats_t, scanned),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("fancyindex_entries_filtered"), NULL,
+      ngx_http_fancyindex_count_variable,
+      offsetof(ngx_http_fancyindex_stats_t, filtered),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    { ngx_string("fancyindex_stat_calls"), NULL,
+      ngx_http_fancyindex_count_variable,
+      offsetof(ngx_http_fancyindex_stats_t, stat_calls),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    return (int) ngx_strcmp(second->name.data, first->name.data);
-}
+    { ngx_string("fancyindex_bytes_rendered"), NULL,
+      ngx_http_fancyindex_count_variable,
+      offsetof(ngx_http_fancyindex_stats_t, bytes),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("fancyindex_read_time"), NULL,
+      ngx_http_fancyindex_time_variable,
+      offsetof(ngx_http_fancyindex_stats_t, read_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_size_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    { ngx_string("fancyindex_sort_time"), NULL,
+      ngx_http_fancyindex_time_variable,
+      offsetof(ngx_http_fancyindex_stats_t, sort_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    return second->size - first->size;
-}
+    { ngx_string("fancyindex_render_time"), NULL,
+      ngx_http_fancyindex_time_variable,
+      offsetof(ngx_http_fancyindex_stats_t, render_time),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_mtime_desc(const void *one, const void *two)
+
+static ngx_int_t
+ngx_http_fancyindex_add_variables(ngx_conf_t *cf)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_fancyindex_variables; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
 
-    return second->mtime - first->mtime;
+    return NGX_OK;
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_asc(const void *one, const void *two)
+/*
+ * The zone of fancyindex_status has a fixed name, which is also used as
+ * its tag to tell it apart from cache zones.
+ */
+static ngx_str_t  ngx_http_fancyindex_status_zone =
+    ngx_string("fancyindex_status");
+
+
+static ngx_int_t
+ngx_http_fancyindex_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_fancyindex_status_sh_t *sh;
 
-    return (int) ngx_strcmp(first->name.data, second->name.data);
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_http_fancyindex_status_sh_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sh, sizeof(ngx_http_fancyindex_status_sh_t));
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two)
+/**
+ * Adds microseconds to a total in milliseconds. What is left below a
+ * millisecond is carried over by the worker, so that the many listings
+ * taking less than that still add up.
+ */
+static void
+ngx_http_fancyindex_add_time(ngx_atomic_t *total, uint64_t *carry,
+    uint64_t usec)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    usec += *carry;
+    *carry = usec % 1000;
 
-    return first->size - second->size;
+    if (usec >= 1000)
+        ngx_atomic_fetch_add(total, (ngx_atomic_int_t) (usec / 1000));
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two)
+/**
+ * Adds what a listing took to the totals, once the request is done.
+ */
+static ngx_int_t
+ngx_http_fancyindex_log_handler(ngx_http_request_t *r)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_http_fancyindex_ctx_t       *ctx;
+    ngx_http_fancyindex_stats_t     *st;
+    ngx_http_fancyindex_status_sh_t *sh;
+    ngx_http_fancyindex_main_conf_t *amcf;
+
+    static uint64_t  carry[3];
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    if (ctx == NULL)
+        return NGX_OK;
+
+    amcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+    sh = amcf->status->data;
+    st = &ctx->stats;
+
+    ngx_atomic_fetch_add(&sh->requests, 1);
+    ngx_atomic_fetch_add(&sh->lookups[st->lookup], 1);
+    ngx_atomic_fetch_add(&sh->scanned, st->scanned);
+    ngx_atomic_fetch_add(&sh->filtered, st->filtered);
+    ngx_atomic_fetch_add(&sh->stat_calls, st->stat_calls);
+    ngx_atomic_fetch_add(&sh->bytes, st->bytes);
+    ngx_http_fancyindex_add_time(&sh->read_time, &carry[0], st->read_time);
+    ngx_http_fancyindex_add_time(&sh->sort_time, &carry[1], st->sort_time);
+    ngx_http_fancyindex_add_time(&sh->render_time, &carry[2],
+                                 st->render_time);
 
-    return first->mtime - second->mtime;
+    return NGX_OK;
 }
 
 
+#define NGX_HTTP_FANCYINDEX_METRIC(name, help)                               \
+    "# HELP fancyindex_" name " " help "\n"                                  \
+    "# TYPE fancyindex_" name " counter\n"
+
+#define NGX_HTTP_FANCYINDEX_SECONDS(v)                                       \
+    (ngx_atomic_uint_t) ((v) / 1000), (ngx_atomic_uint_t) ((v) % 1000)
+
+static const char  ngx_http_fancyindex_metrics[] =
+    NGX_HTTP_FANCYINDEX_METRIC("requests_total",
+                               "Directory listings requested.")
+    "fancyindex_requests_total %uA\n"
+    NGX_HTTP_FANCYINDEX_METRIC("cache_lookups_total",
+                               "Listings looked up in cache zones.")
+    "fancyindex_cache_lookups_total{status=\"hit\"} %uA\n"
+    "fancyindex_cache_lookups_total{status=\"miss\"} %uA\n"
+    "fancyindex_cache_lookups_total{status=\"bypass\"} %uA\n"
+    "fancyindex_cache_lookups_total{status=\"updating\"} %uA\n"
+    NGX_HTTP_FANCYINDEX_METRIC("entries_scanned_total",
+                               "Directory entries read.")
+    "fancyindex_entries_scanned_total %uA\n"
+    NGX_HTTP_FANCYINDEX_METRIC("entries_filtered_total",
+                               "Directory entries ignored or hidden.")
+    "fancyindex_entries_filtered_total %uA\n"
+    NGX_HTTP_FANCYINDEX_METRIC("stat_calls_total",
+                               "Directory entries stat()ed.")
+    "fancyindex_stat_calls_total %uA\n"
+    NGX_HTTP_FANCYINDEX_METRIC("rendered_bytes_total",
+                               "Bytes of listings rendered.")
+    "fancyindex_rendered_bytes_total %uA\n"
+    NGX_HTTP_FANCYINDEX_METRIC("phase_seconds_total",
+                               "Time spent in each phase of listings.")
+    "fancyindex_phase_seconds_total{phase=\"read\"} %uA.%03uA\n"
+    "fancyindex_phase_seconds_total{phase=\"sort\"} %uA.%03uA\n"
+    "fancyindex_phase_seconds_total{phase=\"render\"} %uA.%03uA\n";
+
+
+/**
+ * Sends the totals in the Prometheus text format.
+ */
 static ngx_int_t
-ngx_http_fancyindex_error(ngx_http_request_t *r, ngx_dir_t *dir, ngx_str_t *name)
+ngx_http_fancyindex_status_handler(ngx_http_request_t *r)
 {
-    if (ngx_close_dir(dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_dir_n " \"%V\" failed", name);
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_chain_t                      out;
+    ngx_http_fancyindex_status_sh_t *sh;
+    ngx_http_fancyindex_main_conf_t *amcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
     }
 
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-}
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
 
+    amcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+    sh = amcf->status->data;
 
-static void *
-ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf)
-{
-    ngx_http_fancyindex_loc_conf_t  *conf;
+    b = ngx_create_temp_buf(r->pool, sizeof(ngx_http_fancyindex_metrics)
+                                     + 15 * NGX_ATOMIC_T_LEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_loc_conf_t));
-    if (conf == NULL) {
-        return NGX_CONF_ERROR;
+    b->last = ngx_sprintf(b->last, ngx_http_fancyindex_metrics,
+                          sh->requests,
+                          sh->lookups[NGX_HTTP_FANCYINDEX_LOOKUP_HIT],
+                          sh->lookups[NGX_HTTP_FANCYINDEX_LOOKUP_MISS],
+                          sh->lookups[NGX_HTTP_FANCYINDEX_LOOKUP_BYPASS],
+                          sh->lookups[NGX_HTTP_FANCYINDEX_LOOKUP_UPDATING],
+                          sh->scanned, sh->filtered, sh->stat_calls,
+                          sh->bytes,
+                          NGX_HTTP_FANCYINDEX_SECONDS(sh->read_time),
+                          NGX_HTTP_FANCYINDEX_SECONDS(sh->sort_time),
+                          NGX_HTTP_FANCYINDEX_SECONDS(sh->render_time));
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
     }
 
-    /*
-     * Set by ngx_pcalloc:
-     *    conf->header.len       = 0
-     *    conf->header.data      = NULL
-     *    conf->footer.len       = 0
-     *    conf->footer.data      = NULL
-     *    conf->css_href.len     = 0
-     *    conf->css_href.data    = NULL
-     *    conf->time_format.len  = 0
-     *    conf->time_format.data = NULL
-     */
-    conf->enable        = NGX_CONF_UNSET;
-    conf->default_sort  = NGX_CONF_UNSET_UINT;
-    conf->localtime     = NGX_CONF_UNSET;
-    conf->name_length   = NGX_CONF_UNSET_UINT;
-    conf->exact_size    = NGX_CONF_UNSET;
-    conf->ignore        = NGX_CONF_UNSET_PTR;
-    conf->hide_symlinks = NGX_CONF_UNSET;
+    out.buf = b;
+    out.next = NULL;
 
-    return conf;
+    return ngx_http_output_filter(r, &out);
 }
 
 
 static char *
-ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+ngx_http_fancyindex_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_fancyindex_loc_conf_t *prev = parent;
-    ngx_http_fancyindex_loc_conf_t *conf = child;
+    ngx_http_fancyindex_main_conf_t *amcf = conf;
+    ngx_http_core_loc_conf_t        *clcf;
 
-    (void) cf; /* unused */
+    (void) cmd; /* unused */
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 0);
-    ngx_conf_merge_uint_value(conf->default_sort, prev->default_sort, NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME);
-    ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
-    ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
-    ngx_conf_merge_uint_value(conf->name_length, prev->name_length, 50);
+    if (amcf->status == NULL) {
+        amcf->status = ngx_shared_memory_add(cf,
+                                             &ngx_http_fancyindex_status_zone,
+                                             8 * ngx_pagesize,
+                                             &ngx_http_fancyindex_status_zone);
+        if (amcf->status == NULL) {
+            return NGX_CONF_ERROR;
+        }
 
-    ngx_conf_merge_str_value(conf->header, prev->header, "");
-    ngx_conf_merge_str_value(conf->footer, prev->footer, "");
-    ngx_conf_merge_str_value(conf->css_href, prev->css_href, "");
-    ngx_conf_merge_str_value(conf->time_format, prev->time_format, "%Y-%b-%d %H:%M");
+        amcf->status->init = ngx_http_fancyindex_status_init_zone;
+    }
 
-    ngx_conf_merge_ptr_value(conf->ignore, prev->ignore, NULL);
-    ngx_conf_merge_value(conf->hide_symlinks, prev->hide_symlinks, 0);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_fancyindex_status_handler;
 
     return NGX_CONF_OK;
 }
 
 
-static char*
-ngx_http_fancyindex_ignore(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void *
+ngx_http_fancyindex_create_main_conf(ngx_conf_t *cf)
 {
-    ngx_http_fancyindex_loc_conf_t *alcf = conf;
-    ngx_str_t *value;
+    return ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_main_conf_t));
+}
 
-    (void) cmd; /* unused */
 
-#if (NGX_PCRE)
-    ngx_uint_t          i;
-    ngx_regex_elt_t    *re;
-    ngx_regex_compile_t rc;
-    u_char              errstr[NGX_MAX_CONF_ERRSTR];
+static ngx_int_t
+ngx_http_fancyindex_purge_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
 
-    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
-        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
-        if (alcf->ignore == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_purge_dir(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (ngx_delete_dir(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_dir_n " \"%s\" failed", path->data);
     }
 
-    value = cf->args->elts;
+    return NGX_OK;
+}
 
-    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
 
-    rc.err.data = errstr;
-    rc.err.len  = NGX_MAX_CONF_ERRSTR;
-    rc.pool     = cf->pool;
+static ngx_int_t
+ngx_http_fancyindex_purge_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    (void) ctx;  /* unused */
+    (void) path; /* unused */
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        re = ngx_array_push(alcf->ignore);
-        if (re == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    return NGX_OK;
+}
 
-        rc.pattern = value[i];
-        rc.options = NGX_REGEX_CASELESS;
 
-        if (ngx_regex_compile(&rc) != NGX_OK) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
-            return NGX_CONF_ERROR;
+/**
+ * Empties the cache paths whose files all belong to zones which were just
+ * created: nothing refers to them anymore, as zones do not outlive nginx.
+ * Paths which are also used with zones inherited from the previous
+ * configuration are left alone, as are all of them when only testing the
+ * configuration, since a running nginx may be using them.
+ */
+static ngx_int_t
+ngx_http_fancyindex_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i, j, purge;
+    ngx_str_t                        *name;
+    ngx_tree_ctx_t                    tree;
+    ngx_http_fancyindex_cache_t      *cache;
+    ngx_http_fancyindex_cache_use_t  *use;
+    ngx_http_fancyindex_main_conf_t  *amcf;
+
+    if (ngx_test_config || cycle->conf_ctx[ngx_http_module.index] == NULL)
+        return NGX_OK;
+
+    amcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_fancyindex_module);
+    if (amcf->cache_paths == NULL)
+        return NGX_OK;
+
+    use = amcf->cache_paths->elts;
+
+    for (i = 0; i < amcf->cache_paths->nelts; i++) {
+        name = &use[i].cp->path->name;
+
+        /* Uses of a path decide for all of them, the first one purges. */
+        for (purge = 1, j = 0; purge && j < amcf->cache_paths->nelts; j++) {
+            if (use[j].cp->path->name.len != name->len
+                || ngx_strncmp(use[j].cp->path->name.data, name->data,
+                               name->len) != 0)
+            {
+                continue;
+            }
+
+            cache = use[j].zone->data;
+            purge = (j >= i && cache->fresh);
         }
 
-        re->name  = value[i].data;
-        re->regex = rc.regex;
-    }
+        if (!purge)
+            continue;
 
-    return NGX_CONF_OK;
-#else /* !NGX_PCRE */
-    ngx_uint_t i;
-    ngx_str_t *str;
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "removing old fancyindex cache files in \"%V\"", name);
 
-    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
-        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
-        if (alcf->ignore == NULL) {
-            return NGX_CONF_ERROR;
-        }
+        tree.init_handler = NULL;
+        tree.file_handler = ngx_http_fancyindex_purge_file;
+        tree.pre_tree_handler = ngx_http_fancyindex_purge_noop;
+        tree.post_tree_handler = ngx_http_fancyindex_purge_dir;
+        tree.spec_handler = ngx_http_fancyindex_purge_file;
+        tree.data = NULL;
+        tree.alloc = 0;
+        tree.log = cycle->log;
+
+        (void) ngx_walk_tree(&tree, name);
     }
 
-    value = cf->args->elts;
+    return NGX_OK;
+}
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        str = ngx_array_push(alcf->ignore);
-        if (str == NULL) {
-            return NGX_CONF_ERROR;
-        }
 
-        str->data = value[i].data;
-        str->len  = value[i].len;
-    }
+static ngx_int_t
+ngx_http_fancyindex_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_fancyindex_cache_new_epoch(cycle);
+    return NGX_OK;
+}
 
-    return NGX_CONF_OK;
-#endif /* NGX_PCRE */
 
+static void
+ngx_http_fancyindex_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_fancyindex_cache_new_epoch(cycle);
 }
 
 
 static ngx_int_t
 ngx_http_fancyindex_init(ngx_conf_t *cf)
 {
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
+    ngx_http_handler_pt              *h;
+    ngx_http_core_main_conf_t        *cmcf;
+    ngx_http_fancyindex_main_conf_t  *amcf;
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
@@ -1388,6 +9578,18 @@ ngx_http_fancyindex_init(ngx_conf_t *cf)
 
     *h = ngx_http_fancyindex_handler;
 
+    /* Totals are only kept when they can be looked at. */
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    if (amcf->status) {
+        h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        *h = ngx_http_fancyindex_log_handler;
+    }
+
     return NGX_OK;
 }
 
@@ -90,6 +90,160 @@ static const u_char t08_foot1[] = ""
 "</body>"
 "</html>"
 ;
+static const u_char t09_viewer[] = ""
+"<title>Index</title>"
+"</head>"
+"<body>"
+"<h1 id=\"title\">Index</h1>"
+"<p><input type=\"search\" id=\"filter\" placeholder=\"Filter\"/></p>"
+"<table id=\"list\" cellpadding=\"0.1em\" cellspacing=\"0\">"
+"\n"
+"<colgroup>"
+"<col width=\"55%\"/>"
+"<col width=\"20%\"/>"
+"<col width=\"25%\"/>"
+"</colgroup>"
+"\n"
+"<thead>"
+"<tr>"
+"<th><a href=\"#\" data-c=\"N\">File Name</a></th>"
+"<th><a href=\"#\" data-c=\"S\">File Size</a></th>"
+"<th><a href=\"#\" data-c=\"M\">Date</a></th>"
+"</tr>"
+"</thead>"
+"\n"
+"<tbody id=\"rows\"></tbody>"
+"</table>"
+"<p><a href=\"#\" id=\"prev\">&larr;</a> <span id=\"page\"></span> <a href=\"#\" id=\"next\">&rarr;</a></p>"
+"<script type=\"text/javascript\">"
+"(function () {"
+"var size = 100, rows = [], shown = [];"
+"var col = 'N', desc = false, page = 0, i, th;"
+"var keep = /[?&]F=js(&|$)/.test(location.search) ? '?F=js' : '';"
+"var dir = decode(location.pathname);"
+"function el(id) {"
+"return document.getElementById(id);"
+"}"
+"function decode(s) {"
+"try {"
+"return decodeURIComponent(s);"
+"} catch (e) {"
+"return s;"
+"}"
+"}"
+"function unit(n) {"
+"var u = ['B', 'KiB', 'MiB', 'GiB', 'TiB'], i = 0;"
+"while (n >= 1024 && i < 4) {"
+"n /= 1024;"
+"i++;"
+"}"
+"return (i ? n.toFixed(1) : n) + ' ' + u[i];"
+"}"
+"function date(t) {"
+"return new Date(t * 1000).toISOString().substring(0, 16).replace('T', ' ');"
+"}"
+"function cmp(a, b) {"
+"var r = 0;"
+"if (a.d !== b.d) {"
+"return a.d ? -1 : 1;"
+"}"
+"if (col === 'S') {"
+"r = a.s - b.s;"
+"} else if (col === 'M') {"
+"r = a.m - b.m;"
+"}"
+"if (!r) {"
+"r = a.n < b.n ? -1 : a.n > b.n ? 1 : 0;"
+"}"
+"return desc ? -r : r;"
+"}"
+"function cell(tr, node) {"
+"var td = document.createElement('td');"
+"td.appendChild(node);"
+"tr.appendChild(td);"
+"}"
+"function row(href, name, s, m) {"
+"var tr = document.createElement('tr'), a = document.createElement('a');"
+"a.href = href;"
+"a.appendChild(document.createTextNode(name));"
+"cell(tr, a);"
+"cell(tr, document.createTextNode(s));"
+"cell(tr, document.createTextNode(m));"
+"el('rows').appendChild(tr);"
+"}"
+"function show() {"
+"var q = el('filter').value.toLowerCase(), t = el('rows'), last, i, r;"
+"shown = [];"
+"for (i = 0; i < rows.length; i++) {"
+"if (rows[i].n.toLowerCase().indexOf(q) >= 0) {"
+"shown.push(rows[i]);"
+"}"
+"}"
+"shown.sort(cmp);"
+"last = Math.max(0, Math.ceil(shown.length / size) - 1);"
+"page = Math.max(0, Math.min(page, last));"
+"while (t.firstChild) {"
+"t.removeChild(t.firstChild);"
+"}"
+"if (dir !== '/') {"
+"row('../' + keep, 'Parent directory/', '-', '-');"
+"}"
+"for (i = page * size; i < shown.length && i < (page + 1) * size; i++) {"
+"r = shown[i];"
+"row(r.h + (r.d ? keep : ''), r.n, r.d ? '-' : unit(r.s), date(r.m));"
+"}"
+"el('page').textContent = (page + 1) + ' / ' + (last + 1);"
+"}"
+"function load() {"
+"var x = new XMLHttpRequest();"
+"x.open('GET', location.pathname + '?F=plain&per_page=0');"
+"x.onload = function () {"
+"var l = x.responseText.split('\\n'), i, f;"
+"if (x.status === 200) {"
+"for (i = 0; i < l.length; i++) {"
+"if (l[i]) {"
+"f = l[i].split('\\t');"
+"rows.push({ h: f[0], n: decode(f[0]), d: f[1] === '-', s: +f[1], m: +f[2] });"
+"}"
+"}"
+"}"
+"show();"
+"};"
+"x.onerror = show;"
+"x.send();"
+"}"
+"function sorter(c) {"
+"return function () {"
+"desc = col === c ? !desc : false;"
+"col = c;"
+"page = 0;"
+"show();"
+"return false;"
+"};"
+"}"
+"th = el('list').getElementsByTagName('a');"
+"for (i = 0; i < th.length; i++) {"
+"th[i].onclick = sorter(th[i].getAttribute('data-c'));"
+"}"
+"el('prev').onclick = function () {"
+"page--;"
+"show();"
+"return false;"
+"};"
+"el('next').onclick = function () {"
+"page++;"
+"show();"
+"return false;"
+"};"
+"el('filter').oninput = function () {"
+"page = 0;"
+"show();"
+"};"
+"document.title = el('title').textContent = 'Index of ' + dir;"
+"load();"
+"})();"
+"</script>"
+;
 #define NFI_TEMPLATE_SIZE (0 \
 	+ nfi_sizeof_ssz(t01_head1) \
 	+ nfi_sizeof_ssz(t02_head2) \
@@ -100,4 +254,5 @@ static const u_char t08_foot1[] = ""
 	+ nfi_sizeof_ssz(t_parentdir_entry) \
 	+ nfi_sizeof_ssz(t07_list2) \
 	+ nfi_sizeof_ssz(t08_foot1) \
+	+ nfi_sizeof_ssz(t09_viewer) \
 	)